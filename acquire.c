@@ -0,0 +1,544 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * This file implements threaded data acquisition
+ *
+ * acquire_wrap() takes an ordinary DataSrc and returns a DataSrc that calls the original get_data()
+ * from a dedicated thread.  Every sweep is copied into one slot of a single-producer/single-consumer
+ * ring as it comes in; the wrapper's own get_data(), called by animate() on the GTK main thread,
+ * only copies out samples that the acquisition thread has already published.  A slow display
+ * therefore costs us whole sweeps (counted in 'dropped') instead of overrunning the kernel buffers
+ * of the device.
+ *
+ * Every call that can change the capture parameters of the wrapped DataSrc stops the thread first
+ * and restarts it afterwards, so the data sources themselves never see concurrent calls and don't
+ * need any locking.  The only per-sweep global they touch, 'in_progress', is thread local.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include "xoscope.h"
+#include "acquire.h"
+#include "deep.h"
+
+#define ACQ_MAXCHANS 26         /* one for each recall letter */
+
+typedef struct AcqSlot {
+    unsigned int seq;           /* ring position + 1 of the sweep in this slot; 0 if unused */
+    int done;                   /* TRUE once the sweep is complete */
+    int triggered;              /* OR of the get_data() return values during the sweep */
+    int num[ACQ_MAXCHANS];      /* number of samples published so far */
+    int delay[ACQ_MAXCHANS];
+    long long stamp[ACQ_MAXCHANS];
+    short *data[ACQ_MAXCHANS];  /* NULL if nobody listens to the channel */
+} AcqSlot;
+
+static DataSrc wrapper;
+static DataSrc *inner = NULL;
+
+/* The Signals handed out by chan().  Only the main thread ever touches them. */
+static Signal front[ACQ_MAXCHANS];
+static int nfront = 0;
+
+static AcqSlot ring[ACQ_SLOTS];
+static int slotwidth[ACQ_MAXCHANS];
+static unsigned int head = 0;   /* next sweep to be filled; only used by the thread */
+static unsigned int tail = 0;   /* next sweep to be displayed; only written by the main thread */
+static unsigned int showing = 0; /* seq of the sweep currently copied into front[] */
+
+static pthread_t thread;
+static int running = 0;
+static int quit = 0;
+static int notify[2] = {-1, -1};
+static int dropped = 0;         /* sweeps discarded because the ring was full */
+static char dropstr[32];
+static DataSrcStats merged;     /* the wrapped DataSrc's counters, plus our own drops */
+
+/* The acquisition thread.  Calls get_data() whenever the device has something for us and copies
+ * the new samples of the listened-to channels into the ring slot of the current sweep.
+ */
+
+static void * acquire_thread(void *arg)
+{
+    AcqSlot *slot = NULL;       /* slot being filled; NULL if the sweep is discarded */
+    int open = 0;               /* TRUE while a sweep is in progress */
+    int frame, lead, triggered, published, i, j;
+    struct pollfd pfds[DATASRC_MAXFDS];
+    int nfds, interval;
+    Signal *sig, *s;
+
+    /* Follow the frame numbers of the first channel anybody listens to */
+
+    for (lead = 0; lead < nfront && inner->chan(lead)->listeners == 0; lead++);
+    if (lead < nfront) {
+        frame = inner->chan(lead)->frame;
+    } else {
+        lead = -1;
+        frame = 0;
+    }
+
+    while (!__atomic_load_n(&quit, __ATOMIC_ACQUIRE)) {
+
+        /* Data sources that don't give us a descriptor get polled every SND_QUERY_INTERVALL, and
+         * the ones with an interval() that often whether their descriptors are ready or not
+         */
+
+        nfds = datasrc_pollfds(inner, pfds, DATASRC_MAXFDS);
+        interval = datasrc_interval(inner);
+        if ((poll(pfds, nfds, interval ? interval : SND_QUERY_INTERVALL) <= 0)
+            && (nfds > 0) && !interval) {
+            continue;
+        }
+
+        triggered = inner->get_data();
+        if (lead < 0) {
+            continue;
+        }
+        sig = inner->chan(lead);
+        published = 0;
+
+        if (sig->frame != frame) {
+
+            /* A new sweep started; claim a slot for it if the display has left us one. */
+
+            if (open && slot) {
+                __atomic_store_n(&slot->done, 1, __ATOMIC_RELEASE);
+                head ++;
+            }
+            frame = sig->frame;
+            open = 1;
+            slot = NULL;
+            if (head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) < ACQ_SLOTS) {
+                slot = &ring[head % ACQ_SLOTS];
+                slot->done = 0;
+                slot->triggered = 0;
+                for (i = 0; i < nfront; i++) {
+                    slot->num[i] = 0;
+                    slot->delay[i] = inner->chan(i)->delay;
+                    slot->stamp[i] = inner->chan(i)->stamp;
+                }
+                __atomic_store_n(&slot->seq, head + 1, __ATOMIC_RELEASE);
+            } else if (scope.run) {
+                dropped ++;
+            }
+        }
+
+        if (open && slot) {
+            for (i = 0; i < nfront; i++) {
+                s = inner->chan(i);
+                j = slot->num[i];
+                if (slot->data[i] && (s->num > j)) {
+                    memcpy(slot->data[i] + j, s->data + j, (s->num - j) * sizeof(short));
+                    __atomic_store_n(&slot->num[i], s->num, __ATOMIC_RELEASE);
+                    published = 1;
+                }
+            }
+            slot->triggered |= triggered;
+        }
+
+        if (open && !in_progress && (sig->num > 0)) {
+            if (slot) {
+                __atomic_store_n(&slot->done, 1, __ATOMIC_RELEASE);
+                head ++;
+                published = 1;
+            }
+            open = 0;
+            slot = NULL;
+        }
+
+        if (published && (write(notify[1], "", 1) < 0)) {
+            /* pipe full - the display has plenty of wakeups pending already */
+        }
+    }
+
+    /* Hand over whatever we have of an unfinished sweep */
+
+    if (open && slot) {
+        __atomic_store_n(&slot->done, 1, __ATOMIC_RELEASE);
+        head ++;
+    }
+
+    return NULL;
+}
+
+/* Stop the acquisition thread.  Returns TRUE if it was running. */
+
+static int acquire_stop(void)
+{
+    if (!running) {
+        return 0;
+    }
+    __atomic_store_n(&quit, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    running = 0;
+    return 1;
+}
+
+static void acquire_start(void)
+{
+    if (running || (inner == NULL)) {
+        return;
+    }
+    quit = 0;
+    if (pthread_create(&thread, NULL, acquire_thread, NULL) != 0) {
+        perror("pthread_create");
+        return;
+    }
+    running = 1;
+}
+
+/* Copy the descriptive fields of the wrapped Signals into ours */
+
+static void sync_signals(void)
+{
+    int i;
+    Signal *s;
+
+    nfront = min(inner->nchans(), ACQ_MAXCHANS);
+    for (i = 0; i < nfront; i++) {
+        s = inner->chan(i);
+        memcpy(front[i].name, s->name, sizeof(front[i].name));
+        memcpy(front[i].savestr, s->savestr, sizeof(front[i].savestr));
+        front[i].rate = s->rate;
+        front[i].volts = s->volts;
+        front[i].bits = s->bits;
+        front[i].resolution = s->resolution;
+    }
+}
+
+/* Hand our listener counts down to the wrapped DataSrc, so it captures what we display */
+
+static void sync_listeners(void)
+{
+    int i;
+
+    for (i = 0; i < nfront; i++) {
+        inner->chan(i)->listeners = front[i].listeners;
+    }
+}
+
+/* (Re)allocate the sample buffers and empty the ring.  Thread must be stopped. */
+
+static void setup_buffers(void)
+{
+    int i, j, width;
+    Signal *s;
+
+    sync_signals();
+
+    for (i = 0; i < nfront; i++) {
+        s = inner->chan(i);
+        if (front[i].width != s->width) {
+            deep_free(front[i].data);
+            front[i].data = deep_new(short, s->width);
+            front[i].width = s->width;
+        }
+        front[i].num = 0;
+
+        width = (s->listeners > 0) ? s->width : 0;
+        if (slotwidth[i] != width) {
+            for (j = 0; j < ACQ_SLOTS; j++) {
+                deep_free(ring[j].data[i]);
+                ring[j].data[i] = deep_new(short, width);
+            }
+            slotwidth[i] = width;
+        }
+    }
+
+    for (j = 0; j < ACQ_SLOTS; j++) {
+        ring[j].seq = 0;
+    }
+    head = tail = showing = 0;
+    in_progress = 0;
+}
+
+static void free_buffers(void)
+{
+    int i, j;
+
+    for (i = 0; i < ACQ_MAXCHANS; i++) {
+        deep_free(front[i].data);
+        memset(&front[i], 0, sizeof(Signal));
+        for (j = 0; j < ACQ_SLOTS; j++) {
+            deep_free(ring[j].data[i]);
+            ring[j].data[i] = NULL;
+        }
+        slotwidth[i] = 0;
+    }
+    nfront = 0;
+}
+
+static int nchans(void)
+{
+    sync_signals();
+    return nfront;
+}
+
+static Signal * chan(int chan)
+{
+    return (chan >= 0 && chan < nfront) ? &front[chan] : NULL;
+}
+
+static int set_trigger(int chan, int *levelp, int mode)
+{
+    int restart = acquire_stop();
+    int ret = inner->set_trigger(chan, levelp, mode);
+
+    if (restart) acquire_start();
+    return ret;
+}
+
+static void clear_trigger(void)
+{
+    int restart = acquire_stop();
+
+    inner->clear_trigger();
+    if (restart) acquire_start();
+}
+
+static int change_rate(int dir)
+{
+    int restart = acquire_stop();
+    int ret = inner->change_rate(dir);
+
+    sync_signals();
+    if (restart) acquire_start();
+    return ret;
+}
+
+static void set_width(int width)
+{
+    int restart = acquire_stop();
+
+    inner->set_width(width);
+    setup_buffers();
+    if (restart) acquire_start();
+}
+
+static void set_chan_width(int chan, int width)
+{
+    int restart = acquire_stop();
+
+    inner->set_chan_width(chan, width);
+    setup_buffers();
+    if (restart) acquire_start();
+}
+
+static void reset(void)
+{
+    acquire_stop();
+    sync_listeners();
+    inner->reset();
+    setup_buffers();
+    acquire_start();
+}
+
+/* The second generation calls; the thread stays stopped from configure() to start() */
+
+static void configure(void)
+{
+    acquire_stop();
+    sync_listeners();
+    datasrc_configure(inner);
+    sync_signals();
+}
+
+static void start(void)
+{
+    acquire_stop();
+    datasrc_start(inner);
+    setup_buffers();
+    acquire_start();
+}
+
+static void stop(void)
+{
+    acquire_stop();
+    datasrc_stop(inner);
+}
+
+static int fd(void)
+{
+    return running ? notify[0] : -1;
+}
+
+/* Called from animate().  Copies whatever the thread published since the last call into front[]
+ * and, just like the real data sources, returns at the end of every sweep.
+ */
+
+static int get_data(void)
+{
+    AcqSlot *slot = &ring[tail % ACQ_SLOTS];
+    char buf[64];
+    int i, n, done;
+
+    while (read(notify[0], buf, sizeof(buf)) > 0);
+
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != tail + 1) {
+        return 0;               /* thread hasn't started a new sweep yet */
+    }
+
+    if (showing != tail + 1) {
+        showing = tail + 1;
+        for (i = 0; i < nfront; i++) {
+            front[i].num = 0;
+            front[i].frame ++;
+            front[i].delay = slot->delay[i];
+            front[i].stamp = slot->stamp[i];
+        }
+    }
+
+    /* Read 'done' first, so that a finished sweep is guaranteed to be copied completely */
+
+    done = __atomic_load_n(&slot->done, __ATOMIC_ACQUIRE);
+
+    for (i = 0; i < nfront; i++) {
+        if (slot->data[i] == NULL) continue;
+        n = min(__atomic_load_n(&slot->num[i], __ATOMIC_ACQUIRE), front[i].width);
+        if (n > front[i].num) {
+            signal_writable(&front[i], front[i].num);
+            memcpy(front[i].data + front[i].num, slot->data[i] + front[i].num,
+                   (n - front[i].num) * sizeof(short));
+            front[i].num = n;
+            in_progress = n;
+        }
+    }
+
+    if (!done) {
+        if (!in_progress) in_progress = 1;
+        return 0;
+    }
+
+    in_progress = 0;
+    __atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE);
+    return slot->triggered;
+}
+
+/* The counters are read while the acquisition thread may be updating them; being off by one sweep
+ * on the screen does no harm.
+ */
+
+static const DataSrcStats * stats(void)
+{
+    const DataSrcStats *s = inner->stats ? inner->stats() : NULL;
+
+    if (s != NULL) {
+        merged = *s;
+    } else {
+        memset(&merged, 0, sizeof(merged));
+    }
+    merged.dropped += dropped;
+    return &merged;
+}
+
+static const char * status_str(int i)
+{
+    const char *s;
+
+    if ((i >= 6) && (inner->stats != NULL)) {
+        return datasrc_stats_str(stats(), i - 6);
+    }
+
+    s = inner->status_str ? inner->status_str(i) : NULL;
+
+    if ((s == NULL) && (i == 7) && (dropped > 0)) {
+        snprintf(dropstr, sizeof(dropstr), "%d dropped", dropped);
+        s = dropstr;
+    }
+    return s;
+}
+
+static int option1(void)
+{
+    int restart = acquire_stop();
+    int ret = inner->option1();
+
+    sync_signals();
+    if (restart) acquire_start();
+    return ret;
+}
+
+static int option2(void)
+{
+    int restart = acquire_stop();
+    int ret = inner->option2();
+
+    sync_signals();
+    if (restart) acquire_start();
+    return ret;
+}
+
+static int set_option(char *option)
+{
+    int restart = acquire_stop();
+    int ret = inner->set_option(option);
+
+    sync_signals();
+    if (restart) acquire_start();
+    return ret;
+}
+
+/* Wrap a DataSrc so that its get_data() runs in the acquisition thread.  Only one DataSrc can be
+ * wrapped at a time; wrapping another one releases the previous one.  The string, save_option(),
+ * gtk_options() and caps() functions are passed through unchanged, the others are only set if the
+ * wrapped DataSrc provides them, since callers test them for NULL.
+ */
+
+DataSrc * acquire_wrap(DataSrc *src)
+{
+    acquire_release();
+
+    if (notify[0] < 0) {
+        if (pipe(notify) < 0) {
+            perror("pipe");
+            return src;
+        }
+        fcntl(notify[0], F_SETFL, O_NONBLOCK);
+        fcntl(notify[1], F_SETFL, O_NONBLOCK);
+    }
+
+    inner = src;
+    dropped = 0;
+    free_buffers();
+    sync_signals();
+
+    wrapper = *src;
+    wrapper.nchans = nchans;
+    wrapper.chan = chan;
+    wrapper.set_trigger = src->set_trigger ? set_trigger : NULL;
+    wrapper.clear_trigger = src->clear_trigger ? clear_trigger : NULL;
+    wrapper.change_rate = src->change_rate ? change_rate : NULL;
+    wrapper.set_width = src->set_width ? set_width : NULL;
+    wrapper.set_chan_width = src->set_chan_width ? set_chan_width : NULL;
+    wrapper.reset = reset;
+    wrapper.fd = fd;
+    wrapper.get_data = get_data;
+    wrapper.status_str = status_str;
+    wrapper.option1 = src->option1 ? option1 : NULL;
+    wrapper.option2 = src->option2 ? option2 : NULL;
+    wrapper.set_option = src->set_option ? set_option : NULL;
+    wrapper.stats = stats;
+    wrapper.configure = configure;
+    wrapper.start = start;
+    wrapper.stop = stop;
+    wrapper.pollfds = NULL;     /* the display waits on fd(), the thread on the wrapped ones */
+    wrapper.interval = NULL;
+
+    return &wrapper;
+}
+
+/* Stop the thread and detach from the wrapped DataSrc */
+
+void acquire_release(void)
+{
+    acquire_stop();
+    if (inner) {
+        sync_listeners();
+        inner = NULL;
+    }
+}
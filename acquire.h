@@ -0,0 +1,13 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * Prototypes for the threaded acquisition wrapper in acquire.c
+ *
+ */
+
+/* Number of frames that can be queued between the acquisition thread and the display */
+#define ACQ_SLOTS 4
+
+DataSrc *       acquire_wrap(DataSrc *);
+void            acquire_release(void);
@@ -16,9 +16,15 @@
 #include <errno.h>
 #include <stdlib.h>             /* for abs() */
 #include <sys/ioctl.h>
+#include <poll.h>
 #include <alsa/asoundlib.h>
 #include <linux/soundcard.h>
 #include "xoscope.h"            /* program defaults */
+#include "history.h"
+#include "deep.h"
+#include "trigger.h"
+#include "convert.h"
+#include "record.h"
 
 char    alsaDevice[32] = "\0";
 
@@ -26,8 +32,8 @@ char    alsaDevice[32] = "\0";
    * as described below:
    *
    * Step 1:
-   * Determine the peak-peak voltage for a full swing (-128 to +127 steps in 8-bit mode
-   * or -32768 to 32767 steps in 16-bit mode).
+   * Determine the peak-peak voltage for a full swing (-128 to +127 steps with the U8 sample
+   * format, -32768 to 32767 steps with S16 and the wider formats, which we keep 16 bits of).
    * Hint:
    * If you can only measure the rms of a signal, apply a sine wave
    * (e.g. mains voltage via a transformer),then calculate the peak-peak voltage:
@@ -35,8 +41,8 @@ char    alsaDevice[32] = "\0";
    *
    * Step 2:
    * Calculate alsa_volts from the peak-peak voltage:
-   *  8-bit mode: alsa_volts = V[pp] * 1000mV/V * 320 / 255
-   * 16-bit mode: alsa_volts = V[pp] * 1000mV/V * 320 / 65535
+   *  8-bit (U8): alsa_volts = V[pp] * 1000mV/V * 320 / 255
+   * 16-bit and wider: alsa_volts = V[pp] * 1000mV/V * 320 / 65535
    *
    * In case you are curious why we multiply by 320, tThe explanation for the voltage range
    * in comedi.c says:
@@ -56,13 +62,64 @@ snd_pcm_format_t pcm_format = 0;
 static int sc_chans = 0;
 static int sound_card_rate = DEF_R;     /* sampling rate of sound card */
 
-/* Signal structures we're capturing into */
-static Signal left_sig = {"Left Mix", "a"};
-static Signal right_sig = {"Right Mix", "b"};
+/* With sc_use_mmap set, we ask ALSA for mmap access and read the samples straight out of its ring
+ * buffer (see sc_get_data_mmap()).  If the device can't do that, we fall back to snd_pcm_readi().
+ * sc_mmap tells which of the two we ended up with.
+ */
+static int sc_use_mmap = 1;
+static int sc_mmap = 0;
+static int sc_discard = 0;              /* frames to throw away before looking at the data */
+static int bufferSizeFrames = 0;        /* sweep size, see buffer below */
+static snd_pcm_uframes_t sc_period = 0; /* wanted_period() when we opened the card */
+static int sc_stopped = 0;              /* stop() dropped the capture */
+static int sc_tstamp = 0;               /* the card timestamps its pointer on CLOCK_MONOTONIC */
+static long long sc_next_ns = 0;        /* when the next frame we process was captured */
+static DataSrcStats stats;
+
+/* Sample formats we can ask ALSA for, in the order we try them unless the user picks one.  S16
+ * comes first because everything wider still ends up as 16 bits in the Signals.
+ */
+static const struct {
+    const char *name;
+    SampleFormat fmt;
+    snd_pcm_format_t pcm;
+} sc_formats[] = {
+    {"S16", FMT_S16, SND_PCM_FORMAT_S16},
+    {"S32", FMT_S32, SND_PCM_FORMAT_S32},
+    {"S24", FMT_S24, SND_PCM_FORMAT_S24},
+    {"FLOAT", FMT_FLOAT, SND_PCM_FORMAT_FLOAT},
+    {"U8", FMT_U8, SND_PCM_FORMAT_U8},
+};
+#define NFORMATS ((int) (sizeof(sc_formats) / sizeof(sc_formats[0])))
+
+static int sc_want_format = -1;         /* index into sc_formats[], or -1 for the first usable */
+static int sc_format = 0;               /* index into sc_formats[] of the one we got */
+static unsigned int sc_format_mask = 0; /* 1 << SampleFormat of every one the card can do */
+
+/* The usual sound card rates.  When we open the card, we keep the ones it can do in sc_rates[],
+ * for change_rate() to step through.
+ */
+static const int std_rates[] = {
+    8000, 11025, 16000, 22050, 32000, 44100, 48000, 88200, 96000, 176400, 192000, 352800, 384000
+};
+#define NRATES ((int) (sizeof(std_rates) / sizeof(std_rates[0])))
+
+static int sc_rates[NRATES + 2];        /* + the card's own minimum and maximum, if need be */
+static int sc_nrates = 0;
+
+/* Signal structures we're capturing into, one per channel of the card, up to as many as the display
+ * has.  The first two are the usual stereo pair; name_channels() names the rest.
+ */
+#define SC_MAXCHANS CHANNELS
 
-static int trigmode = 0;
-static int triglev;
+static Signal sc_sigs[SC_MAXCHANS] = {{"Left Mix", "a"}, {"Right Mix", "b"}};
+
+/* Everything we read goes through these, for the samples before the trigger */
+static History sc_hist[SC_MAXCHANS];
+
+static Trigger trig;
 static int trigch;
+static int triglev;                     /* trigger level, in 8 bit sample values */
 
 static const char * snd_errormsg1 = NULL;
 static const char * snd_errormsg2 = NULL;
@@ -78,6 +135,8 @@ void alsa_gtk_option_dialog() __attribute__ ((weak));
 static void close_sound_card(void)
 {
     if (handle != NULL) {
+        /* whatever the card still had is lost, and so is everything until it's open again */
+        record_break();
         snd_pcm_drop(handle);
         snd_pcm_hw_free(handle);
         snd_pcm_close(handle);
@@ -86,20 +145,90 @@ static void close_sound_card(void)
     }
 }
 
+/* Fill in sc_rates[] with the rates the card can do, in increasing order: its minimum, the
+ * std_rates[] in between that it accepts, and its maximum.
+ */
+
+static void find_rates(snd_pcm_hw_params_t *params)
+{
+    unsigned int rmin, rmax;
+    int dir = 0;
+    int i;
+
+    sc_nrates = 0;
+    if ((snd_pcm_hw_params_get_rate_min(params, &rmin, &dir) < 0)
+        || (snd_pcm_hw_params_get_rate_max(params, &rmax, &dir) < 0)) {
+        return;
+    }
+
+    if (rmin < std_rates[0]) {
+        sc_rates[sc_nrates++] = rmin;
+    }
+    for (i = 0; i < NRATES; i++) {
+        if ((std_rates[i] >= rmin) && (std_rates[i] <= rmax)
+            && (snd_pcm_hw_params_test_rate(handle, params, std_rates[i], 0) == 0)) {
+            sc_rates[sc_nrates++] = std_rates[i];
+        }
+    }
+    if ((sc_nrates == 0) || (rmax > sc_rates[sc_nrates - 1])) {
+        sc_rates[sc_nrates++] = rmax;
+    }
+}
+
+static void name_channels(void)
+{
+    int i;
+
+    for (i = 2; i < SC_MAXCHANS; i++) {
+        if (sc_sigs[i].name[0] == '\0') {
+            snprintf(sc_sigs[i].name, sizeof(sc_sigs[i].name), "Input %d", i + 1);
+            sc_sigs[i].savestr[0] = 'a' + i;
+            sc_sigs[i].savestr[1] = '\0';
+        }
+    }
+}
+
+/* Frames the card captures in one display update interval */
+
+static snd_pcm_uframes_t interval_frames(void)
+{
+    int intervall_ms = max(scope.min_interval, SND_QUERY_INTERVALL);
+
+    return (sound_card_rate * intervall_ms) / 1000;
+}
+
+/* We wake up (via the descriptors returned by pollfds()) once per period, so make a period one
+ * sweep, but no longer than the display update interval, so that slow sweeps still get drawn as
+ * they come in.
+ */
+
+static snd_pcm_uframes_t wanted_period(void)
+{
+    snd_pcm_uframes_t period = interval_frames();
+
+    if ((bufferSizeFrames > 0) && (bufferSizeFrames < (int) period)) {
+        period = bufferSizeFrames;
+    }
+    return period;
+}
+
 static int open_sound_card(void)
 {
     unsigned int rate = sound_card_rate;
-    unsigned int chan = 2;
+    unsigned int chan = SC_MAXCHANS;
     int rc;
     snd_pcm_hw_params_t *params;
+    snd_pcm_sw_params_t *swparams;
     int dir = 0;
     snd_pcm_uframes_t pcm_frames;
-    int intervall_ms;
+    snd_pcm_uframes_t period;
+    int i;
 
     if (handle != NULL){
         return 1;
     }
 
+    name_channels();
     snd_errormsg1 = NULL;
     snd_errormsg2 = NULL;
 
@@ -124,24 +253,38 @@ static int open_sound_card(void)
 
     /* Set the desired hardware parameters. */
 
-    /* Interleaved mode */
-    rc = snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+    /* Interleaved mode, mmap access if we can get it */
+    sc_mmap = sc_use_mmap &&
+        (snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0);
+    rc = sc_mmap ? 0 : snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
     if (rc < 0) {
         snd_errormsg1 = "snd_pcm_hw_params_set_access() failed ";
         snd_errormsg2 = snd_strerror(rc);
         return 0;
     }
 
-    /* Set and check format, i.e. bits per sample */
-#if SC_16BIT
-    /* Signed 16-bit little-endian format */
-    rc = snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16_LE);
-    pcm_format = SND_PCM_FORMAT_S16_LE;
-#else
-    /* Unsigned 8-bit format */
-    rc = snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_U8);
-    pcm_format = SND_PCM_FORMAT_U8;
-#endif
+    /* Set and check format, i.e. bits per sample - the one the user asked for, or else the first
+     * one in sc_formats[] that the device can do
+     */
+    sc_format_mask = 0;
+    for (i = 0; i < NFORMATS; i++) {
+        if (snd_pcm_hw_params_test_format(handle, params, sc_formats[i].pcm) == 0) {
+            sc_format_mask |= 1 << sc_formats[i].fmt;
+        }
+    }
+    for (i = 0; i < NFORMATS; i++) {
+        if (((sc_want_format < 0) || (sc_want_format == i))
+            && (sc_format_mask & (1 << sc_formats[i].fmt))) {
+            break;
+        }
+    }
+    if (i == NFORMATS) {
+        snd_errormsg1 = (sc_want_format < 0) ? "no usable sample format"
+            : "requested sample format not available";
+        return 0;
+    }
+    sc_format = i;
+    rc = snd_pcm_hw_params_set_format(handle, params, sc_formats[i].pcm);
     if (rc < 0) {
         snd_errormsg1 = "snd_pcm_hw_params_set_format() failed ";
         snd_errormsg2 = snd_strerror(rc);
@@ -154,22 +297,18 @@ static int open_sound_card(void)
         snd_errormsg2 = snd_strerror(rc);
         return 0;
     }
-#if SC_16BIT
-    if (pcm_format != SND_PCM_FORMAT_S16_LE) {
-        snd_errormsg1 = "Can't set 16-bit format (SND_PCM_FORMAT_S16_LE)";
-        return 0;
-    }
-#else
-    if (pcm_format != SND_PCM_FORMAT_U8) {
-        snd_errormsg1 = "Can't set 8-bit format (SND_PCM_FORMAT_U8)";
+    if (pcm_format != sc_formats[sc_format].pcm) {
+        snd_errormsg1 = "Can't set sample format";
         return 0;
     }
-#endif
 
-    /* Two channels (stereo) */
-    rc = snd_pcm_hw_params_set_channels(handle, params, chan);
+    /* As many channels as the card has, up to as many as we can show (usually two, stereo) */
+    if ((snd_pcm_hw_params_get_channels_max(params, &chan) < 0) || (chan > SC_MAXCHANS)) {
+        chan = SC_MAXCHANS;
+    }
+    rc = snd_pcm_hw_params_set_channels_near(handle, params, &chan);
     if (rc < 0) {
-        snd_errormsg1 = "snd_pcm_hw_params_set_channels() failed ";
+        snd_errormsg1 = "snd_pcm_hw_params_set_channels_near() failed ";
         snd_errormsg2 = snd_strerror(rc);
         return 0;
     }
@@ -181,16 +320,15 @@ static int open_sound_card(void)
     }
     sc_chans = chan;
 
+    find_rates(params);
+
+    /* If the card can't do the rate we want, take the closest one it can do */
     rc = snd_pcm_hw_params_set_rate_near(handle, params, &rate, &dir);
     if (rc < 0) {
         snd_errormsg1 = "snd_pcm_hw_params_set_rate_near() failed ";
         snd_errormsg2 = snd_strerror(rc);
         return 0;
     }
-    if (rate != sound_card_rate) {
-        snd_errormsg1 = "requested sample rate not available ";
-        return 0;
-    }
     sound_card_rate = rate;
 
     /* Set period period size (measured in frames).
@@ -199,16 +337,24 @@ static int open_sound_card(void)
      * 
      * sound_card_rate is in Hz, that means we get "sound_card_rate" samples per second.
      * We query for samples at SND_QUERY_INTERVALL or scope.min_interval ms. 
-     * So the frames buffer must hold at least: 
-     *                      (sound_card_rate * interval) / 1000 frames.
+     * So the frames buffer must hold at least interval_frames().
      *
      * As we dont use interrup-style transfer, we could leave it to the alse driver
      * to choose the buffer size. 
      * But to be sure, we set a lower limit of 5 times the minimum value.
      */
-    intervall_ms = 
-            scope.min_interval > SND_QUERY_INTERVALL ? scope.min_interval : SND_QUERY_INTERVALL;
-    pcm_frames = (sound_card_rate * intervall_ms ) / 200;
+    period = sc_period = wanted_period();
+    rc = snd_pcm_hw_params_set_period_size_near(handle, params, &period, &dir);
+    if (rc < 0) {
+        snd_errormsg1 = "snd_pcm_hw_params_set_period_size_near() failed ";
+        snd_errormsg2 = snd_strerror(rc);
+        return 0;
+    }
+
+    pcm_frames = 5 * interval_frames();
+    if (pcm_frames < 4 * period) {
+        pcm_frames = 4 * period;
+    }
     rc = snd_pcm_hw_params_set_buffer_size_min(handle, params, &pcm_frames);
     if (rc < 0) {
         snd_errormsg1 = "snd_pcm_hw_params_set_buffer_size_min() failed ";
@@ -224,12 +370,39 @@ static int open_sound_card(void)
         return 0;
     }
 
+    /* Don't signal the poll descriptor before a whole period is available */
+    snd_pcm_hw_params_get_period_size(params, &period, &dir);
+    snd_pcm_sw_params_alloca(&swparams);
+    snd_pcm_sw_params_current(handle, swparams);
+    snd_pcm_sw_params_set_avail_min(handle, swparams, period);
+
+    /* Have the card timestamp its pointer, on the same clock as ours if it can (alsa-lib 1.0.29) */
+    sc_tstamp = 0;
+#if SND_LIB_VERSION >= 0x01001d
+    sc_tstamp = (snd_pcm_sw_params_set_tstamp_mode(handle, swparams, SND_PCM_TSTAMP_ENABLE) == 0)
+        && (snd_pcm_sw_params_set_tstamp_type(handle, swparams, SND_PCM_TSTAMP_TYPE_MONOTONIC) == 0);
+#endif
+    rc = snd_pcm_sw_params(handle, swparams);
+    if (rc < 0) {
+        snd_errormsg1 = "snd_pcm_sw_params() failed ";
+        snd_errormsg2 = snd_strerror(rc);
+        return 0;
+    }
+
     if ((rc = snd_pcm_prepare (handle)) < 0) {
         snd_errormsg1 = "snd_pcm_prepare() failed ";
         snd_errormsg2 = snd_strerror(rc);
         return 0;
     }
 
+    /* snd_pcm_readi() starts the capture by itself, mmap access doesn't */
+    if (sc_mmap && ((rc = snd_pcm_start(handle)) < 0)) {
+        snd_errormsg1 = "snd_pcm_start() failed ";
+        snd_errormsg2 = snd_strerror(rc);
+        return 0;
+    }
+    sc_stopped = 0;
+
     return 1;
 }
 
@@ -238,7 +411,8 @@ static void reset_sound_card(void)
     static unsigned char *junk = NULL;
 
     if (junk == NULL) {
-        if (!(junk =  malloc((SAMPLESKIP * snd_pcm_format_width(pcm_format) / 8) * 2))) {
+        /* big enough for the widest format */
+        if (!(junk =  malloc(SAMPLESKIP * SC_MAXCHANS * sizeof(int)))) {
             snd_errormsg1 = "malloc() failed " ;
             snd_errormsg2 = strerror(errno);
             return;
@@ -252,7 +426,12 @@ static void reset_sound_card(void)
         if (handle == NULL) {
             return;
         }
-        snd_pcm_readi(handle, junk, SAMPLESKIP);
+        /* the recording already has a gap here, from close_sound_card() */
+        if (sc_mmap) {
+            sc_discard = SAMPLESKIP;
+        } else {
+            snd_pcm_readi(handle, junk, SAMPLESKIP);
+        }
     }
 }
 
@@ -264,59 +443,109 @@ static int sc_nchans(void)
     return (handle != NULL) ? sc_chans : 0;
 }
 
+/* If ALSA gives us descriptors to poll, we can wait for a period to complete instead of having the
+ * main code poll us every SND_QUERY_INTERVALL ms.  Some plugins need more than one, which only
+ * pollfds() can hand out; fd() is for the callers that can only take one.
+ */
+
+static int sc_pollfds(struct pollfd *fds, int nfds)
+{
+    int n;
+
+    if ((handle == NULL) || sc_stopped
+        || ((n = snd_pcm_poll_descriptors_count(handle)) <= 0) || (n > nfds)) {
+        return 0;
+    }
+    return max(snd_pcm_poll_descriptors(handle, fds, n), 0);
+}
+
 static int fd(void)
 {
-    return -1;
+    struct pollfd pfd;
+
+    if ((handle == NULL) || (snd_pcm_poll_descriptors_count(handle) != 1)
+        || (snd_pcm_poll_descriptors(handle, &pfd, 1) != 1)) {
+        return -1;
+    }
+    return pfd.fd;
+}
+
+/* Let ALSA see the poll event, which some plugins need to clear their descriptor */
+
+static void clear_poll_event(void)
+{
+    struct pollfd pfds[DATASRC_MAXFDS];
+    unsigned short revents;
+    int n = sc_pollfds(pfds, DATASRC_MAXFDS);
+
+    if ((n > 0) && (poll(pfds, n, 0) > 0)) {
+        snd_pcm_poll_descriptors_revents(handle, pfds, n, &revents);
+    }
 }
 
 static Signal *sc_chan(int chan)
 {
-    return (chan ? &right_sig : &left_sig);
+    return &sc_sigs[chan];
 }
 
-/* Triggering - we save the trigger level in the raw, unsigned byte values that we read from the
- * sound card
+/* Triggering - we trigger on the converted samples, so the trigger level has to follow the
+ * resolution of the sample format we got
  */
 
+static void scale_trigger(void)
+{
+    trig.level = triglev * SAMPLE_UNIT(&sc_sigs[0]);
+    trig.hyst = scope.trighyst * SAMPLE_UNIT(&sc_sigs[0]);
+    trigger_reset(&trig);
+}
+
 static int set_trigger(int chan, int *levelp, int mode)
 {
     trigch = chan;
-    trigmode = mode;
-    triglev = 127 + *levelp;
-    if (triglev > 255) {
-        triglev = 255;
+    trig.mode = mode;
+    triglev = *levelp;
+    if (triglev > 128) {
+        triglev = 128;
         *levelp = 128;
     }
-    if (triglev < 0) {
-        triglev = 0;
+    if (triglev < -127) {
+        triglev = -127;
         *levelp = -128;
     }
+    scale_trigger();
     return 1;
 }
 
 static void clear_trigger(void)
 {
-    trigmode = 0;
+    trig.mode = 0;
 }
 
+/* Step to the next higher or lower rate the card can do, or through the usual rates if we haven't
+ * been able to ask it yet
+ */
+
 static int change_rate(int dir)
 {
+    const int *rates = sc_nrates ? sc_rates : std_rates;
+    int n = sc_nrates ? sc_nrates : NRATES;
     int newrate = sound_card_rate;
+    int i;
 
     if (dir > 0) {
-        if (sound_card_rate > 16500)
-            newrate = 44100;
-        else if (sound_card_rate > 9500)
-            newrate = 22050;
-        else
-            newrate = 11025;
+        for (i = 0; i < n; i++) {
+            if (rates[i] > sound_card_rate) {
+                newrate = rates[i];
+                break;
+            }
+        }
     } else {
-        if (sound_card_rate < 16500)
-            newrate = 8000;
-        else if (sound_card_rate < 33000)
-            newrate = 11025;
-        else
-            newrate = 22050;
+        for (i = n - 1; i >= 0; i--) {
+            if (rates[i] < sound_card_rate) {
+                newrate = rates[i];
+                break;
+            }
+        }
     }
 
     if (newrate != sound_card_rate) {
@@ -326,25 +555,63 @@ static int change_rate(int dir)
     return 0;
 }
 
-static void reset(void)
+/* configure() reopens the card with the current settings, start() starts a new sweep */
+
+static void configure(void)
 {
+    int i;
+
     reset_sound_card();
 
-    left_sig.rate = sound_card_rate;
-    right_sig.rate = sound_card_rate;
+    for (i = 0; i < SC_MAXCHANS; i++) {
+        sc_sigs[i].rate = sound_card_rate;
+        sc_sigs[i].volts = alsa_volts;
+        sc_sigs[i].resolution = sample_resolution(sc_formats[sc_format].fmt);
+    }
+}
 
-    left_sig.num = 0;
-    left_sig.frame ++;
+static void start(void)
+{
+    int i;
+
+    if ((handle != NULL) && (wanted_period() != sc_period)) {
+        /* the sweep is now shorter than a period (or no longer is), so change the period */
+        reset_sound_card();
+    } else if ((handle != NULL) && sc_stopped) {
+        record_break();
+        snd_pcm_prepare(handle);
+        if (sc_mmap) {
+            snd_pcm_start(handle);
+        }
+    }
+    sc_stopped = 0;
 
-    right_sig.num = 0;
-    right_sig.frame ++;
+    for (i = 0; i < SC_MAXCHANS; i++) {
+        sc_sigs[i].num = 0;
+        sc_sigs[i].frame ++;
 
-    left_sig.volts = alsa_volts;
-    right_sig.volts = alsa_volts;
+        history_clear(&sc_hist[i]);
+    }
+    scale_trigger();
 
     in_progress = 0;
 }
 
+static void stop(void)
+{
+    if (handle != NULL) {
+        record_break();
+        snd_pcm_drop(handle);
+    }
+    sc_stopped = 1;
+}
+
+static void reset(void)
+{
+    configure();
+    start();
+}
+
 /* This is the buffer into wich we read the interleaved data from the soundcard.
  * Interleaved means the data is transfered in individual frames, 
  * where each frame is composed of a single sample from each channel. 
@@ -352,17 +619,18 @@ static void reset(void)
  * The buffer is sized so that the data for a full sweep of the scope fits into it.
  * The number of samples for a full sweep depends on the time base and the sample rate 
  * of the scope.
- * It is stored in bufferSizeFrames (also equal to: left_sig/right_sig.width).
+ * It is stored in bufferSizeFrames (also equal to: sc_sigs[].width).
  * Therfore the size has to be recaluleted and the buffer realocated 
  * when the time base and/or the sample rate changes.
+ * It is sized for the widest sample format and the most channels, so reopening the card with
+ * something else doesn't have to touch it.
+ *
+ * The frames are converted into stage[] (one array per channel, in the 16 bit samples of the
+ * Signals) before we trigger on them.
  */
 
-#if SC_16BIT
-static short *buffer = NULL;
-#else
-static unsigned char *buffer = NULL;
-#endif
-static int  bufferSizeFrames    = 0;    /* The size of the buffer,measured in Frames */
+static char *buffer = NULL;
+static short *stage[SC_MAXCHANS];
 
 /* set_width(int)
  *
@@ -371,209 +639,375 @@ static int  bufferSizeFrames    = 0;    /* The size of the buffer,measured in Fr
 
 static void set_width(int width)
 {
-    left_sig.width = width;
-    right_sig.width = width;
+    int i;
+
     bufferSizeFrames = width;
 
-    if (left_sig.data != NULL) 
-        g_free(left_sig.data);
-    if (right_sig.data != NULL) 
-        g_free(right_sig.data);
-    
-    left_sig.data = g_new0(short, width);
-    right_sig.data = g_new0(short, width);
-    
-#if SC_16BIT
-    if(buffer == NULL)
-        buffer = g_new0(short, width * 2);
-    else
-        buffer = g_renew(short, buffer, width * 2);
-#else
-    if(buffer == NULL)
-        buffer = g_new0(unsigned char, width * 2);
-    else
-        buffer = g_renew(unsigned char, buffer, width * 2);
-#endif
+    for (i = 0; i < SC_MAXCHANS; i++) {
+        sc_sigs[i].width = width;
+        deep_free(sc_sigs[i].data);
+        sc_sigs[i].data = deep_new(short, width);
+
+        history_resize(&sc_hist[i], width);
+        stage[i] = deep_renew(short, stage[i], width);
+    }
+
+    buffer = deep_renew(char, buffer, width * SC_MAXCHANS * sizeof(int));
 }
 
+static int frame_bytes(void)
+{
+    return sc_chans * sample_bytes(sc_formats[sc_format].fmt);
+}
 
-/* get data from ALSA sound system, */
-/* return value is 0 when we wait for a trigger event or on error, otherwise 1 */
-/* in_progress: 0 when we start a new plot, when a plot is in progress, number of samples read. */
+/* Remember 'n' staged frames, starting with frame 'from', in the history */
 
-static int sc_get_data(void)
+static void history_stage(int from, int n)
 {
-    int i, delay;
-    int rdCnt, rdMax;           /* measured in frames ! */
+    int c;
 
-    if (handle == NULL) {
-        return 0;
+    for (c = 0; c < sc_chans; c++) {
+        history_push(&sc_hist[c], stage[c] + from, n);
     }
+}
 
-    rdMax = bufferSizeFrames - in_progress;
-    if (!in_progress) {
-        /* Discard excess samples so we can keep our time snapshot close to real-time and minimize
-         * sound recording overruns.  For ESD we don't know how many are available (do we?) so we
-         * discard them all to start with a fresh buffer that hopefully won't wrap around before we
-         * get it read.
-         */
+/* Remember 'count' frames we've read in the history (only the last ones that fit) */
+
+static void history_frames(const char *frames, int count)
+{
+    int i = max(0, count - bufferSizeFrames);
+
+    deinterleave_short(sc_formats[sc_format].fmt, frames + i * frame_bytes(), sc_chans, count - i,
+                       stage);
+    history_stage(0, count - i);
+}
+
+/* process_frames() - trigger on and copy 'count' interleaved frames into the Signals
+ *
+ * Shared by the read and mmap paths of sc_get_data().  Returns the number of frames used up, which
+ * is less than 'count' only if the sweep ended before the frames did.  Sets *got if any samples
+ * went into the sweep buffer.
+ * in_progress: 0 when we start a new plot, when a plot is in progress, number of samples read.
+ */
 
-        /* read until we get something smaller than a full buffer */
-        while ((rdCnt = snd_pcm_readi(handle, buffer, bufferSizeFrames)) == bufferSizeFrames)
-            ;
-    } 
-    else {
-        rdCnt = snd_pcm_readi(handle, buffer, rdMax);
+static int process_frames(const char *frames, int count, int *got)
+{
+    int i, n, c, delay, pre;
+    int width = sc_sigs[0].width;
+    int first = 0;              /* first frame that goes into the sweep */
+
+    /* convert no more than the rest of the sweep (or a whole one, if we're still looking for the
+     * trigger) at a time; whatever is left over comes back to us on the next call
+     */
+    if (in_progress) {
+        count = min(count, width - in_progress);
     }
+    count = min(count, bufferSizeFrames);
+    deinterleave_short(sc_formats[sc_format].fmt, frames, sc_chans, count, stage);
 
-    if (rdCnt < 0) {
-        if (rdCnt == -EAGAIN) { /* EAGAIN means try again, i.e. no data available */
-            return 0;
+    i = 0;
+    if (!in_progress) {
+        i = trigger_find_s16(&trig, stage[trigch], count, 1);
+
+        if (scope.pretrig) {
+            history_stage(0, i);
         }
-        else if (rdCnt == -EPIPE) { /* EPIPE means overrun */
-            snd_pcm_recover(handle, rdCnt, TRUE);
-            snd_pcm_readi(handle, buffer, rdMax); // flush frame buffer
-            usleep(1000);
-            return sc_get_data();
+
+        if (i >= count) {  /* haven't triggered within the screen */
+             return count; /* give up */
         }
-        else {
-            snd_pcm_recover(handle, rdCnt, TRUE);
-            snd_pcm_readi(handle, buffer, rdMax); // flush frame buffer
-            usleep(1000);
-            return 0;
+
+        /* The sweep starts with the samples that led up to the trigger */
+        pre = pretrigger_samples(width);
+
+        /* The delay value calculated here is only used in on_databox_button_press_event()
+         * But it seems on_databox_button_press_event() isn't associated with anything.
+         * Most likely it was used in the now defunct code for "cursors"
+         */
+        delay = 0;
+
+        for (c = 0; c < sc_chans; c++) {
+            signal_writable(&sc_sigs[c], 0);
+            history_copy(&sc_hist[c], sc_sigs[c].data, pre);
+            sc_sigs[c].delay = delay;
+            sc_sigs[c].frame ++;
+            sc_sigs[c].stamp = stamp_add(sc_next_ns, i - pre, sound_card_rate);
         }
+
+        first = i;
+        in_progress = pre;
+        stats.triggers ++;
     }
 
-    if (rdCnt < 0) {
-        if (rdCnt == -EAGAIN) { /* EAGAIN means try again, i.e. not data available */
-            return 0;
-        }
-        else if (rdCnt == -EPIPE) { /* EPIPE means overrun */
-            snd_pcm_recover(handle, rdCnt, TRUE);
-            snd_pcm_readi(handle, buffer, rdMax); // flush frame buffer
-            usleep(1000);
-            return sc_get_data();
-        }
-        else {
-            snd_pcm_recover(handle, rdCnt, TRUE);
-            snd_pcm_readi(handle, buffer, rdMax); // flush frame buffer
-            usleep(1000);
-            return 0;
+    /* copy as much of the sweep as we have, starting with the trigger frame if we just triggered */
+    n = min(count - i, width - in_progress);
+    for (c = 0; c < sc_chans; c++) {
+        if (n > 0) {
+            signal_writable(&sc_sigs[c], in_progress);
+            memcpy(sc_sigs[c].data + in_progress, stage[c] + i, n * sizeof(short));
         }
+        sc_sigs[c].num = in_progress + max(n, 0);
     }
-    i = 0;
-    if (!in_progress) {
-        int trigger, val, prev, k;
-#if SC_16BIT
-    trigger = (triglev - 127) * 256;
-#else
-    trigger = (triglev - 0);
-#endif
-        if (trigmode == 1) {
-            /* locate rising edges. Try to handle handle noise by looking at the next 10 values.
-             * Might miss a trigger point close to the right edge of the screen
-             */
-#if SC_16BIT
-            prev = SHRT_MAX;
-#else
-            prev = UCHAR_MAX;
-#endif
-            for (i = 0; i < rdCnt; i++) {
-                val = buffer[2*i + trigch];
-                if (val > trigger && prev <= trigger){
-                    int rising = 0;
-                    for(k = i + 1; k < i + 11 && k < rdCnt; k++) {
-                        if(buffer[2*k + trigch] > val){
-                            rising++;
-                        }
-                    }
-                    if(rising > 5){
-                        break;
-                    }
-                }
-                prev = val;
+    if (n > 0) {
+        in_progress += n;
+        i += n;
+    }
+
+    if (scope.pretrig) {
+        history_stage(first, i - first);
+    }
+
+    if (in_progress >= width) { // enough samples for a screen
+        in_progress = 0;
+        stats.delivered ++;
+        /* the search for the next trigger carries on from the end of this sweep */
+        trigger_prime(&trig, stage[trigch][i-1]);
+    }
+    *got = 1;
+    return i;
+}
+
+/* Work out when the next frame we process was captured.  'read' frames we've already taken from the
+ * card come before ALSA's pointer, 'avail' frames are still waiting behind it.  The card's own
+ * timestamp of its pointer is the best guide; without one, the newest frame is taken to be from
+ * right now.
+ */
+
+static void sc_timestamp(snd_pcm_uframes_t read, snd_pcm_uframes_t avail)
+{
+    snd_pcm_uframes_t waiting;
+    snd_htimestamp_t ts;
+
+    if (sc_tstamp && (snd_pcm_htimestamp(handle, &waiting, &ts) == 0)
+        && (ts.tv_sec || ts.tv_nsec)) {
+        sc_next_ns = stamp_add((long long) ts.tv_sec * 1000000000LL + ts.tv_nsec,
+                               -(long long) (read + waiting), sound_card_rate);
+    } else {
+        sc_next_ns = stamp_add(monotonic_ns(), -(long long) (read + avail), sound_card_rate);
+    }
+}
+
+/* skip_stale() while recording: the frames still have to be taken from the card, for the recorder
+ * and the pre-trigger history, but nothing else looks at them.
+ */
+
+static snd_pcm_sframes_t record_stale(snd_pcm_sframes_t avail, snd_pcm_sframes_t skip)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, frames;
+    snd_pcm_sframes_t rc;
+    const char *base;
+
+    sc_timestamp(0, avail);
+
+    while (skip > 0) {
+        frames = min(skip, bufferSizeFrames);
+        if (sc_mmap) {
+            if (snd_pcm_mmap_begin(handle, &areas, &offset, &frames) < 0) {
+                break;
             }
-        }
-        else if(trigmode == 2) {
-            /* same for falling edges */
-            prev = 0;
-#if SC_16BIT
-            prev = SHRT_MIN;
-#else
-            prev = 0;
-#endif
-            for (i = 0; i < rdCnt; i++) {
-                val = buffer[2*i + trigch];
-                if (val < trigger && prev >= trigger){
-                    int falling = 0;
-                    for(k = i + 1; k < i + 11 && k < rdCnt; k++) {
-                        if(buffer[2*k + trigch] < val){
-                            falling++;
-                        }
-                    }
-                    if(falling > 5){
-                        break;
-                    }
-                }
-                prev = val;
+            base = (const char *) areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+            deinterleave_short(sc_formats[sc_format].fmt, base, sc_chans, frames, stage);
+            rc = snd_pcm_mmap_commit(handle, offset, frames);
+        } else {
+            rc = snd_pcm_readi(handle, buffer, frames);
+            if (rc > 0) {
+                deinterleave_short(sc_formats[sc_format].fmt, buffer, sc_chans, rc, stage);
             }
         }
+        if (rc <= 0) {
+            break;
+        }
+        record_frames(stage, sc_chans, rc, sound_card_rate, sc_next_ns);
+        if (scope.pretrig) {
+            history_stage(0, rc);
+        }
+        sc_next_ns = stamp_add(sc_next_ns, rc, sound_card_rate);
+        stats.skipped += rc;
+        avail -= rc;
+        skip -= rc;
+    }
+
+    trigger_reset(&trig);
+    return avail;
+}
+
+/* Throw away all but the last sweep's worth of the 'avail' frames waiting for us.
+ *
+ * snd_pcm_forward() just moves ALSA's pointer past them, which costs the same however far behind
+ * we are.  Only the frames the pre-trigger history can still use get looked at: read here, or left
+ * to the discard in sc_get_data_mmap().  Returns the number of frames still waiting.
+ */
+
+static snd_pcm_sframes_t skip_stale(snd_pcm_sframes_t avail)
+{
+    snd_pcm_sframes_t skip = avail - bufferSizeFrames;
+    snd_pcm_sframes_t keep = 0;
+    snd_pcm_sframes_t rc;
+
+    if (record_active()) {
+        return record_stale(avail, skip);
+    }
+
+    if (scope.pretrig) {
+        keep = min(skip, pretrigger_samples(bufferSizeFrames));
+    }
 
-        if (i >= rdCnt) {  /* haven't triggered within the screen */
-             return 0;     /* give up */
+    rc = snd_pcm_forward(handle, skip - keep);
+    if (rc < 0) {
+        return avail;
+    }
+    avail -= rc;
+    stats.skipped += rc;
+
+    if (keep > 0) {
+        if (sc_mmap) {
+            sc_discard += keep;
+        } else if ((rc = snd_pcm_readi(handle, buffer, keep)) > 0) {
+            history_frames(buffer, rc);
+            avail -= rc;
         }
+    }
 
-        /* The delay value calculated here is only used in on_databox_button_press_event()
-         * But it seems on_databox_button_press_event() isn't associated with anything.
-         * Most likely it was used in the now defunct code for "cursors"
-         */
-        delay = 0;
+    /* the trigger didn't see what we threw away */
+    trigger_reset(&trig);
+    return avail;
+}
 
-#if SC_16BIT
-        left_sig.data[0] = buffer[2*i];
-#else
-        left_sig.data[0] = buffer[2*i] - 127;
-#endif
-        left_sig.delay = delay;
-        left_sig.num = 1;
-        left_sig.frame ++;
+/* An overrun, or any other error, in the mmap version.  A sweep with a hole in it is no use, so
+ * start over, just like the read version does.
+ */
 
-#if SC_16BIT
-        right_sig.data[0] = buffer[2*i + 1];
-#else
-        right_sig.data[0] = buffer[2*i + 1] - 127;
-#endif
-        right_sig.delay = delay;
-        right_sig.num = 1;
-        right_sig.frame ++;
+static void mmap_xrun(int rc)
+{
+    stats.xruns ++;
+    record_break();
+    snd_pcm_recover(handle, rc, TRUE);
+    snd_pcm_start(handle);
+    in_progress = 0;
+    trigger_reset(&trig);
+}
+
+/* get data from ALSA sound system, mmap version */
+/* Works directly on ALSA's ring buffer: snd_pcm_mmap_begin() hands us the next contiguous piece
+ * of it, we trigger on and convert the frames right there and snd_pcm_mmap_commit() what we used.
+ */
 
-        i ++;
-        in_progress = 1;
+static int sc_get_data_mmap(void)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, frames;
+    snd_pcm_sframes_t avail;
+    const char *base;
+    int used, rc;
+    int got = 0;
+
+    avail = snd_pcm_avail_update(handle);
+    if (avail < 0) {
+        mmap_xrun(avail);
+        return 0;
+    }
+
+    if (!in_progress && (avail > bufferSizeFrames)) {
+        /* Discard excess samples so we can keep our time snapshot close to real-time, just like
+         * the read version does
+         */
+        avail = skip_stale(avail);
     }
+    sc_timestamp(0, avail);
+
+    while (avail > 0) {
+        frames = avail;
+        rc = snd_pcm_mmap_begin(handle, &areas, &offset, &frames);
+        if (rc < 0) {
+            mmap_xrun(rc);
+            return got;
+        }
+
+        base = (const char *) areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+        if (sc_discard > 0) {
+            used = min(sc_discard, frames);
+            sc_discard -= used;
+            record_break();
+            if (scope.pretrig) {
+                history_frames(base, used);
+            }
+        } else {
+            used = process_frames(base, frames, &got);
+            record_frames(stage, sc_chans, used, sound_card_rate, sc_next_ns);
+        }
 
-    while (i < rdCnt) {
-        if (in_progress >= left_sig.width) { // enough samples for a screen
+        rc = snd_pcm_mmap_commit(handle, offset, used);
+        if (rc < 0) {
+            mmap_xrun(rc);
+            return got;
+        }
+        avail -= used;
+        sc_next_ns = stamp_add(sc_next_ns, used, sound_card_rate);
+
+        if (got && !in_progress) {      /* end of sweep */
             break;
         }
-#if SC_16BIT
-        left_sig.data[in_progress] = buffer[2*i];
-        right_sig.data[in_progress] = buffer[2*i + 1];
-#else
-        left_sig.data[in_progress] = buffer[2*i] - 127;
-        right_sig.data[in_progress] = buffer[2*i + 1] - 127;
-#endif
+    }
+
+    return got;
+}
+
+/* get data from ALSA sound system, */
+/* return value is 0 when we wait for a trigger event or on error, otherwise 1 */
 
-        in_progress ++;
-        i++;
+static int sc_get_data(void)
+{
+    int rdCnt, rdMax;           /* measured in frames ! */
+    int got = 0;
+
+    if (handle == NULL) {
+        return 0;
     }
 
-    left_sig.num = in_progress;
-    right_sig.num = in_progress;
+    clear_poll_event();
+
+    if (sc_mmap) {
+        return sc_get_data_mmap();
+    }
+
+    rdMax = bufferSizeFrames - in_progress;
+    if (!in_progress) {
+        /* Discard excess samples so we can keep our time snapshot close to real-time and minimize
+         * sound recording overruns.  An error here shows up again in the read below.
+         */
+        snd_pcm_sframes_t avail = snd_pcm_avail(handle);
+
+        if (avail > bufferSizeFrames) {
+            skip_stale(avail);
+        }
+    }
+    rdCnt = snd_pcm_readi(handle, buffer, rdMax);
 
-    if (in_progress >= left_sig.width) { // enough samples for a screen
+    if (rdCnt < 0) {
+        if (rdCnt == -EAGAIN) { /* EAGAIN means try again, i.e. no data available */
+            return 0;
+        }
+        /* EPIPE means overrun; anything else gets the same treatment.  A sweep with a hole in it
+         * is no use, so start over with the next poll() instead of calling ourselves again.
+         */
+        stats.xruns ++;
+        record_break();
+        snd_pcm_recover(handle, rdCnt, TRUE);
+        rdCnt = snd_pcm_readi(handle, buffer, rdMax); // flush frame buffer
+        if (rdCnt > 0) {
+            stats.skipped += rdCnt;
+        }
         in_progress = 0;
+        trigger_reset(&trig);
+        usleep(1000);
+        return 0;
     }
-    return 1;
+
+    sc_timestamp(rdCnt, 0);
+    process_frames(buffer, rdCnt, &got);
+    record_frames(stage, sc_chans, rdCnt, sound_card_rate, sc_next_ns);
+    return got;
 }
 
 static const char * snd_status_str(int i)
@@ -601,19 +1035,57 @@ static const char * snd_status_str(int i)
         } else {
             return "";
         }
+
+    case 6:
+    case 7:
+        return datasrc_stats_str(&stats, i - 6);
     }
     return NULL;
 }
 
-#ifdef DEBUG
-static char * option1str_sc(void)
+static const DataSrcStats * sc_stats(void)
+{
+    return &stats;
+}
+
+static const DataSrcCaps * sc_caps(void)
+{
+    static DataSrcCaps caps;
+
+    caps.formats = sc_format_mask;
+    caps.min_rate = sc_nrates ? sc_rates[0] : 0;
+    caps.max_rate = sc_nrates ? sc_rates[sc_nrates - 1] : 0;
+    caps.hw_trigger = 0;
+    caps.pretrigger = 1;
+    caps.records = 1;
+    return &caps;
+}
+
+/* Option 1 key - sample format: automatic, then each of the ones in sc_formats[] in turn */
+
+static int option1_sc(void)
+{
+    if (++sc_want_format >= NFORMATS) {
+        sc_want_format = -1;
+    }
+    return 1;
+}
+
+static const char * option1str_sc(void)
 {
     static char string[16];
 
-    sprintf(string, "opt1");
+    if (sc_want_format >= 0) {
+        snprintf(string, sizeof(string), "Format %s", sc_formats[sc_want_format].name);
+    } else if (handle != NULL) {
+        snprintf(string, sizeof(string), "auto (%s)", sc_formats[sc_format].name);
+    } else {
+        return "Format auto";
+    }
     return string;
 }
 
+#ifdef DEBUG
 static char * option2str_sc(void)
 {
     static char string[16];
@@ -625,8 +1097,28 @@ static char * option2str_sc(void)
 
 static int sc_set_option(char *option)
 {
+    char name[16];
+    int i;
+
     if (sscanf(option, "rate=%d", &sound_card_rate) == 1) {
         return 1;
+    } else if (sscanf(option, "mmap=%d", &sc_use_mmap) == 1) {
+        close_sound_card();
+        return 1;
+    } else if (sscanf(option, "format=%15s", name) == 1) {
+        if (strcasecmp(name, "auto") == 0) {
+            sc_want_format = -1;
+        } else {
+            for (i = 0; i < NFORMATS; i++) {
+                if (strcasecmp(name, sc_formats[i].name) == 0) break;
+            }
+            if (i == NFORMATS) {
+                return 0;
+            }
+            sc_want_format = i;
+        }
+        close_sound_card();
+        return 1;
     } else if (strcmp(option, "dma=") == 0) {
         /* a deprecated option, return 1 so we don't indicate error */
         return 1;
@@ -644,6 +1136,15 @@ static char * sc_save_option(int i)
         snprintf(buf, sizeof(buf), "rate=%d", sound_card_rate);
         return buf;
 
+    case 1:
+        snprintf(buf, sizeof(buf), "mmap=%d", sc_use_mmap);
+        return buf;
+
+    case 2:
+        snprintf(buf, sizeof(buf), "format=%s",
+                 (sc_want_format < 0) ? "auto" : sc_formats[sc_want_format].name);
+        return buf;
+
     default:
         return NULL;
     }
@@ -658,22 +1159,27 @@ DataSrc datasrc_sc = {
     change_rate,
     set_width,
     reset,
-    fd, //should be REALY unused....
+    fd,
     sc_get_data,
     snd_status_str,
-#ifdef DEBUG
-    NULL,
+    option1_sc,
     option1str_sc,
+#ifdef DEBUG
     NULL,
     option2str_sc,
 #else
-    NULL,  /* option1, */
-    NULL,  /* option1str, */
     NULL,  /* option2, */
     NULL,  /* option2str, */
 #endif
     sc_set_option,
     sc_save_option,
-    NULL  /* gtk_options */
+    NULL, /* gtk_options */
+    sc_stats,
+    configure,
+    start,
+    stop,
+    sc_pollfds,
+    NULL, /* interval */
+    sc_caps
 };
 
@@ -12,6 +12,10 @@
  * (but we don't) implement an "alt mode" - an entire sweep is taken from one channel, then the
  * entire next sweep is taken from the next channel, etc.  Triggering would be a problem.
  *
+ * Slow signals don't need to be kept at the full rate, though.  Each channel can be given a divisor
+ * (the divide= option), and then keeps the average of that many samples instead of all of them, at
+ * its own lower rate and with a sweep that many times narrower.
+ *
  */
 
 #include <stdio.h>
@@ -24,9 +28,14 @@
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <sys/poll.h>
+#include <sys/mman.h>
 #include <comedilib.h>
 #include "xoscope.h"            /* program defaults */
 #include "func.h"
+#include "history.h"
+#include "deep.h"
+#include "trigger.h"
+#include "record.h"
 
 #define COMEDI_RANGE 0          /* XXX user should set this */
 
@@ -65,10 +74,20 @@ int comedi_bufsize = -1;
 static sampl_t buf[BUFSZ];
 static int bufvalid=0;
 
+/* COMEDI's kernel buffer, mmap()ed so get_data() can read the samples in place.  If the mapping
+ * fails (or the mmap option is off), comedi_map stays NULL and we read() into buf[] instead.
+ */
+
+int comedi_use_mmap = 1;
+static char *comedi_map = NULL;
+static int comedi_map_size = 0;
+
 // has to be set later
 int zero_value = -1;
 
 static int lag = 0;                     /* lag - see get_data() */
+static long long next_ns = 0;           /* when the next scan we process was sampled */
+static DataSrcStats stats;
 
 static int subdevice_flags = 0;
 static int subdevice_type = COMEDI_SUBD_UNUSED;
@@ -93,6 +112,26 @@ static struct capture *capture_list = NULL;
 
 static int active_channels=0;
 
+/* capture_list flattened into an array (in scan order) for get_data() */
+
+static Signal *capture_sigs[NCHANS];
+
+/* The rate divisor of each COMEDI channel (see the divide= option; 0 means 1), and for each captured
+ * channel (in scan order) its divisor and the sum and count of the samples it is averaging.
+ */
+
+static int comedi_divide[NCHANS];
+static int capture_div[NCHANS];
+static int capture_acc[NCHANS];
+static int capture_cnt[NCHANS];
+
+/* Recent samples of each captured channel (in scan order), for the part of a sweep that comes
+ * before the trigger.  Cleared whenever the capture restarts, since the old samples no longer lead
+ * up to the new ones.
+ */
+
+static History capture_hist[NCHANS];
+
 static Signal comedi_chans[NCHANS];
 
 /* Triggering information - the (one) channel we're triggering on, the sample level, the type of
@@ -105,6 +144,12 @@ static int trig_level = 0;
 static int trig_mode = 0;
 static int trig_index = -1;
 
+/* The trigger search itself.  It remembers what it has seen between calls, so it can trigger
+ * across buffer boundaries.
+ */
+
+static Trigger trig;
+
 /* This function is defined as do-nothing and weak, meaning it can be overridden by the linker
  * without error.  It's used to start the X Windows GTK options dialog for COMEDI, and is defined in
  * this way so that this object file can be used either with or without GTK.  If this causes
@@ -122,11 +167,55 @@ void comedi_gtk_options() {}
 
 static void stop_comedi_running(void)
 {
+    int i;
+
     if (comedi_running) {
         comedi_cancel(comedi_dev, 0);
         comedi_running = 0;
     }
+    record_break();
     bufvalid = 0;
+    trigger_reset(&trig);
+    for (i = 0; i < NCHANS; i++) {
+        history_clear(&capture_hist[i]);
+        capture_acc[i] = capture_cnt[i] = 0;
+    }
+}
+
+static void unmap_comedi_buffer(void)
+{
+    if (comedi_map) {
+        munmap(comedi_map, comedi_map_size);
+        comedi_map = NULL;
+        comedi_map_size = 0;
+    }
+}
+
+/* Map COMEDI's kernel buffer, unless it's already mapped at its current size.  Failure isn't an
+ * error; get_data() just falls back to read().
+ */
+
+static void map_comedi_buffer(void)
+{
+    int size;
+
+    if (!comedi_use_mmap) {
+        unmap_comedi_buffer();
+        return;
+    }
+
+    size = comedi_get_buffer_size(comedi_dev, comedi_subdevice);
+    if (comedi_map && (size == comedi_map_size)) return;
+
+    unmap_comedi_buffer();
+    if (size <= 0) return;
+
+    comedi_map = mmap(NULL, size, PROT_READ, MAP_SHARED, comedi_fileno(comedi_dev), 0);
+    if (comedi_map == MAP_FAILED) {
+        comedi_map = NULL;
+        return;
+    }
+    comedi_map_size = size;
 }
 
 /* XXX This function should make sure the Signal arrays are reset to sane values.  Right now, it
@@ -167,6 +256,8 @@ static int start_comedi_running(void)
          * bug, but that requires <asm/page.h> to be present on the system.  Easier is to just skip
          * setting buffer size on pre-0.7.73 comedi.
          */
+        /* COMEDI refuses to resize a buffer that is mapped */
+        unmap_comedi_buffer();
         ret = comedi_set_buffer_size(comedi_dev, comedi_subdevice, comedi_bufsize);
         if (ret < 0) {
             comedi_error = comedi_errno();
@@ -318,7 +409,8 @@ static int start_comedi_running(void)
      * to get millivolts per 320 sample values.  320 is the size of the vertical display area, in
      * case you wondered.
      *
-     * Also, set the rate (samples/sec) at which we'll capture data
+     * Also, set the rate (samples/sec) at which we'll capture data, divided down for the channels
+     * that only keep every so many samples
      */
 
     for (capture = capture_list; capture != NULL; capture = capture->next) {
@@ -363,7 +455,7 @@ static int start_comedi_running(void)
 
         }
 
-        capture->signal->rate = comedi_rate;
+        capture->signal->rate = max(1, comedi_rate / max(1, comedi_divide[capture->chan]));
     }
 
 #if 0
@@ -374,6 +466,7 @@ static int start_comedi_running(void)
     ret = comedi_command(comedi_dev,&cmd);
     if (ret >= 0) {
         fcntl(comedi_fileno(comedi_dev), F_SETFL, O_NONBLOCK);
+        map_comedi_buffer();
         comedi_running = 1;
     } else {
         comedi_error = comedi_errno();
@@ -387,6 +480,7 @@ static void close_comedi()
     struct capture *capture;
 #endif
 
+    unmap_comedi_buffer();
     if (comedi_dev) comedi_close(comedi_dev);
     comedi_dev = NULL;
     if (comedi_board_name) g_free(comedi_board_name);
@@ -609,6 +703,8 @@ static void reset(void)
             capture->chan = i;
             capture->signal = &comedi_chans[i];
             capture->next = NULL;
+            capture_sigs[active_channels] = &comedi_chans[i];
+            capture_div[active_channels] = max(1, comedi_divide[i]);
             *capture_ptr = capture;
             capture_ptr = &capture->next;
 
@@ -634,6 +730,7 @@ static int set_trigger(int chan, int *levelp, int mode)
     trig_chan = chan;
     trig_level = *levelp;
     trig_mode = mode;
+    trig.hyst = scope.trighyst;
     /* XXX check that trig_level is within subdevice's range */
     return 1;
 }
@@ -676,11 +773,26 @@ static void set_width(int width)
 
     for (i=0; i<NCHANS; i++) {
         comedi_chans[i].width = width;
-        if (comedi_chans[i].data != NULL) free(comedi_chans[i].data);
-        comedi_chans[i].data = malloc(width * sizeof(short));
+        deep_free(comedi_chans[i].data);
+        comedi_chans[i].data = deep_new(short, width);
+        history_resize(&capture_hist[i], width);
     }
 }
 
+/* set_chan_width(int, int)
+ *
+ * sets the frame width of one channel, since the channels with a divisor need fewer samples to
+ * cover the same time.
+ */
+
+static void set_chan_width(int chan, int width)
+{
+    comedi_chans[chan].width = width;
+    deep_free(comedi_chans[chan].data);
+    comedi_chans[chan].data = deep_new(short, width);
+    history_resize(&capture_hist[chan], width);
+}
+
 /* get_data() -
  * read all available data from comedi device, return value is TRUE if we actually put some samples
  * into the sweep buffer (and thus need a redisplay)
@@ -690,33 +802,231 @@ static void set_width(int width)
 
 #define convert(sample) (sample - zero_value)
 
-static int get_data(void)
+/* take_scans() - deinterleave 'nscans' scans starting at 'scans'
+ *
+ * Channels without a divisor keep every sample, the others the average of each 'divide' of them.
+ * The samples go into the per-channel histories if the sweep has a pretrigger, and into the sweep
+ * if 'sweep' is TRUE and the channel's part of it isn't full yet.  Without 'sweep', only the last
+ * history_size() samples can matter, so whole divisions of the scans before those are skipped.
+ */
+
+static void take_scans(sampl_t *scans, int nscans, int sweep)
 {
-    int bytes_read;
-    int samples_read;
-    int scans_read;
-    int samples_per_frame;
-    sampl_t *current_scan, *last_scan;
-    int i, j;
-    int delay;
-    int triggered=0;
-    int was_in_sweep=in_progress;
-    static struct timeval tv1, tv2;
-    struct capture *capture;
+    Signal *sig;
+    sampl_t *in;
+    int i, j, d, value;
+
+    for (j = 0; j < active_channels; j++) {
+        sig = capture_sigs[j];
+        d = capture_div[j];
+        in = scans + j;
+        if (sweep) {
+            signal_writable(sig, sig->num);
+        }
 
-    /* This code used to try and start COMEDI running if it wasn't running already.  But if fd()
-     * already returned -1, the main code doesn't think we're running, so it's best to leave things
-     * alone here...
-     */
+        i = 0;
+        if (!sweep) {
+            i = max(0, nscans - history_size(&capture_hist[j]) * d);
+            i -= i % d;
+        }
 
-    if (! comedi_dev || ! comedi_running) return 0;
+        for (; i < nscans; i++) {
+            value = convert(in[i * active_channels]);
+            if (d > 1) {
+                capture_acc[j] += value;
+                if (++capture_cnt[j] < d) continue;
+                value = capture_acc[j] / d;
+                capture_acc[j] = capture_cnt[j] = 0;
+            }
+            if (scope.pretrig) {
+                history_put(&capture_hist[j], value);
+            }
+            if (sweep && (sig->num < sig->width)) {
+                sig->data[sig->num++] = value;
+            }
+        }
+    }
+}
+
+/* Hand 'nscans' scans starting at 'scans' to the recorder: every sample of every captured channel,
+ * at the full rate, whatever the divisors are.
+ */
+
+static void record_scans(sampl_t *scans, int nscans)
+{
+    static short block[NCHANS][4096];
+    short *stage[NCHANS];
+    long long stamp = next_ns;
+    int i, j, n;
+
+    if (!record_active())
+        return;
+
+    for (j = 0; j < active_channels; j++) {
+        stage[j] = block[j];
+    }
+    while (nscans > 0) {
+        n = min(nscans, 4096);
+        for (i = 0; i < n; i++) {
+            for (j = 0; j < active_channels; j++) {
+                block[j][i] = convert(scans[i * active_channels + j]);
+            }
+        }
+        record_frames(stage, active_channels, n, comedi_rate, stamp);
+        stamp = stamp_add(stamp, n, comedi_rate);
+        scans += n * active_channels;
+        nscans -= n;
+    }
+}
 
-    /* The way the code's written right now, all the channels are sampled at the same rate and for
-     * the same width (number of samples per frame), so we just use the width from the first channel
-     * in the capture list to figure how many samples we're capturing.
+/* Scans still needed to fill every listened-to channel's part of the sweep.  A channel that is
+ * only captured for the trigger doesn't get its width set, so it only counts if it's all we have.
+ */
+
+static int scans_left(void)
+{
+    int j, n;
+    int left = 0, left_all = 0, listened = 0;
+
+    for (j = 0; j < active_channels; j++) {
+        n = (capture_sigs[j]->width - capture_sigs[j]->num) * capture_div[j] - capture_cnt[j];
+        left_all = max(left_all, n);
+        if (capture_sigs[j]->listeners > 0) {
+            left = max(left, n);
+            listened = 1;
+        }
+    }
+    return listened ? left : left_all;
+}
+
+/* process_scans() - trigger on and deinterleave 'nscans' complete scans starting at 'scans'
+ *
+ * Shared by the mmap and read() paths of get_data().  Returns the number of scans consumed, which
+ * is less than 'nscans' only if a sweep that was already in progress when get_data() was called
+ * has ended, and get_data() should return now.  The trigger search keeps its state between calls,
+ * so that we don't miss a trigger that happens to straddle two calls.
+ */
+
+static int process_scans(sampl_t *scans, int nscans, int was_in_sweep, int *triggered)
+{
+    int i = 0, j, n;
+    int delay, pre, start;
+
+    /* All the channels are sampled at the same rate, but the ones with a divisor keep fewer of the
+     * samples, so a sweep ends when every channel has its width of them.
      */
 
-    samples_per_frame = capture_list->signal->width;
+    while (i < nscans) {
+
+        if (!in_progress) {
+
+            if (!scope.run) {
+                i = nscans;
+                break;
+            }
+
+            /* Sweep isn't in_progress, so look for a trigger - anything (trig_mode==0) or a
+             * transition between the last sample and the current one that crossed the trig_level
+             * threshold, either going positive (trig_mode==1) or going negative (trig_mode==2).
+             */
+
+            start = i;
+
+            if (trig_mode != 0 && trig_index >= 0) {
+                trig.mode = trig_mode;
+                trig.level = trig_level + zero_value;
+                i += trigger_find_u16(&trig, scans + i * active_channels + trig_index, nscans - i,
+                                      active_channels);
+            }
+
+            if (scope.pretrig) {
+                take_scans(scans + start * active_channels, i - start, 0);
+            }
+
+            if (i == nscans) break;
+
+            /* found something to trigger on, so compute a delay value based on extrapolating a
+             * straight line between the two sample values that straddle the triggering point, for
+             * high-frequency signals that change significantly between the two samples.  Set up
+             * all the relevent Signal structures, then fall through into the triggered case below
+             */
+
+            delay = 0;
+
+            if (trig_mode != 0) {
+                short current = convert(scans[i * active_channels + trig_index]);
+                short last = convert(trig.before);
+                if (current != last) {
+                    delay = abs(10000 * (current - trig_level) / (current - last));
+                }
+            }
+
+            /* The sweep starts with the samples that led up to the trigger.  Without those, the
+             * averages of the divided channels start afresh at the trigger.
+             */
+
+            for (j = 0; j < active_channels; j++) {
+                pre = pretrigger_samples(capture_sigs[j]->width);
+                signal_writable(capture_sigs[j], 0);
+                history_copy(&capture_hist[j], capture_sigs[j]->data, pre);
+                capture_sigs[j]->frame ++;
+                capture_sigs[j]->delay = delay / capture_div[j];
+                capture_sigs[j]->stamp = stamp_add(next_ns, i - pre * capture_div[j], comedi_rate);
+                capture_sigs[j]->num = pre;
+                if (!scope.pretrig) {
+                    capture_acc[j] = capture_cnt[j] = 0;
+                }
+            }
+
+            in_progress = 1;
+            stats.triggers ++;
+        }
+
+        /* Sweep in progress - deinterleave as many scans as it still needs, one channel at a time */
+
+        n = min(nscans - i, scans_left());
+
+        take_scans(scans + i * active_channels, n, 1);
+
+        i += n;
+        in_progress = (scans_left() > 0);
+
+        /* the next trigger search carries on from here */
+        if (trig_index >= 0) {
+            trigger_prime(&trig, scans[(i - 1) * active_channels + trig_index]);
+        }
+        *triggered = 1;
+
+        if (!in_progress) {
+
+            stats.delivered ++;
+
+            /* If we were in the middle of a sweep when we entered get_data(), return now.
+             * Otherwise, keep looking for more sweeps.
+             */
+
+            if (was_in_sweep) break;
+        }
+    }
+
+    record_scans(scans, i);
+    next_ns = stamp_add(next_ns, i, comedi_rate);
+    return i;
+}
+
+/* Read path - read() the data into buf[].  It would be nice if COMEDI never returned a partial
+ * scan to a read() call.  Unfortunately, it often does, so we need to tuck the "extra" data away
+ * until the next time through the loop...
+ *
+ * Returns TRUE if a sweep ended and get_data() should return, -1 on a read error, else FALSE.
+ */
+
+static int read_scans(int was_in_sweep, int *triggered)
+{
+    int scan_bytes = active_channels * sizeof(sampl_t);
+    int bytes_read;
+    int scans_read;
+    int used;
 
     /* It is possible for this loop to be entered with a full buffer of data already (bufvalid ==
      * sizeof(buf)).  In that case, the read will be called with a zero byte buffer size, and will
@@ -726,13 +1036,8 @@ static int get_data(void)
                               ((char *)buf) + bufvalid, sizeof(buf) - bufvalid))
            >= 0) {
 
-        // fprintf(stderr, "bytes_read=%d; bufvalid=%d\n", bytes_read, bufvalid);
-
         bytes_read += bufvalid;
-
-        gettimeofday(&tv1, NULL);
-        samples_read = bytes_read / sizeof(sampl_t);
-        scans_read = samples_read / active_channels;
+        scans_read = bytes_read / scan_bytes;
 
         /* This is here to catch the case when there's nothing (or not much) in the buffer, and the
          * read() call returned nothing.
@@ -740,112 +1045,101 @@ static int get_data(void)
 
         if (scans_read == 0 && bytes_read == 0) break;
 
-        for (i = 0; i < scans_read; i++) {
-
-            current_scan = buf + i * active_channels;
-
-            if (!in_progress && scope.run && i>0) {
-
-                /* Sweep isn't in_progress, so look for a trigger - anything (trig_mode==0) or a
-                 * transition between the last sample and the current one that crossed the
-                 * trig_level threshold, either going positive (trig_mode==1) or going negative
-                 * (trig_mode==2).  Since we check the previous sample, there's an "i>0" case in the
-                 * above if statement, and that does mean that we'll miss a trigger if the
-                 * transition exactly corresponds with a read buffer boundary.
-                 */
-
-                last_scan = buf + (i-1) * active_channels;
-
-                if ((trig_mode == 0) ||
-                    ((trig_mode == 1) &&
-                     (convert(current_scan[trig_index]) >= trig_level) &&
-                     (convert(last_scan[trig_index]) < trig_level)) ||
-                    ((trig_mode == 2) &&
-                     (convert(current_scan[trig_index]) <= trig_level) &&
-                     (convert(last_scan[trig_index]) > trig_level))) {
-
-                    /* found something to trigger on, so compute a delay value based on
-                     * extrapolating a straight line between the two sample values that straddle the
-                     * triggering point, for high-frequency signals that change significantly
-                     * between the two samples.  Set up all the relevent Signal structures, then
-                     * fall through into the triggered case below
-                     */
-
-                    delay = 0;
-
-                    if (trig_mode != 0) {
-                        short current = convert(current_scan[trig_index]);
-                        short last = convert(last_scan[trig_index]);
-                        if (current != last) {
-                            delay = abs(10000 * (current - trig_level) / (current - last));
-                        }
-                    }
+        used = process_scans(buf, scans_read, was_in_sweep, triggered);
 
-                    for (j=0, capture=capture_list;
-                         capture != NULL; capture=capture->next, j++) {
-                        capture->signal->frame ++;
-                        capture->signal->delay = delay;
-                        capture->signal->num = 0;
-                    }
-                    if (j != active_channels) {
-                        fprintf(stderr, "ERROR!   j != active_channels in get_data()\n");
-                    }
+        bufvalid = bytes_read - used * scan_bytes;
+        if (bufvalid) {
+            memmove(buf, (char *) buf + bytes_read - bufvalid, bufvalid);
+        }
+
+        if (used < scans_read) return 1;
+    }
 
-                    in_progress = 1;
+    return ((bytes_read < 0) && (errno != EAGAIN)) ? -1 : 0;
+}
 
-                }
-            }
+/* mmap path - deinterleave straight out of COMEDI's kernel buffer, without any copies.  The buffer
+ * size is a multiple of the page size, not of the scan size, so a scan can wrap around the end of
+ * the buffer; that one scan gets reassembled in a small buffer on the stack.
+ *
+ * Returns TRUE if a sweep ended and get_data() should return, -1 on an error, else FALSE.
+ */
 
-            if (in_progress) {
+static int mmap_scans(int was_in_sweep, int *triggered)
+{
+    int scan_bytes = active_channels * sizeof(sampl_t);
+    int avail, offset, contig;
+    int nscans, used;
+    sampl_t wrapped[NCHANS];
 
-                /* Sweep in progress */
+    while ((avail = comedi_get_buffer_contents(comedi_dev, comedi_subdevice)) >= scan_bytes) {
 
-                for (j=0, capture=capture_list; capture != NULL; capture=capture->next, j++) {
-                    capture->signal->data[capture->signal->num ++] = convert(current_scan[j]);
-                    in_progress = capture->signal->num;
-                }
-                if (j != active_channels) {
-                    fprintf(stderr, "ERROR!   j != active_channels in get_data()\n");
-                }
+        offset = comedi_get_buffer_offset(comedi_dev, comedi_subdevice);
+        contig = comedi_map_size - offset;
 
-                triggered = 1;
+        if (contig >= scan_bytes) {
+            nscans = min(avail, contig) / scan_bytes;
+            used = process_scans((sampl_t *) (comedi_map + offset), nscans, was_in_sweep, triggered);
+        } else {
+            memcpy(wrapped, comedi_map + offset, contig);
+            memcpy((char *) wrapped + contig, comedi_map, scan_bytes - contig);
+            nscans = 1;
+            used = process_scans(wrapped, 1, was_in_sweep, triggered);
+        }
 
-                if (in_progress >= samples_per_frame) {
+        if (comedi_mark_buffer_read(comedi_dev, comedi_subdevice, used * scan_bytes) < 0) {
+            return -1;
+        }
 
-                    in_progress = 0;
+        if (used < nscans) return 1;
+    }
 
-                    /* If we were in the middle of a sweep when we entered this function, return
-                     * now.  Otherwise, keep looking for more sweeps.
-                     */
+    return (avail < 0) ? -1 : 0;
+}
 
-                    if (was_in_sweep) {
+static int get_data(void)
+{
+    int ret, queued;
+    int triggered=0;
+    int was_in_sweep=in_progress;
+    unsigned long delivered = stats.delivered;
+    static struct timeval tv1, tv2;
 
-                        bufvalid = bytes_read - (i * active_channels * sizeof(sampl_t));
-                        if (bufvalid) {
-                            memcpy(buf, (char *) buf + bytes_read - bufvalid, bufvalid);
-                        }
+    /* This code used to try and start COMEDI running if it wasn't running already.  But if fd()
+     * already returned -1, the main code doesn't think we're running, so it's best to leave things
+     * alone here...
+     */
 
-                        lag = 0;
-                        return triggered;
-                    }
-                }
+    if (! comedi_dev || ! comedi_running) return 0;
 
-            }
-        }
+    /* The newest scan in COMEDI's buffer is taken to be from now, and the ones we have left over
+     * in buf[] come before all of those
+     */
 
-        /* It would be nice if COMEDI never returned a partial scan to a read() call.
-         * Unfortunately, it often does, so we need to tuck the "extra" data away until the next
-         * time through this loop...
-         */
+    queued = (max(0, comedi_get_buffer_contents(comedi_dev, comedi_subdevice)) + bufvalid)
+        / (int) (active_channels * sizeof(sampl_t));
+    next_ns = stamp_add(monotonic_ns(), -queued, comedi_rate);
 
-        bufvalid = bytes_read - (scans_read * active_channels * sizeof(sampl_t));
-        if (bufvalid) {
-            memcpy(buf, (char *) buf + bytes_read - bufvalid, bufvalid);
-        }
+    if (comedi_map) {
+        ret = mmap_scans(was_in_sweep, &triggered);
+    } else {
+        ret = read_scans(was_in_sweep, &triggered);
+    }
+
+    /* Only the last sweep completed here gets displayed, and not even that one if another has
+     * started on top of it
+     */
+    if (stats.delivered - delivered > 0) {
+        stats.dropped += stats.delivered - delivered - (in_progress ? 0 : 1);
+    }
 
+    if (ret > 0) {
+        lag = 0;
+        gettimeofday(&tv1, NULL);
+        return triggered;
     }
 
-    if ((bytes_read < 0) && (errno != EAGAIN)) {
+    if (ret < 0) {
 
         /* The most common cause of a COMEDI read error is a buffer overflow.  There are all kinds
          * of ways to do it, from hitting space to stop the scope trace to dragging a window while
@@ -864,13 +1158,17 @@ static int get_data(void)
 
         if (errno != EINVAL && errno != EPIPE) perror("comedi read");
 
+        stats.xruns ++;
+        record_break();
         start_comedi_running();
         bufvalid = 0;
+        trigger_reset(&trig);
         gettimeofday(&tv2, NULL);
         lag = 1000000*(tv2.tv_sec-tv1.tv_sec) + tv2.tv_usec - tv1.tv_usec;
         return 0;
     }
 
+    gettimeofday(&tv1, NULL);
     lag = 0;
     return triggered;
 }
@@ -910,8 +1208,10 @@ static const char * status_str(int i)
             return split_field(error, 0, 16);
         } else if (lag > 1000) {
             snprintf(buffer, sizeof(buffer), "%d ms lag", lag/1000);
+            return buffer;
         } else if (lag > 0) {
             snprintf(buffer, sizeof(buffer), "%d \302\265s lag", lag);
+            return buffer;
         } else {
             return "";
         }
@@ -922,11 +1222,19 @@ static const char * status_str(int i)
             return "";
         }
 
+    case 6:
+    case 7:
+        return datasrc_stats_str(&stats, i - 6);
+
     default:
         return NULL;
     }
 }
 
+static const DataSrcStats * comedi_stats(void)
+{
+    return &stats;
+}
 
 /* Option 1 key - global analog reference toggle
  *
@@ -994,6 +1302,8 @@ static int comedi_set_option(char *option)
 {
     char buf[256];
     char *p = buf;
+    char chan;
+    int divide;
 
     do {
         *p++ = tolower(*option);
@@ -1025,6 +1335,14 @@ static int comedi_set_option(char *option)
     } else if (sscanf(buf, "bufsize=%d", &comedi_bufsize) == 1) {
         reset_comedi();
         return 1;
+    } else if (sscanf(buf, "mmap=%d", &comedi_use_mmap) == 1) {
+        reset_comedi();
+        return 1;
+    } else if ((sscanf(buf, "divide=%c:%d", &chan, &divide) == 2)
+               && (chan >= 'a') && (chan < 'a' + NCHANS) && (divide >= 1)) {
+        comedi_divide[chan - 'a'] = divide;
+        reset_comedi();
+        return 1;
     } else {
         return 0;
     }
@@ -1067,8 +1385,19 @@ static char * comedi_save_option(int i)
             return "bufsize=default";
         }
 
+    case 5:
+        snprintf(buf, sizeof(buf), "mmap=%d", comedi_use_mmap);
+        return buf;
+
     default:
-        return NULL;
+        if (i - 6 >= NCHANS) {
+            return NULL;
+        } else if (comedi_divide[i - 6] > 1) {
+            snprintf(buf, sizeof(buf), "divide=%c:%d", 'a' + i - 6, comedi_divide[i - 6]);
+            return buf;
+        } else {
+            return "";
+        }
     }
 }
 
@@ -1096,4 +1425,12 @@ DataSrc datasrc_comedi = {
     comedi_set_option,
     comedi_save_option,
     comedi_gtk_options,
+    comedi_stats,
+    NULL,  /* configure */
+    NULL,  /* start */
+    NULL,  /* stop */
+    NULL,  /* pollfds */
+    NULL,  /* interval */
+    NULL,  /* caps */
+    set_chan_width,
 };
@@ -0,0 +1,354 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * This file implements the sample format conversions for the sound card data sources
+ *
+ * Sound devices hand us blocks of interleaved frames.  Rather than convert them a sample at a time
+ * as they go into the sweep, the data sources split each block into the per-channel sweep arrays
+ * with one call here.  Mono and stereo blocks (which is what we nearly always get) are done a
+ * vector at a time with SSE2 where we have it, and so are the 16 and 32 bit formats with a multiple
+ * of four channels (multichannel interfaces), by transposing eight frames at a time; everything
+ * else takes the plain loops.
+ *
+ */
+
+#include <string.h>
+#include <limits.h>
+#include "convert.h"
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define HAVE_SSE2_CONVERT 1
+#include <emmintrin.h>
+#endif
+
+int sample_bytes(SampleFormat fmt)
+{
+    switch (fmt) {
+    case FMT_U8:
+        return 1;
+    case FMT_S16:
+        return 2;
+    default:
+        return 4;
+    }
+}
+
+/* Bits per sample in the short arrays deinterleave_short() makes out of this format */
+
+int sample_resolution(SampleFormat fmt)
+{
+    return (fmt == FMT_U8) ? 8 : 16;
+}
+
+/* Full scale floats to short or int, clipping anything outside of -1.0 to 1.0 */
+
+static inline short float_to_short(float f)
+{
+    float v = f * (float) SHRT_MAX;
+
+    if (v >= SHRT_MAX) return SHRT_MAX;
+    if (v <= SHRT_MIN) return SHRT_MIN;
+    return v;
+}
+
+static inline int float_to_int(float f)
+{
+    double v = f * (double) INT_MAX;
+
+    if (v >= INT_MAX) return INT_MAX;
+    if (v <= INT_MIN) return INT_MIN;
+    return v;
+}
+
+/* One sample, converted.  U8 samples are centered on 127, like they always have been here. */
+
+static inline short to_short(SampleFormat fmt, const void *in, int k)
+{
+    switch (fmt) {
+    case FMT_U8:
+        return ((const unsigned char *) in)[k] - 127;
+    case FMT_S16:
+        return ((const short *) in)[k];
+    case FMT_S24:
+        return (int) ((unsigned int) ((const int *) in)[k] << 8) >> 16;
+    case FMT_S32:
+        return ((const int *) in)[k] >> 16;
+    default:
+        return float_to_short(((const float *) in)[k]);
+    }
+}
+
+static inline int to_int(SampleFormat fmt, const void *in, int k)
+{
+    switch (fmt) {
+    case FMT_U8:
+        return ((const unsigned char *) in)[k] - 127;
+    case FMT_S16:
+        return ((const short *) in)[k];
+    case FMT_S24:
+        return (int) ((unsigned int) ((const int *) in)[k] << 8) >> 8;
+    case FMT_S32:
+        return ((const int *) in)[k];
+    default:
+        return float_to_int(((const float *) in)[k]);
+    }
+}
+
+#ifdef HAVE_SSE2_CONVERT
+
+/* Four full scale floats to four ints in the range of a short, like float_to_short() */
+
+static inline __m128i float_to_short_sse2(__m128i a)
+{
+    const __m128 full = _mm_set1_ps(SHRT_MAX);
+    const __m128 low = _mm_set1_ps(SHRT_MIN);
+
+    return _mm_cvttps_epi32(_mm_max_ps(_mm_min_ps(_mm_mul_ps(_mm_castsi128_ps(a), full), full),
+                                       low));
+}
+
+/* Eight 32 bit samples (two vectors) down to eight shorts */
+
+static inline __m128i narrow(SampleFormat fmt, __m128i a, __m128i b)
+{
+    if (fmt == FMT_FLOAT) {
+        return _mm_packs_epi32(float_to_short_sse2(a), float_to_short_sse2(b));
+    }
+    if (fmt == FMT_S24) {
+        a = _mm_slli_epi32(a, 8);
+        b = _mm_slli_epi32(b, 8);
+    }
+    return _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+}
+
+/* Both return the number of frames done; the caller finishes the rest */
+
+static int mono_short_sse2(SampleFormat fmt, const void *in, int nframes, short *out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i center = _mm_set1_epi16(127);
+    int f = 0;
+
+    switch (fmt) {
+    case FMT_U8:
+        for (; f + 16 <= nframes; f += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *) ((const unsigned char *) in + f));
+            _mm_storeu_si128((__m128i *) (out + f),
+                             _mm_sub_epi16(_mm_unpacklo_epi8(v, zero), center));
+            _mm_storeu_si128((__m128i *) (out + f + 8),
+                             _mm_sub_epi16(_mm_unpackhi_epi8(v, zero), center));
+        }
+        break;
+    case FMT_S16:
+        memcpy(out, in, nframes * sizeof(short));
+        f = nframes;
+        break;
+    default:
+        for (; f + 8 <= nframes; f += 8) {
+            const __m128i *p = (const __m128i *) ((const int *) in + f);
+            _mm_storeu_si128((__m128i *) (out + f),
+                             narrow(fmt, _mm_loadu_si128(p), _mm_loadu_si128(p + 1)));
+        }
+        break;
+    }
+    return f;
+}
+
+static int stereo_short_sse2(SampleFormat fmt, const void *in, int nframes, short *left,
+                             short *right)
+{
+    int f = 0;
+
+    switch (fmt) {
+    case FMT_U8: {
+        const __m128i low = _mm_set1_epi16(0x00ff);
+        const __m128i center = _mm_set1_epi16(127);
+        for (; f + 8 <= nframes; f += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i *) ((const unsigned char *) in + 2*f));
+            _mm_storeu_si128((__m128i *) (left + f),
+                             _mm_sub_epi16(_mm_and_si128(v, low), center));
+            _mm_storeu_si128((__m128i *) (right + f),
+                             _mm_sub_epi16(_mm_srli_epi16(v, 8), center));
+        }
+        break;
+    }
+    case FMT_S16:
+        for (; f + 8 <= nframes; f += 8) {
+            const __m128i *p = (const __m128i *) ((const short *) in + 2*f);
+            __m128i a = _mm_loadu_si128(p);
+            __m128i b = _mm_loadu_si128(p + 1);
+            _mm_storeu_si128((__m128i *) (left + f),
+                             _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16),
+                                             _mm_srai_epi32(_mm_slli_epi32(b, 16), 16)));
+            _mm_storeu_si128((__m128i *) (right + f),
+                             _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16)));
+        }
+        break;
+    default:
+        for (; f + 8 <= nframes; f += 8) {
+            const __m128i *p = (const __m128i *) ((const int *) in + 2*f);
+            /* [l0 r0 l1 r1] -> [l0 l1 r0 r1], then pair up the halves */
+            __m128i a = _mm_shuffle_epi32(_mm_loadu_si128(p), _MM_SHUFFLE(3, 1, 2, 0));
+            __m128i b = _mm_shuffle_epi32(_mm_loadu_si128(p + 1), _MM_SHUFFLE(3, 1, 2, 0));
+            __m128i c = _mm_shuffle_epi32(_mm_loadu_si128(p + 2), _MM_SHUFFLE(3, 1, 2, 0));
+            __m128i d = _mm_shuffle_epi32(_mm_loadu_si128(p + 3), _MM_SHUFFLE(3, 1, 2, 0));
+            _mm_storeu_si128((__m128i *) (left + f),
+                             narrow(fmt, _mm_unpacklo_epi64(a, b), _mm_unpacklo_epi64(c, d)));
+            _mm_storeu_si128((__m128i *) (right + f),
+                             narrow(fmt, _mm_unpackhi_epi64(a, b), _mm_unpackhi_epi64(c, d)));
+        }
+        break;
+    }
+    return f;
+}
+
+/* Four channels of 16 bit samples: eight frames are four vectors, which we transpose into eight
+ * samples of each channel
+ */
+
+static int quad_s16_sse2(const void *in, int nframes, short **out)
+{
+    int f = 0;
+
+    for (; f + 8 <= nframes; f += 8) {
+        const __m128i *p = (const __m128i *) ((const short *) in + 4*f);
+        __m128i t0 = _mm_unpacklo_epi16(_mm_loadu_si128(p), _mm_loadu_si128(p + 1));
+        __m128i t1 = _mm_unpackhi_epi16(_mm_loadu_si128(p), _mm_loadu_si128(p + 1));
+        __m128i t2 = _mm_unpacklo_epi16(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3));
+        __m128i t3 = _mm_unpackhi_epi16(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3));
+        __m128i u0 = _mm_unpacklo_epi16(t0, t1);        /* frames 0-3 of channels 0 and 1 */
+        __m128i u1 = _mm_unpackhi_epi16(t0, t1);        /* frames 0-3 of channels 2 and 3 */
+        __m128i u2 = _mm_unpacklo_epi16(t2, t3);        /* frames 4-7 ... */
+        __m128i u3 = _mm_unpackhi_epi16(t2, t3);
+
+        if (out[0]) _mm_storeu_si128((__m128i *) (out[0] + f), _mm_unpacklo_epi64(u0, u2));
+        if (out[1]) _mm_storeu_si128((__m128i *) (out[1] + f), _mm_unpackhi_epi64(u0, u2));
+        if (out[2]) _mm_storeu_si128((__m128i *) (out[2] + f), _mm_unpacklo_epi64(u1, u3));
+        if (out[3]) _mm_storeu_si128((__m128i *) (out[3] + f), _mm_unpackhi_epi64(u1, u3));
+    }
+    return f;
+}
+
+/* Any multiple of eight channels of 16 bit samples: an 8x8 transpose for each group of eight */
+
+static int octo_s16_sse2(const void *in, int nchans, int nframes, short **out)
+{
+    int groups = nchans / 8;
+    int f = 0, g, k;
+
+    for (; f + 8 <= nframes; f += 8) {
+        for (g = 0; g < groups; g++) {
+            const __m128i *p = (const __m128i *) ((const short *) in + nchans*f) + g;
+            __m128i a[8], b[8];
+
+            for (k = 0; k < 8; k += 2) {
+                __m128i x = _mm_loadu_si128(p + k*groups);
+                __m128i y = _mm_loadu_si128(p + (k+1)*groups);
+                a[k] = _mm_unpacklo_epi16(x, y);                /* channels 0-3 of two frames */
+                a[k+1] = _mm_unpackhi_epi16(x, y);              /* channels 4-7 */
+            }
+            for (k = 0; k < 2; k++) {
+                b[4*k] = _mm_unpacklo_epi32(a[4*k], a[4*k + 2]);        /* channels 0, 1 */
+                b[4*k + 1] = _mm_unpackhi_epi32(a[4*k], a[4*k + 2]);    /* channels 2, 3 */
+                b[4*k + 2] = _mm_unpacklo_epi32(a[4*k + 1], a[4*k + 3]); /* channels 4, 5 */
+                b[4*k + 3] = _mm_unpackhi_epi32(a[4*k + 1], a[4*k + 3]); /* channels 6, 7 */
+            }
+            for (k = 0; k < 4; k++) {
+                short *lo = out[8*g + 2*k];
+                short *hi = out[8*g + 2*k + 1];
+                if (lo) _mm_storeu_si128((__m128i *) (lo + f), _mm_unpacklo_epi64(b[k], b[k+4]));
+                if (hi) _mm_storeu_si128((__m128i *) (hi + f), _mm_unpackhi_epi64(b[k], b[k+4]));
+            }
+        }
+    }
+    return f;
+}
+
+/* Any multiple of four channels of 32 bit samples: two 4x4 transposes (frames 0-3 and 4-7) for
+ * each group of four, then narrow() them down to eight shorts per channel
+ */
+
+static inline void transpose4(const __m128i *p, int step, __m128i *c)
+{
+    __m128i t0 = _mm_unpacklo_epi32(_mm_loadu_si128(p), _mm_loadu_si128(p + step));
+    __m128i t1 = _mm_unpackhi_epi32(_mm_loadu_si128(p), _mm_loadu_si128(p + step));
+    __m128i t2 = _mm_unpacklo_epi32(_mm_loadu_si128(p + 2*step), _mm_loadu_si128(p + 3*step));
+    __m128i t3 = _mm_unpackhi_epi32(_mm_loadu_si128(p + 2*step), _mm_loadu_si128(p + 3*step));
+
+    c[0] = _mm_unpacklo_epi64(t0, t2);
+    c[1] = _mm_unpackhi_epi64(t0, t2);
+    c[2] = _mm_unpacklo_epi64(t1, t3);
+    c[3] = _mm_unpackhi_epi64(t1, t3);
+}
+
+static int quad_wide_sse2(SampleFormat fmt, const void *in, int nchans, int nframes, short **out)
+{
+    int groups = nchans / 4;
+    int f = 0, g, k;
+
+    for (; f + 8 <= nframes; f += 8) {
+        for (g = 0; g < groups; g++) {
+            const __m128i *p = (const __m128i *) ((const int *) in + nchans*f) + g;
+            __m128i lo[4], hi[4];
+
+            transpose4(p, groups, lo);
+            transpose4(p + 4*groups, groups, hi);
+            for (k = 0; k < 4; k++) {
+                short *o = out[4*g + k];
+                if (o) _mm_storeu_si128((__m128i *) (o + f), narrow(fmt, lo[k], hi[k]));
+            }
+        }
+    }
+    return f;
+}
+
+#endif
+
+void deinterleave_short(SampleFormat fmt, const void *in, int nchans, int nframes, short **out)
+{
+    int c, f = 0;
+
+#ifdef HAVE_SSE2_CONVERT
+    if (nchans == 1 && out[0]) {
+        f = mono_short_sse2(fmt, in, nframes, out[0]);
+    } else if (nchans == 2 && out[0] && out[1]) {
+        f = stereo_short_sse2(fmt, in, nframes, out[0], out[1]);
+    } else if (fmt == FMT_S16 && nchans == 4) {
+        f = quad_s16_sse2(in, nframes, out);
+    } else if (fmt == FMT_S16 && nchans % 8 == 0) {
+        f = octo_s16_sse2(in, nchans, nframes, out);
+    } else if (fmt != FMT_U8 && fmt != FMT_S16 && nchans % 4 == 0) {
+        f = quad_wide_sse2(fmt, in, nchans, nframes, out);
+    }
+#endif
+
+    for (c = 0; c < nchans; c++) {
+        short *o = out[c];
+        int k;
+
+        if (o == NULL) continue;
+        for (k = f; k < nframes; k++) {
+            o[k] = to_short(fmt, in, k * nchans + c);
+        }
+    }
+}
+
+void deinterleave_int(SampleFormat fmt, const void *in, int nchans, int nframes, int **out)
+{
+    int c;
+
+    for (c = 0; c < nchans; c++) {
+        int *o = out[c];
+        int k;
+
+        if (o == NULL) continue;
+        if (nchans == 1 && fmt == FMT_S32) {
+            memcpy(o, in, nframes * sizeof(int));
+            continue;
+        }
+        for (k = 0; k < nframes; k++) {
+            o[k] = to_int(fmt, in, k * nchans + c);
+        }
+    }
+}
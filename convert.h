@@ -0,0 +1,31 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * Prototypes for the sample format conversions in convert.c
+ *
+ */
+
+/* Interleaved sample formats we can read from a sound device.  S24 is 24 bits in the low three
+ * bytes of a 32 bit word, like ALSA's S24_LE; FLOAT is -1.0 to 1.0 full scale; all but U8 are in
+ * host byte order.
+ */
+
+typedef enum {
+    FMT_U8,
+    FMT_S16,
+    FMT_S24,
+    FMT_S32,
+    FMT_FLOAT
+} SampleFormat;
+
+int     sample_bytes(SampleFormat);
+int     sample_resolution(SampleFormat);
+
+/* Split 'nframes' frames of 'nchans' interleaved channels at 'in' into one array per channel,
+ * converting to short (keeping the top 16 bits, U8 centered on zero) or int (keeping every bit).
+ * out[c] receives channel c; a NULL out[c] skips that channel.
+ */
+
+void    deinterleave_short(SampleFormat, const void *in, int nchans, int nframes, short **out);
+void    deinterleave_int(SampleFormat, const void *in, int nchans, int nframes, int **out);
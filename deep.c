@@ -0,0 +1,267 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * This file implements the deep sample buffers
+ *
+ * Small buffers just come from the heap.  Big ones are anonymous mappings that only reserve the
+ * address space: the kernel hands out a zeroed page the first time one is written, so the pages
+ * are the segments the buffer grows by, and a sweep only costs the memory it has filled so far.
+ * Mappings of a few huge pages or more ask for transparent huge pages, which cuts the page faults
+ * and TLB misses of walking through millions of samples.
+ *
+ * Every buffer has room for a power of two bytes, not counting its header, and a freed one waits
+ * in the pool for the next request of its size class rather than going back to the system.
+ * Flipping between timebases, or the display allocating its trace arrays every sweep, then just
+ * moves buffers between the pool and their users, pages and all; deep_stats() shows whether that is
+ * all that happens.  A buffer that is resized within its class doesn't move at all.  A mapping that
+ * sits in the pool unused for DEEP_IDLE_NS gives its pages back to the kernel, keeping only the
+ * address space, so the classes a timebase change left behind don't hold on to memory either.
+ *
+ * Buffers are reference counted, so that storing a sweep into a memory can just take another
+ * reference to it (see save() and signal_writable()).
+ *
+ */
+
+#define _GNU_SOURCE             /* MADV_HUGEPAGE */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "deep.h"
+
+/* Size classes are 1 << DEEP_MIN_CLASS bytes and up.  Those of DEEP_MAPPED_CLASS and up are
+ * mappings, smaller ones come from the heap.  A mapping's header goes at the end of a page of its
+ * own, so the samples start on a page boundary and their pages can be dropped without it.
+ */
+
+#define DEEP_MIN_CLASS          12
+#define DEEP_MAPPED_CLASS       18      /* 256K */
+#define DEEP_HUGE_CLASS         23      /* 8M, four 2M huge pages */
+#define DEEP_CLASSES            (8 * sizeof(size_t))
+
+/* How many freed buffers of each class the pool keeps.  Enough for the traces of every display
+ * channel and the buffers of every data source channel to find theirs in there after a change.
+ */
+
+#define DEEP_KEEP               16
+
+/* How long a pooled mapping keeps its pages.  Buffers that are going round, like the display's,
+ * are back out of the pool well within a sweep.
+ */
+
+#define DEEP_IDLE_NS            2000000000LL
+
+typedef struct DeepHeader {
+    size_t size;                /* bytes asked for */
+    int cls;                    /* the buffer holds 1 << cls bytes */
+    int refs;                   /* owners, see deep_ref() */
+    struct DeepHeader *next;    /* next in the pool */
+    long long pooled;           /* when it went into the pool */
+    int resident;               /* TRUE if it may still have pages */
+} __attribute__ ((aligned (64))) DeepHeader;
+
+static struct {
+    DeepHeader *free;
+    int count;
+} pool[DEEP_CLASSES];
+
+static DeepStats stats;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t page;
+static long long next_idle_check;
+
+static int size_class(size_t size)
+{
+    int cls = DEEP_MIN_CLASS;
+
+    while (((size_t) 1 << cls) < size) {
+        cls++;
+    }
+    return cls;
+}
+
+static void * deep_failed(size_t size)
+{
+    fprintf(stderr, "deep buffer of %lu bytes failed\n", (unsigned long) size);
+    exit(EXIT_FAILURE);
+}
+
+static long long now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* Hand back the pages of the mappings that have been in the pool for DEEP_IDLE_NS.  Looks at the
+ * pool at most once every DEEP_IDLE_NS, so it costs deep_free() nothing most of the time.  Call
+ * with the lock held.
+ */
+
+static void drop_idle(long long now)
+{
+    DeepHeader *h;
+    int cls;
+
+    if (now < next_idle_check)
+        return;
+    next_idle_check = now + DEEP_IDLE_NS;
+
+    for (cls = DEEP_MAPPED_CLASS; cls < (int) DEEP_CLASSES; cls++) {
+        for (h = pool[cls].free; h != NULL; h = h->next) {
+            if (h->resident && (now - h->pooled >= DEEP_IDLE_NS)) {
+                madvise(h + 1, (size_t) 1 << cls, MADV_DONTNEED);
+                h->resident = 0;
+                stats.dropped ++;
+            }
+        }
+    }
+}
+
+/* Get a buffer of class cls from the system, or give one back */
+
+static DeepHeader * fresh_buffer(int cls)
+{
+    size_t len = (size_t) 1 << cls;
+    char *map;
+
+    if (cls < DEEP_MAPPED_CLASS) {
+        return malloc(sizeof(DeepHeader) + len);
+    }
+    if (page == 0) {
+        page = sysconf(_SC_PAGESIZE);
+    }
+    map = mmap(NULL, page + len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (cls >= DEEP_HUGE_CLASS) {
+        madvise(map + page, len, MADV_HUGEPAGE);
+    }
+#endif
+    return (DeepHeader *) (map + page) - 1;
+}
+
+static void release_buffer(DeepHeader *h)
+{
+    if (h->cls < DEEP_MAPPED_CLASS) {
+        free(h);
+    } else {
+        munmap((char *) (h + 1) - page, page + ((size_t) 1 << h->cls));
+    }
+}
+
+void * deep_alloc(size_t size)
+{
+    DeepHeader *h;
+    int cls;
+
+    if (size == 0)
+        return NULL;
+
+    cls = size_class(size);
+
+    pthread_mutex_lock(&lock);
+    stats.allocs ++;
+    stats.inuse += (size_t) 1 << cls;
+    if ((h = pool[cls].free) != NULL) {
+        pool[cls].free = h->next;
+        pool[cls].count --;
+        stats.pooled -= (size_t) 1 << cls;
+        stats.reused ++;
+    } else {
+        stats.fresh ++;
+    }
+    pthread_mutex_unlock(&lock);
+
+    if ((h == NULL) && ((h = fresh_buffer(cls)) == NULL)) {
+        return deep_failed(size);
+    }
+    h->size = size;
+    h->cls = cls;
+    h->refs = 1;
+    h->resident = 1;
+    return h + 1;
+}
+
+void * deep_ref(void *p)
+{
+    if (p != NULL) {
+        __atomic_add_fetch(&((DeepHeader *) p - 1)->refs, 1, __ATOMIC_RELAXED);
+    }
+    return p;
+}
+
+int deep_shared(void *p)
+{
+    return (p != NULL) && (__atomic_load_n(&((DeepHeader *) p - 1)->refs, __ATOMIC_ACQUIRE) > 1);
+}
+
+void deep_free(void *p)
+{
+    DeepHeader *h = (DeepHeader *) p - 1;
+
+    if ((p == NULL) || (__atomic_sub_fetch(&h->refs, 1, __ATOMIC_ACQ_REL) > 0))
+        return;
+
+    pthread_mutex_lock(&lock);
+    stats.inuse -= (size_t) 1 << h->cls;
+    if (pool[h->cls].count < DEEP_KEEP) {
+        h->pooled = now_ns();
+        h->next = pool[h->cls].free;
+        pool[h->cls].free = h;
+        pool[h->cls].count ++;
+        stats.pooled += (size_t) 1 << h->cls;
+        drop_idle(h->pooled);
+        h = NULL;
+    } else {
+        stats.released ++;
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (h != NULL) {
+        release_buffer(h);
+    }
+}
+
+/* Resize, keeping the samples that fit */
+
+void * deep_realloc(void *p, size_t size)
+{
+    DeepHeader *h = (DeepHeader *) p - 1;
+    void *n;
+
+    if (p == NULL)
+        return deep_alloc(size);
+    if (size == 0) {
+        deep_free(p);
+        return NULL;
+    }
+
+    if ((size_class(size) == h->cls) && !deep_shared(p)) {
+        pthread_mutex_lock(&lock);
+        stats.grown ++;
+        pthread_mutex_unlock(&lock);
+        h->size = size;
+        return p;
+    }
+
+    n = deep_alloc(size);
+    memcpy(n, p, (size < h->size) ? size : h->size);
+    deep_free(p);
+    return n;
+}
+
+void deep_stats(DeepStats *s)
+{
+    pthread_mutex_lock(&lock);
+    *s = stats;
+    pthread_mutex_unlock(&lock);
+}
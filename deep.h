@@ -0,0 +1,46 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * Prototypes for the deep sample buffers in deep.c
+ *
+ */
+
+/* A deep buffer is sized for a whole sweep but only takes memory as it gets written, so a slow
+ * timebase can have tens of millions of samples per channel without anything being spent on the
+ * part of the sweep that hasn't come in yet.  Freed buffers go back to a pool and are handed out
+ * again, so like g_new() their contents start out undefined; deep_renew() keeps what was there,
+ * like g_renew() does.
+ */
+
+void *  deep_alloc(size_t);
+void *  deep_realloc(void *, size_t);
+void    deep_free(void *);
+
+/* A deep buffer can have more than one owner: deep_ref() adds one, and deep_free() only puts the
+ * buffer back in the pool when the last one lets go.  Nobody may write into a buffer that
+ * deep_shared() says somebody else is holding on to; see signal_writable().
+ */
+
+void *  deep_ref(void *);
+int     deep_shared(void *);
+
+#define deep_new(type, n)       ((type *) deep_alloc((size_t) (n) * sizeof(type)))
+#define deep_renew(type, p, n)  ((type *) deep_realloc((p), (size_t) (n) * sizeof(type)))
+
+/* DeepStats - what the pool has done since the program started.  Once the widths stop changing,
+ * every buffer should come out of the pool, and 'fresh' should stop going up.
+ */
+
+typedef struct DeepStats {
+    unsigned long allocs;       /* buffers handed out, by deep_alloc() or a moving deep_realloc() */
+    unsigned long reused;       /* ... of which came out of the pool */
+    unsigned long fresh;        /* ... of which had to be got from the system */
+    unsigned long grown;        /* deep_realloc()s that fit where the buffer already was */
+    unsigned long released;     /* buffers given back to the system because the pool was full */
+    unsigned long dropped;      /* pooled buffers that gave their pages back after DEEP_IDLE_NS */
+    size_t inuse;               /* bytes of address space in buffers handed out */
+    size_t pooled;              /* bytes of address space waiting in the pool */
+} DeepStats;
+
+void    deep_stats(DeepStats *);
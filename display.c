@@ -19,6 +19,8 @@
 #include "xoscope.h"            /* program defaults */
 #include "display.h"
 #include "func.h"
+#include "deep.h"
+#include "record.h"
 
 #include "xoscope_gtk.h"
 #include <glib.h>
@@ -39,6 +41,19 @@ int     math_warning = 0;       /* TRUE if math has a problem */
 
 struct signal_stats stats;
 
+/* Acquisition to display latency - how long ago the newest sample we hand to the databox was
+ * sampled (see Signal.stamp), summed over the last second for the fps label
+ */
+
+static long long newest_drawn = 0;
+static long long latency_sum = 0;
+static long long latency_max = 0;
+static int latency_count = 0;
+
+/* Deep buffers got from the system (see DeepStats), as of the last fps label */
+
+static unsigned long fresh_seen = 0;
+
 /* message() - draw a temporary one-line message to center of screen
  *
  * XXX actually draws into the databox, which means that if we scroll the databox, the message
@@ -277,21 +292,15 @@ void setup_help_text(GtkWidget *widget, gpointer ignored)
  * But I dont know what frquency range to expect from a comedi device.
  *
  * If signal->volts is 0, we display steps for min, max and peak/peak
- * The required width for printf differs in 8 and 16 bit mode 
+ * The required width for printf differs for 8 and 16 bit signals
  * The defines below set the width accordingly.
  */
 
-#if SC_16BIT
-#define INTW    6   // min, max: 5 digits plus + or - sign
-#define UINTW   5   // peak/peak: 5 digits no sign as this value is always positve
-#define FLW     8   // 5 digits plus + or - sign, decimal point and 2 digits precision
-#define FLPREC  2   // 2 digits precision
-#else
-#define INTW    4   // min, max: 3 digits plus + or - sign
-#define UINTW   3   // peak/peak: 3 digits no sign as this value is always positve
-#define FLW     6   // 3 digits plus + or - sign, decimal point and 2 digits precision
+#define DIGITS(sig) ((sig)->resolution > 8 ? 5 : 3)
+#define INTW(sig)   (DIGITS(sig) + 1)   // min, max: digits plus + or - sign
+#define UINTW(sig)  DIGITS(sig)         // peak/peak: no sign as this value is always positve
+#define FLW(sig)    (DIGITS(sig) + 3)   // digits plus sign, decimal point and 2 digits precision
 #define FLPREC  2   // 2 digits precision
-#endif
 
 /* Text update - the 'dynamic' text is unpredictable and is updated on every sweep.  Most of the
  * text only changes when the user hits a key or something; updating it requires a call to
@@ -306,6 +315,8 @@ void update_dynamic_text(void)
     const char *s;
     int i;
     time_t sec;
+    DeepStats deep;
+    RecordStats rec;
     Channel *p;
 
     p = &ch[scope.select];
@@ -342,13 +353,14 @@ void update_dynamic_text(void)
         }
         else{
             sprintf(cp, "<tt>Max:%+*d - Min:%+*d = %*d Pk-Pk",
-                        INTW, stats.max, INTW, stats.min, UINTW, stats.max - stats.min);
+                    INTW(p->signal), stats.max, INTW(p->signal), stats.min,
+                    UINTW(p->signal), stats.max - stats.min);
 #if CALC_RMS
             cp = string + strlen(string);
             if(stats.rms > 0)
-                sprintf(cp, " %*.*f RMS", FLW, FLPREC, stats.rms);
+                sprintf(cp, " %*.*f RMS", FLW(p->signal), FLPREC, stats.rms);
             else
-                sprintf(cp, " %*s RMS", FLW, "---");
+                sprintf(cp, " %*s RMS", FLW(p->signal), "---");
 #endif
            strcat(cp, "</tt>");
         }
@@ -427,14 +439,29 @@ void update_dynamic_text(void)
     time(&sec);
     if (sec != prev) {
 
-        if (prev != 0) {
-            sprintf(string, "fps:%3d", frames);
-            gtk_label_set_text(GTK_LABEL(LU("fps_label")), string);
+        deep_stats(&deep);
+        if ((prev != 0) && (latency_count > 0)) {
+            sprintf(string, "fps:%3d lat:%lld/%lld ms new:%lu", frames,
+                    latency_sum / latency_count / 1000000, latency_max / 1000000,
+                    deep.fresh - fresh_seen);
+        } else if (prev != 0) {
+            sprintf(string, "fps:%3d new:%lu", frames, deep.fresh - fresh_seen);
         } else {
-            gtk_label_set_text(GTK_LABEL(LU("fps_label")), "");
+            string[0] = '\0';
+        }
+
+        /* and how much the recorder has written, and lost */
+
+        if ((prev != 0) && record_active()) {
+            record_stats(&rec);
+            snprintf(string + strlen(string), sizeof(string) - strlen(string),
+                     " rec:%luM lost:%llu", rec.chunks, rec.lost);
         }
+        gtk_label_set_text(GTK_LABEL(LU("fps_label")), string);
 
         frames = 0;
+        latency_sum = latency_max = latency_count = 0;
+        fresh_seen = deep.fresh;
         if (datasrc) {
             prev = sec;
         } else {
@@ -487,12 +514,18 @@ void update_text(void)
         if (trigsig->volts > 0) {
             char minibuf[256];
             SIformat(minibuf, "%g %sV",
-                     (scope.trig) * trigsig->volts / 320000, TRUE);
+                     scope.trig * SAMPLE_UNIT(trigsig) * trigsig->volts / 320000, TRUE);
             sprintf(string, "%s Trigger @ %s", trigs[scope.trige], minibuf);
         } else {
             sprintf(string, "%s Trigger @ %d",
                     trigs[scope.trige], scope.trig);
         }
+        if (scope.trighyst) {
+            sprintf(string + strlen(string), " \302\261%d", scope.trighyst);
+        }
+        if (scope.pretrig) {
+            sprintf(string + strlen(string), ", %d%% pre", scope.pretrig);
+        }
         gtk_label_set_text(GTK_LABEL(LU("trigger_label")), string);
         gtk_label_set_text(GTK_LABEL(LU("trigger_source_label")), trigsig->name);
     } else {
@@ -525,13 +558,9 @@ void update_text(void)
 //                    SIformat(string, "%g %sV/div", 
 //                        (double)ch[i].signal->volts / ch[i].scale / 10000, TRUE);
 
-#if SC_16BIT
-                    SIformat(string, "%g %sV/div", 
-                        (double)(ch[i].signal->volts * 256.0) / (ch[i].scale * 10000), TRUE);
-#else
-                    SIformat(string, "%g %sV/div", 
-                        (double)ch[i].signal->volts / (ch[i].scale * 10000 ), TRUE);
-#endif
+                    SIformat(string, "%g %sV/div",
+                        ch[i].signal->volts * SAMPLE_UNIT(ch[i].signal) / (ch[i].scale * 10000),
+                        TRUE);
 
 
                 else if (ch[i].scale > 1.0)
@@ -804,8 +833,10 @@ void free_signalline(SignalLine *sl)
             gtk_databox_graph_remove(GTK_DATABOX(databox), sl->graph);
             g_object_unref(G_OBJECT(sl->graph));
         }
-        g_free(sl->X);
-        g_free(sl->Y);
+        deep_free(sl->X);
+        deep_free(sl->Y);
+        deep_free(sl->data);
+        pyramid_free(&sl->pyramid);
 
         g_free(sl);
         sl = slnext;
@@ -933,6 +964,31 @@ void configure_databox(void)
     recompute_graticule();
 }
 
+/* listen_datasrc() - wake us up whenever one of the data source's descriptors is ready */
+
+void listen_datasrc(void)
+{
+    struct pollfd fds[DATASRC_MAXFDS];
+
+    setinputfds(fds, datasrc_pollfds(datasrc, fds, DATASRC_MAXFDS));
+}
+
+/* restart_datasrc() - (re)configure the data source and start a new sweep
+ *
+ * configure() makes sure the rate and volts fields in the Signal structures are valid, so we can
+ * set the capture width of each active channel to the number of samples required to fill the
+ * screen at its rate, then start() the capture.  Data sources without these get reset() twice
+ * instead, see datasrc_configure().
+ */
+
+static void restart_datasrc(void)
+{
+    datasrc_configure(datasrc);
+    datasrc_set_widths(datasrc);
+    datasrc_start(datasrc);
+    listen_datasrc();
+}
+
 void timebase_changed(void)
 {
     /* If the scope is running, then clear the screen traces and reset the capture.  We don't do
@@ -944,32 +1000,7 @@ void timebase_changed(void)
 
         clear_databox();
 
-        /* In xoscope.h, I wrote "Only after reset() has been called are the rate and volts fields in
-         * the Signal structures guaranteed valid".  So... we reset() once to make sure the rate and
-         * volts fields are valid, then use the rate field in the first active channel to set the
-         * capture width to the number of samples required to fill the screen at that rate, then
-         * reset() again to (re)start the capture.
-         *
-         * XXX Probably reset() needs to be split into two functions - say reset() and
-         * start_sweep(), so then our sequence is reset(), set_width(), start_sweep()
-         *
-         * XXX Also seems a little hokey the way we run through the channels.  Implicit here is the
-         * code's current design that all the channels for a data source have the same rate and
-         * frame width.
-         */
-
-        datasrc->reset();
-        if (datasrc->set_width) {
-            int i;
-            for (i=0; i<datasrc->nchans(); i++) {
-                if (datasrc->chan(i)->listeners > 0) {
-                    datasrc->set_width(samples(datasrc->chan(i)->rate));
-                    break;
-                }
-            }
-            datasrc->reset();
-        }
-        setinputfd(datasrc->fd());
+        restart_datasrc();
     }
 
     restart_external_commands();
@@ -997,32 +1028,7 @@ void clear(void)
 
     if (datasrc) {
 
-        /* In xoscope.h, I wrote "Only after reset() has been called are the rate and volts fields in
-         * the Signal structures guaranteed valid".  So... we reset() once to make sure the rate and
-         * volts fields are valid, then use the rate field in the first active channel to set the
-         * capture width to the number of samples required to fill the screen at that rate, then
-         * reset() again to (re)start the capture.
-         *
-         * XXX Probably reset() needs to be split into two functions - say reset() and
-         * start_sweep(), so then our sequence is reset(), set_width(), start_sweep()
-         *
-         * XXX Also seems a little hokey the way we run through the channels.  Implicit here is the
-         * code's current design that all the channels for a data source have the same rate and
-         * frame width.
-         */
-
-        datasrc->reset();
-        if (datasrc->set_width) {
-            int i;
-            for (i=0; i<datasrc->nchans(); i++) {
-                if (datasrc->chan(i)->listeners > 0) {
-                    datasrc->set_width(samples(datasrc->chan(i)->rate));
-                    break;
-                }
-            }
-            datasrc->reset();
-        }
-        setinputfd(datasrc->fd());
+        restart_datasrc();
     }
 
     configure_databox();
@@ -1040,11 +1046,8 @@ void clear(void)
 
         if (ch[i].signal) {
             if (ch[i].signal->volts != 0 && ch[i].signal->rate > 0){
-#if SC_16BIT
-                ch[i].scale = roundoff(ch[i].scale, 1.0 / (ch[i].signal->volts * 256.0));
-#else
-                ch[i].scale = roundoff(ch[i].scale, 1.0 / ch[i].signal->volts);
-#endif
+                ch[i].scale = roundoff(ch[i].scale,
+                                       1.0 / (ch[i].signal->volts * SAMPLE_UNIT(ch[i].signal)));
             }
             else
                 ch[i].scale = roundoff(ch[i].scale, 1);
@@ -1095,18 +1098,105 @@ gfloat cursoraX[2], cursoraY[2], cursorbX[2], cursorbY[2];
 GtkDataboxGraph *cursora = NULL;
 GtkDataboxGraph *cursorb = NULL;
 
+/* Copy the samples of sig that sl hasn't got yet into its data[] (or just one bit of them, if
+ * bit >= 0)
+ */
+
+static void signalline_fill(SignalLine *sl, Signal *sig, int bit)
+{
+    int i;
+
+    switch (sig->type) {
+    case SIG_S32:
+        for (i = sl->next_point; i < sig->num; i++) {
+            sl->data[i] = (bit < 0) ? sig->data32[i] : (sig->data32[i] >> bit) & 1;
+        }
+        break;
+    case SIG_FLOAT:
+        for (i = sl->next_point; i < sig->num; i++) {
+            sl->data[i] = (bit < 0) ? sig->dataf[i] : ((int) sig->dataf[i] >> bit) & 1;
+        }
+        break;
+    default:
+        for (i = sl->next_point; i < sig->num; i++) {
+            sl->data[i] = (bit < 0) ? sig->data[i] : (sig->data[i] >> bit) & 1;
+        }
+    }
+    if (sig->num > sl->next_point) {
+        sl->next_point = sig->num;
+    }
+}
+
+/* Turn data[] from sample 'from' on into the points in X and Y, sample i going to x0 + i * dx,
+ * y0 + data[i] * dy.  With more than two samples to a pixel column ('spp', see draw_data()), each
+ * column just gets two points, the smallest and the largest of its samples, so a deep trace costs
+ * what the screen is wide rather than what it holds.  If spp isn't what X and Y were filled at, they
+ * are filled again from the start.
+ */
+
+static void signalline_points(SignalLine *sl, int from, double spp,
+                              double x0, double dx, double y0, double dy)
+{
+    int i, c, a, b;
+    float lo, hi;
+
+    if (spp != sl->spp) {
+        sl->spp = spp;
+        from = 0;
+    }
+
+    if (spp == 0) {
+        for (i = from; i < sl->next_point; i++) {
+            if ((scope.plot_mode != 2) || (i == 0)) {
+                sl->X[i] = x0 + i * dx;
+                sl->Y[i] = y0 + sl->data[i] * dy;
+            } else {
+                sl->X[2*i] = x0 + i * dx;
+                sl->Y[2*i] = y0 + sl->data[i] * dy;
+                sl->X[2*i - 1] = sl->X[2*i - 2];
+                sl->Y[2*i - 1] = sl->Y[2*i];
+            }
+        }
+        sl->points = ((scope.plot_mode == 2) && (sl->next_point > 0))
+            ? 2 * sl->next_point - 1 : sl->next_point;
+        return;
+    }
+
+    pyramid_update(&sl->pyramid, sl->data, sl->next_point);
+
+    /* The last column may have been drawn before all of its samples were in */
+
+    for (c = (int) (from / spp); (a = (int) (c * spp)) < sl->next_point; c++) {
+        b = MIN((int) ((c + 1) * spp), sl->next_point);
+        pyramid_range(&sl->pyramid, sl->data, a, b, &lo, &hi);
+        sl->X[2*c] = sl->X[2*c + 1] = x0 + a * dx;
+        sl->Y[2*c] = y0 + lo * dy;
+        sl->Y[2*c + 1] = y0 + hi * dy;
+    }
+    sl->points = 2 * c;
+}
+
+/* The first point in X/Y of sample i or one after it */
+
+static int signalline_index(SignalLine *sl, int i)
+{
+    if (sl->spp != 0) {
+        return 2 * (int) ceil(i / sl->spp);
+    }
+    return (scope.plot_mode == 2) ? 2 * i : i;
+}
+
 void draw_data(void)
 {
-    static int i, j, bit, start, end;
+    static int j, bit, start, end, from;
     gfloat num, left_offset;
     Channel *p;
     SignalLine *sl;
-    short *samp;
     gchar widget[80];
     GtkStyle *style;
     GdkColor gcolor;
     SignalLine *prevSL;
-    double x_offset;
+    double x_offset, spp;
 
     /* Remove the cursors.  We'll put them back in later if they're active. */
 
@@ -1142,8 +1232,6 @@ void draw_data(void)
             style = gtk_widget_get_style(GTK_WIDGET(LU(widget)));
             gcolor = style->fg[GTK_STATE_NORMAL];
 
-            samp = p->signal->data;
-
             /* Compute num, the number of seconds per sample, based on the signal's rate (in
              * samples/sec). If the signal rate is zero (unspecified) or negative (a special case
              * for Fourier Transforms, meaning the x scale is in Hz), we use a base rate of one
@@ -1166,6 +1254,18 @@ void draw_data(void)
 
             left_offset = p->signal->delay * num / 10000;
 
+            /* Compute spp, the number of samples to a pixel column of the visible ten divisions.
+             * With more than two, the trace is drawn a column at a time (see signalline_points()).
+             */
+
+            spp = 0;
+            if (databox->allocation.width > 0) {
+                spp = 10 * 0.001 * scope.scale / (num * databox->allocation.width);
+            }
+            if (spp <= 2) {
+                spp = 0;
+            }
+
             /* Draw the cursors, if needed.
              *
              * There's several things I don't like about the cursors.  First, the cursor positions
@@ -1215,9 +1315,10 @@ void draw_data(void)
                      * two vertices for every data point
                      */
 
-                    sl->X = g_new0(gfloat, 2 * p->signal->width);
-                    sl->Y = g_new0(gfloat, 2 * p->signal->width);
-                    sl->data = g_new0(short, p->signal->width);
+                    sl->X = deep_new(gfloat, 2 * p->signal->width);
+                    sl->Y = deep_new(gfloat, 2 * p->signal->width);
+                    sl->data = deep_new(gfloat, p->signal->width);
+                    pyramid_resize(&sl->pyramid, p->signal->width);
 
                     sl->y_scale = 1.0;
                 }
@@ -1238,18 +1339,9 @@ void draw_data(void)
                  * updating a trace that's already partially drawn; that's why we start at
                  * sl->next_point and not 0.
                  */
-                for (i = sl->next_point; i < p->signal->num; i++) {
-
-                    if (bit < 0) {
-                        sl->data[sl->next_point] = samp[i];
-                    } else {
-                        sl->data[sl->next_point] = (samp[i] >> bit) & 1;
-                    }
-
-                    sl->X[sl->next_point] = left_offset + i * num;
-                    sl->Y[sl->next_point] = sl->data[sl->next_point];
-                    sl->next_point ++;
-                }
+                from = sl->next_point;
+                signalline_fill(sl, p->signal, bit);
+                signalline_points(sl, from, spp, left_offset, num, 0, 1);
 
                 /* Depending on the scroll mode, manage previous traces */
 
@@ -1291,27 +1383,22 @@ void draw_data(void)
                     }
 #else
                     if ((sl->next != NULL)
-                        && (sl->next_point < sl->next->next_point)) {
+                        && ((from = signalline_index(sl->next, sl->next_point))
+                            < sl->next->points)) {
                         switch (scope.plot_mode) {
                         case 0: /* points */
                             sl->next->graph
-                                = gtk_databox_points_new (sl->next->next_point-sl->next_point,
-                                                          sl->next->X + sl->next_point,
-                                                          sl->next->Y + sl->next_point,
+                                = gtk_databox_points_new (sl->next->points - from,
+                                                          sl->next->X + from,
+                                                          sl->next->Y + from,
                                                           &gcolor, 1);
                             break;
                         case 1: /* lines */
-                            sl->next->graph
-                                = gtk_databox_lines_new (sl->next->next_point-sl->next_point,
-                                                         sl->next->X + sl->next_point,
-                                                         sl->next->Y + sl->next_point,
-                                                         &gcolor, 1);
-                            break;
                         case 2: /* step */
                             sl->next->graph
-                                = gtk_databox_lines_new (2*(sl->next->next_point - sl->next_point) - 1,
-                                                         sl->next->X + 2 * sl->next_point,
-                                                         sl->next->Y + 2 * sl->next_point,
+                                = gtk_databox_lines_new (sl->next->points - from,
+                                                         sl->next->X + from,
+                                                         sl->next->Y + from,
                                                          &gcolor, 1);
                             break;
                         }
@@ -1359,16 +1446,11 @@ void draw_data(void)
 
                 /* The scale is applied first, then the offset 
                  * Full range is scaled to 4/5 of the screen.
-                 * Therefor we scale it to 127*1,25 in 8-bit mode 
-                 * and 32767*1,25 in 16-bit mode.
+                 * Therefor we scale it to 127*1,25 for 8-bit signals
+                 * and 32767*1,25 for 16-bit signals.
                  */
-#if SC_16BIT
-                sl->y_scale = (double)p->scale / 40959;
-                sl->y_offset = (double)p->pos;
-#else
-                sl->y_scale = (double)p->scale / 160;
+                sl->y_scale = (double)p->scale / (160 * SAMPLE_UNIT(p->signal));
                 sl->y_offset = (double)p->pos;
-#endif
                 /* If we're in digital mode, increase the scale by eight and shift the offset by
                  * sixteen for each bit.  This hardwires eight as the height of a digital line and
                  * sixteen as the inter-line spacing.  We also shift the entire digital plot by the
@@ -1378,29 +1460,21 @@ void draw_data(void)
                 if (bit >= 0) {
                     int bitoff = bit * 16 - end * 8 + 4;
 
-#if SC_16BIT
-                    sl->y_offset += bitoff * sl->y_scale * 256;
-                    sl->y_scale *= (8 * 256);
-#else
-                    sl->y_offset += bitoff * sl->y_scale;
-                    sl->y_scale *= 8;
-#endif
+                    sl->y_offset += bitoff * sl->y_scale * SAMPLE_UNIT(p->signal);
+                    sl->y_scale *= 8 * SAMPLE_UNIT(p->signal);
                 }
                 /* Add the current trace to the databox */
 
-                if (sl->next_point > 0) {
+                if (sl->points > 0) {
 
                     switch (scope.plot_mode) {
                     case 0: /* points */
-                        sl->graph = gtk_databox_points_new (sl->next_point,
+                        sl->graph = gtk_databox_points_new (sl->points,
                                                             sl->X, sl->Y, &gcolor, 1);
                         break;
                     case 1: /* lines */
-                        sl->graph = gtk_databox_lines_new (sl->next_point,
-                                                           sl->X, sl->Y, &gcolor, 1);
-                        break;
-                    case 2: /* step */
-                        sl->graph = gtk_databox_lines_new (2 * sl->next_point - 1,
+                    case 2: /* step, X and Y have two points per sample */
+                        sl->graph = gtk_databox_lines_new (sl->points,
                                                            sl->X, sl->Y, &gcolor, 1);
                         break;
                     }
@@ -1440,17 +1514,10 @@ void draw_data(void)
                             g_value_unset(&gvalue);
                             //g_object_set_property((GObject *) prevSL->graph, "plot-style", &plotstyle);
                         } else {
-                            for (i = 0; i < prevSL->next_point; i++) {
-                                if ((scope.plot_mode != 2) || (i == 0)) {
-                                    prevSL->X[i] = prevSL->x_offset + left_offset + i * num;
-                                    prevSL->Y[i] = prevSL->y_offset + prevSL->data[i] * prevSL->y_scale;
-                                } else {
-                                    prevSL->X[2*i] = prevSL->x_offset + left_offset + i * num;
-                                    prevSL->Y[2*i] = prevSL->y_offset + prevSL->data[i] * prevSL->y_scale;
-                                    prevSL->X[2*i - 1] = prevSL->X[2*i - 2];
-                                    prevSL->Y[2*i - 1] = prevSL->Y[2*i];
-                                }
-                            }
+                            /* same columns as the graph was made with, so the same number of points */
+                            signalline_points(prevSL, 0, prevSL->spp,
+                                              prevSL->x_offset + left_offset, num,
+                                              prevSL->y_offset, prevSL->y_scale);
                         }
                     }
                 }
@@ -1487,6 +1554,30 @@ void draw_data(void)
 
 }
 
+/* Note how old the newest sample on the screen is, if it's one we haven't drawn before */
+
+static void measure_latency(void)
+{
+    long long newest = 0, latency;
+    Signal *sig;
+    int j;
+
+    for (j = 0 ; j < CHANNELS ; j++) {
+        sig = ch[j].signal;
+        if (ch[j].show && sig && sig->stamp && (sig->rate > 0) && (sig->num > 0)) {
+            newest = MAX(newest, stamp_add(sig->stamp, sig->num - 1, sig->rate));
+        }
+    }
+
+    if (newest > newest_drawn) {
+        newest_drawn = newest;
+        latency = monotonic_ns() - newest;
+        latency_sum += latency;
+        latency_max = MAX(latency_max, latency);
+        latency_count ++;
+    }
+}
+
 /* calculate any math and plot the results and the graticule */
 
 void show_data(void)
@@ -1509,6 +1600,7 @@ void show_data(void)
         draw_data();            /* plot graticule on top of data */
         draw_graticule();
     }
+    measure_latency();
 
     gtk_widget_queue_draw (databox);
 }
@@ -1518,6 +1610,8 @@ void show_data(void)
 void animate(void *data)
 {
     static struct timeval current_time, prev_time;
+    struct pollfd fds[DATASRC_MAXFDS];
+    int nfds, interval;
 
     /* To avoid hammering the X server, don't do anything if it's been less than scope.min_interval
      * milliseconds (default 50) since the last time we ran this function.  If we do skip
@@ -1536,13 +1630,24 @@ void animate(void *data)
             + current_time.tv_usec - prev_time.tv_usec
             < 1000 * scope.min_interval)) {
         settimeout(scope.min_interval);
-        setinputfd(-1);
+        setinputfds(NULL, 0);
         return;
     }
 
     prev_time = current_time;
-    if (datasrc) setinputfd(datasrc->fd());
-    settimeout(SND_QUERY_INTERVALL);
+
+    /* A data source with descriptors wakes us up when it has data; only poll the others, and the
+     * ones that ask to be called every so often anyway
+     */
+
+    nfds = datasrc ? datasrc_pollfds(datasrc, fds, DATASRC_MAXFDS) : 0;
+    interval = datasrc ? datasrc_interval(datasrc) : 0;
+    setinputfds(fds, nfds);
+    if (nfds > 0 && scope.run) {
+        settimeout(interval);
+    } else {
+        settimeout(interval ? interval : SND_QUERY_INTERVALL);
+    }
 
     clip = 0;
     if (datasrc) {
@@ -1559,7 +1664,7 @@ void animate(void *data)
             datasrc->get_data();
         } else {
             //usleep(100000);           /* no need to suck all CPU cycles */
-            setinputfd(-1);             /* scope not running, so why listen? */
+            setinputfds(NULL, 0);       /* scope not running, so why listen? */
         }
     }
     show_data();
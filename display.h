@@ -30,6 +30,7 @@ void    setup_help_text(GtkWidget *widget, gpointer ignored);
 void    update_text(void);
 void    show_data(void);
 void    roundoff_multipliers(Channel *);
+void    listen_datasrc(void);
 void    timebase_changed(void);
 void    clear(void);
 void    message(const char *);
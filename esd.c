@@ -17,6 +17,11 @@
 #include <stdlib.h>             /* for abs() */
 #include <sys/ioctl.h>
 #include "xoscope.h"            /* program defaults */
+#include "history.h"
+#include "deep.h"
+#include "trigger.h"
+#include "convert.h"
+#include "record.h"
 #include <esd.h>
 
 #define ESDDEVICE "ESounD"
@@ -31,9 +36,13 @@ static int esdrecord = 1;       /* 1 to use ESD record mode; 0 to use ESD monito
 static Signal left_sig = {"Left Mix", "a"};
 static Signal right_sig = {"Right Mix", "b"};
 
-static int trigmode = 0;
-static int triglev;
+/* Recent samples, for the part of the sweep before the trigger */
+static History left_hist;
+static History right_hist;
+
+static Trigger trig;
 static int trigch;
+static DataSrcStats stats;
 
 static char * esd_errormsg1 = NULL;
 static char * esd_errormsg2 = NULL;
@@ -52,6 +61,7 @@ void esd_gtk_option_dialog() __attribute__ ((weak));
 static void close_ESD(void)
 {
     if (esd >= 0) {
+        record_break();
         close(esd);
         esd = -2;
     }
@@ -134,22 +144,24 @@ static Signal *sc_chan(int chan)
 static int set_trigger(int chan, int *levelp, int mode)
 {
     trigch = chan;
-    trigmode = mode;
-    triglev = 127 + *levelp;
-    if (triglev > 255) {
-        triglev = 255;
+    trig.mode = mode;
+    trig.level = 127 + *levelp;
+    if (trig.level > 255) {
+        trig.level = 255;
         *levelp = 128;
     }
-    if (triglev < 0) {
-        triglev = 0;
+    if (trig.level < 0) {
+        trig.level = 0;
         *levelp = -128;
     }
+    trig.hyst = scope.trighyst;
+    trigger_reset(&trig);
     return 1;
 }
 
 static void clear_trigger(void)
 {
-    trigmode = 0;
+    trig.mode = 0;
 }
 
 static int change_rate(int dir)
@@ -174,6 +186,10 @@ static void reset(void)
     left_sig.volts = 0;
     right_sig.volts = 0;
 
+    history_clear(&left_hist);
+    history_clear(&right_hist);
+    trigger_reset(&trig);
+
     in_progress = 0;
 }
 
@@ -189,28 +205,56 @@ static void set_width(int width)
     left_sig.width = width;
     right_sig.width = width;
 
-    if (left_sig.data != NULL) free(left_sig.data);
-    if (right_sig.data != NULL) free(right_sig.data);
+    deep_free(left_sig.data);
+    deep_free(right_sig.data);
+
+    left_sig.data = deep_new(short, width);
+    right_sig.data = deep_new(short, width);
+
+    history_resize(&left_hist, width);
+    history_resize(&right_hist, width);
+}
+
+/* Remember the last of 'count' frames of 'buffer' in the history */
 
-    left_sig.data = malloc(width * sizeof(short));
+static void history_frames(unsigned char *buffer, int count)
+{
+    int i = max(0, count - history_size(&left_hist));
 
-    if(left_sig.data == NULL){
-        fprintf(stderr, "set_width(), malloc failed, %s\n", strerror(errno));
-        exit(0);
+    for (; i < count; i++) {
+        history_put(&left_hist, buffer[2*i] - 127);
+        history_put(&right_hist, buffer[2*i + 1] - 127);
     }
-    right_sig.data = malloc(width * sizeof(short));
-    if(right_sig.data == NULL){
-        fprintf(stderr, "set_width(), malloc failed, %s\n", strerror(errno));
-        exit(0);
+}
+
+/* Hand 'count' frames of 'buffer' to the recorder.  'behind' more are still waiting in the socket,
+ * and the last of those is taken to be from now.
+ */
+
+static void record_buffer(unsigned char *buffer, int count, int behind)
+{
+    static short block[2][4096];
+    short *stage[2] = {block[0], block[1]};
+    long long stamp = stamp_add(monotonic_ns(), -(long long) (count + behind), ESD_DEFAULT_RATE);
+    int n;
+
+    while (count > 0) {
+        n = min(count, 4096);
+        deinterleave_short(FMT_U8, buffer, 2, n, stage);
+        record_frames(stage, 2, n, ESD_DEFAULT_RATE, stamp);
+        stamp = stamp_add(stamp, n, ESD_DEFAULT_RATE);
+        buffer += 2*n;
+        count -= n;
     }
 }
 
 /* get data from sound card, return value is whether we triggered or not */
 static int esd_get_data(void)
 {
-    static unsigned char buffer[MAXWID * 2];
+    static unsigned char buffer[256 * 1024 * 2];     /* as many frames as one read takes */
     static int i, j, delay;
-    int fd;
+    int fd, n, pre, avail, keep;
+    int first = 0;
 
     if (esd >= 0) {
         fd = esd;
@@ -220,84 +264,104 @@ static int esd_get_data(void)
 
     if (!in_progress) {
         /* Discard excess samples so we can keep our time snapshot close to real-time and minimize
-         * sound recording overruns.  For ESD we don't know how many are available (do we?) so we
-         * discard them all to start with a fresh buffer that hopefully won't wrap around before we
-         * get it read.
+         * sound recording overruns.  FIONREAD tells us how far behind we are, so we can throw away
+         * just the part that is too old even for the pre-trigger history, without converting or
+         * searching any of it.  The socket still has to be read to get rid of it.
          */
+        pre = scope.pretrig ? pretrigger_samples(left_sig.width) : 0;
+        keep = min(2 * (left_sig.width + pre), sizeof(buffer));
+        if ((ioctl(fd, FIONREAD, &avail) == 0) && ((avail -= keep) > 0)) {
+            avail &= ~1;        /* whole frames */
+            while ((avail > 0) && ((j = read(fd, buffer, min(avail, sizeof(buffer)))) > 0)) {
+                avail -= j;
+                stats.skipped += j / 2;
+                if (record_active()) {
+                    record_buffer(buffer, j / 2, (avail + keep) / 2);
+                }
+            }
+            trigger_reset(&trig);   /* the trigger didn't see what we threw away */
+        }
+    }
 
-        /* read until we get something smaller than a full buffer */
-        while ((j = read(fd, buffer, sizeof(buffer))) == sizeof(buffer));
-
-    } else {
-
-        /* XXX this ends up discarding everything after a complete read */
-        j = read(fd, buffer, sizeof(buffer));
+    /* XXX this ends up discarding everything after a complete read */
+    j = read(fd, buffer, sizeof(buffer));
 
+    /* ... but not from the recording */
+    if ((j > 0) && record_active()) {
+        record_buffer(buffer, j / 2, 0);
     }
 
     i = 0;
 
     if (!in_progress) {
 
-        if (trigmode == 1) {
-            i ++;
-            while (((i+1)*2 <= j) && ((buffer[2*i + trigch] < triglev) ||
-                                      (buffer[2*(i-1) + trigch] >= triglev))) i ++;
-        } else if (trigmode == 2) {
-            i ++;
-            while (((i+1)*2 <= j) && ((buffer[2*i + trigch] > triglev) ||
-                                      (buffer[2*(i-1) + trigch] <= triglev))) i ++;
+        i = trigger_find_u8(&trig, buffer + trigch, max(j, 0) / 2, 2);
+
+        if (scope.pretrig) {
+            history_frames(buffer, i);
         }
 
         if ((i+1)*2 > j) {      /* haven't triggered within the screen */
             return 0;           /* give up and keep previous samples */
         }
 
+        pre = pretrigger_samples(left_sig.width);
+        signal_writable(&left_sig, 0);
+        signal_writable(&right_sig, 0);
+        history_copy(&left_hist, left_sig.data, pre);
+        history_copy(&right_hist, right_sig.data, pre);
+
         delay = 0;
 
-        if (trigmode) {
-            int last = buffer[2*(i-1) + trigch] - 127;
+        if (trig.mode) {
+            int last = trig.before - 127;
             int current = buffer[2*i + trigch] - 127;
             if (last != current) {
-                delay = abs(10000 * (current - (triglev - 127)) / (current - last));
+                delay = abs(10000 * (current - (trig.level - 127)) / (current - last));
             }
         }
 
-        left_sig.data[0] = buffer[2*i] - 127;
         left_sig.delay = delay;
-        left_sig.num = 1;
         left_sig.frame ++;
 
-        right_sig.data[0] = buffer[2*i + 1] - 127;
         right_sig.delay = delay;
-        right_sig.num = 1;
         right_sig.frame ++;
 
-        i ++;
-        in_progress = 1;
-    }
+        /* the last frame we just read is taken to be from now */
+        left_sig.stamp = stamp_add(monotonic_ns(), i - pre - j/2, left_sig.rate);
+        right_sig.stamp = left_sig.stamp;
 
-    while ((i+1)*2 <= j) {
-        if (in_progress >= left_sig.width) {
-            break;
-        }
-#if 0
-        if (*buff == 0 || *buff == 255) {
-            clip = i % 2 + 1;
-        }
-#endif
-        left_sig.data[in_progress] = buffer[2*i] - 127;
-        right_sig.data[in_progress] = buffer[2*i + 1] - 127;
+        first = i;
+        in_progress = pre;
+        stats.triggers ++;
+    }
 
-        in_progress ++;
-        i ++;
+    /* copy as much of the sweep as we have, starting with the trigger frame if we just triggered */
+    n = min(j/2 - i, left_sig.width - in_progress);
+    if (n > 0) {
+        short *out[2];
+
+        signal_writable(&left_sig, in_progress);
+        signal_writable(&right_sig, in_progress);
+        out[0] = left_sig.data + in_progress;
+        out[1] = right_sig.data + in_progress;
+        deinterleave_short(FMT_U8, buffer + 2*i, 2, n, out);
+        in_progress += n;
+        i += n;
     }
 
     left_sig.num = in_progress;
     right_sig.num = in_progress;
 
+    if (scope.pretrig) {
+        history_frames(buffer + 2*first, i - first);
+    }
+
     if (in_progress >= left_sig.width) {
         in_progress = 0;
+        stats.delivered ++;
+        stats.skipped += j/2 - i;
+        trigger_reset(&trig);   /* we throw away the rest of the buffer */
     }
 
     return 1;
@@ -312,10 +376,18 @@ static const char * esd_status_str(int i)
     case 2:
         if (esd_errormsg2) return esd_errormsg2;
         else return "";
+    case 6:
+    case 7:
+        return datasrc_stats_str(&stats, i - 6);
     }
     return NULL;
 }
 
+static const DataSrcStats * esd_stats(void)
+{
+    return &stats;
+}
+
 /* ESD option key 1 (*) - toggle Record mode */
 
 static int option1_esd(void)
@@ -384,4 +456,5 @@ DataSrc datasrc_esd = {
     esd_set_option,  /* set_option */
     esd_save_option,  /* save_option */
     esd_gtk_option_dialog,  /* gtk_options */
+    esd_stats,  /* stats */
 };
@@ -0,0 +1,235 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * xoscope-feed - feed xoscope's Shm data source from standard input
+ *
+ * This is the reference producer for the ring described in shmring.h.  It reads raw interleaved
+ * samples from its standard input straight into the ring, so the only copy of the data on this
+ * side is the read() itself, and hands the ring to whichever xoscope connects to its socket.  It
+ * never waits for xoscope: with nobody connected, the ring is just kept empty, and if xoscope
+ * falls too far behind, whatever doesn't fit is thrown away and counted as an overrun.
+ *
+ *      arecord -f S16_LE -c 2 -r 48000 -t raw | xoscope-feed -f S16 -c 2 -r 48000
+ *      xoscope -D Shm
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include "convert.h"
+#include "shmring.h"
+
+static const char *fmt_names[] = {"U8", "S16", "S24", "S32", "FLOAT"};
+#define NFORMATS ((int) (sizeof(fmt_names) / sizeof(fmt_names[0])))
+
+static const char *progname;
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: %s [-s socket] [-f U8|S16|S24|S32|FLOAT] [-c chans] [-r rate] "
+            "[-n frames]\n", progname);
+    exit(1);
+}
+
+/* Hand the memfd and the eventfd to a newly connected xoscope */
+
+static int send_fds(int conn, int memfd, int event_fd)
+{
+    char byte = 0;
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fds[2] = { memfd, event_fd };
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, 2 * sizeof(int));
+
+    return sendmsg(conn, &msg, MSG_NOSIGNAL) == 1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = DEFAULT_SHMSOCKET;
+    int format = FMT_S16;
+    int chans = 2;
+    int rate = 44100;
+    int frames = 65536;
+    struct sockaddr_un addr;
+    struct pollfd pfd[3];
+    ShmRing *ring;
+    size_t size;
+    char *where;
+    char *scratch;
+    int memfd, event_fd, listener;
+    int conn = -1;
+    int partial = 0;            /* bytes of a frame read beyond the head */
+    uint64_t one = 1;
+    uint32_t space;
+    ssize_t n, m;
+    int c, i;
+
+    progname = argv[0];
+    while ((c = getopt(argc, argv, "s:f:c:r:n:")) != -1) {
+        switch (c) {
+        case 's':
+            path = optarg;
+            break;
+        case 'f':
+            for (i = 0; (i < NFORMATS) && strcasecmp(optarg, fmt_names[i]); i++);
+            if (i == NFORMATS) usage();
+            format = i;
+            break;
+        case 'c':
+            chans = atoi(optarg);
+            break;
+        case 'r':
+            rate = atoi(optarg);
+            break;
+        case 'n':
+            frames = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if ((chans < 1) || (rate < 1) || (frames < 1) || (frames & (frames - 1))) {
+        fprintf(stderr, "%s: need at least one channel, a rate, and a power of two frames\n",
+                progname);
+        exit(1);
+    }
+
+    /* The ring */
+
+    size = shmring_size(frames, chans * sample_bytes(format));
+    if (((memfd = memfd_create("xoscope-feed", MFD_CLOEXEC)) < 0)
+        || (ftruncate(memfd, size) < 0)
+        || ((ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0))
+            == MAP_FAILED)) {
+        perror("memfd");
+        exit(1);
+    }
+    ring->magic = SHMRING_MAGIC;
+    ring->version = SHMRING_VERSION;
+    ring->rate = rate;
+    ring->chans = chans;
+    ring->format = format;
+    ring->frames = frames;
+    ring->frame_bytes = chans * sample_bytes(format);
+    ring->offset = size - (size_t) frames * ring->frame_bytes;
+
+    if ((event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("eventfd");
+        exit(1);
+    }
+    scratch = malloc(ring->frame_bytes * 1024);
+
+    /* The socket xoscope connects to */
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+    if (((listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        || (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+        || (listen(listener, 1) < 0)) {
+        perror(path);
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    pfd[0].fd = 0;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = listener;
+    pfd[1].events = POLLIN;
+    pfd[2].events = POLLIN;
+
+    while (1) {
+        pfd[2].fd = conn;
+        if (poll(pfd, (conn >= 0) ? 3 : 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            exit(1);
+        }
+
+        if (pfd[1].revents & POLLIN) {
+            /* One xoscope at a time: a new one takes over from the old one */
+            if (conn >= 0) close(conn);
+            conn = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+            if ((conn >= 0) && !send_fds(conn, memfd, event_fd)) {
+                close(conn);
+                conn = -1;
+            }
+        }
+
+        if ((conn >= 0) && (pfd[2].revents & (POLLIN | POLLHUP | POLLERR))) {
+            close(conn);            /* xoscope never writes, so it's gone */
+            conn = -1;
+        }
+
+        if (pfd[0].revents & (POLLIN | POLLHUP)) {
+            if (conn < 0) {
+                /* nobody reading, so the ring is ours: keep it empty */
+                __atomic_store_n(&ring->tail, ring->head, __ATOMIC_RELEASE);
+            }
+
+            space = shmring_space(ring, &where);
+            if (space > 0) {
+                /* The ring wraps at a frame boundary, so a partial frame read here is already
+                 * where the rest of it will go.  space can't be zero with a partial frame in it.
+                 */
+                n = read(0, where + partial, (size_t) space * ring->frame_bytes - partial);
+                if (n > 0) {
+                    partial += n;
+                    shmring_commit(ring, partial / ring->frame_bytes);
+                    partial %= ring->frame_bytes;
+                    if (conn >= 0) {
+                        write(event_fd, &one, sizeof(one));
+                    }
+                }
+            } else {
+                /* Full - throw away whole frames, finishing off the last one */
+                n = read(0, scratch, ring->frame_bytes * 1024);
+                while ((n > 0) && (m = n % ring->frame_bytes)
+                       && ((m = read(0, scratch + n, ring->frame_bytes - m)) > 0)) {
+                    n += m;
+                }
+                if (n > 0) {
+                    __atomic_add_fetch(&ring->overruns, 1, __ATOMIC_RELAXED);
+                }
+            }
+            if (n == 0) {
+                break;              /* end of input */
+            }
+            if ((n < 0) && (errno != EINTR) && (errno != EAGAIN)) {
+                perror("read");
+                break;
+            }
+        }
+    }
+
+    unlink(path);
+    return 0;
+}
@@ -35,7 +35,7 @@ int             fftLenIn = -1;
 int             xLayOut[FFT_DSP_LEN + 1];     /* Array of bin #'s displayed */
 
 /* Fast Fourier Transform of in to out */
-void fftW(short *in, short *out, int inLen)
+void fftW(Signal *in, short *out, int inLen)
 {
     int     k;
 #ifdef TIME_FFT
@@ -43,8 +43,21 @@ void fftW(short *in, short *out, int inLen)
     double time_spent;
 #endif
 
-    for (k = 0; k < inLen && k < fftLenIn; k++) {
-        dp[k] = (double)in[k];
+    switch (in->type) {
+    case SIG_S32:
+        for (k = 0; k < inLen && k < fftLenIn; k++) {
+            dp[k] = (double)in->data32[k];
+        }
+        break;
+    case SIG_FLOAT:
+        for (k = 0; k < inLen && k < fftLenIn; k++) {
+            dp[k] = (double)in->dataf[k];
+        }
+        break;
+    default:
+        for (k = 0; k < inLen && k < fftLenIn; k++) {
+            dp[k] = (double)in->data[k];
+        }
     }
 
 #ifdef TIME_FFT
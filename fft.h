@@ -14,7 +14,7 @@ extern int fftLenIn;
 extern int fftLenOut;
  
 void InitializeFFTW(int fftlen);
-void fftW(short *in, short *out, int inLen);
+void fftW(Signal *in, short *out, int inLen);
 void EndFFTW(void);
 int  floor2(int num);
 int  FFTactive(Signal *source, Signal *dest, int rateChange);
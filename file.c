@@ -14,6 +14,9 @@
 #include "xoscope.h"            /* program defaults */
 #include "display.h"            /* display routines */
 #include "func.h"               /* signal math functions */
+#include "deep.h"               /* deep sample buffers */
+#include "memfile.h"            /* file backed memories */
+#include "record.h"             /* continuous recorder */
 
 int backwards_compat_1_10 = 0;  /* TRUE if parsing a pre-1.10 save file */
 int backwards_compat_2_0 = 0;   /* TRUE if parsing a pre-2.0 save file */
@@ -62,6 +65,7 @@ void handle_opt(int opt, char *optarg)
                 fprintf(stderr, "Couldn't set option %s\n\n", optarg);
                 usage(1);
             }
+            datasrc_show_channels();
         }
         break;
     case 'r':                   /* soundcard sample rate - deprecated */
@@ -103,6 +107,14 @@ void handle_opt(int opt, char *optarg)
             } else {
                 scope.trigch = strtol(q, NULL, 0);
             }
+            p = q;
+        }
+        if ((q = strchr(p, ':')) != NULL) {
+            scope.pretrig = limit(strtol(++q, NULL, 0), 0, 90);
+            p = q;
+        }
+        if ((q = strchr(p, ':')) != NULL) {
+            scope.trighyst = limit(strtol(++q, NULL, 0), 0, 64);
         }
         if (datasrc && datasrc->set_trigger
             && datasrc->set_trigger(scope.trigch,
@@ -114,6 +126,21 @@ void handle_opt(int opt, char *optarg)
             scope.trige = 0;
         }
         break;
+    case 'm':                   /* memory bound to a file */
+    case 'M':
+        if ((optarg[0] >= 'a') && (optarg[0] <= 'z') && (optarg[1] == ':')) {
+            if ((p = strchr(optarg, '\n')) != NULL)
+                *p = '\0';
+            mem_bind(optarg[0] - 'a', optarg + 2);
+        }
+        break;
+    case 'e':                   /* record every sample */
+    case 'E':
+        if ((p = strchr(optarg, '\n')) != NULL)
+            *p = '\0';
+        record_start(optarg);
+        datasrc_check_record();
+        break;
     case 'l':                   /* cursor lines */
     case 'L':
         scope.curs = 1;
@@ -162,6 +189,10 @@ void handle_opt(int opt, char *optarg)
     case 'I':
         scope.min_interval = strtol(optarg, NULL, 0);
         break;
+    case 'w':                   /* threaded acquisition */
+    case 'W':
+        scope.threaded = 1;
+        break;
     case 'x':                   /* sound card (backwards compatibility) */
     case 'X':
     case 'y':
@@ -299,7 +330,7 @@ formatScale(double fScale)
 void writefile(char *filename)
 {
     FILE *file;
-    int i, j, k = 0, l = 0, chan[26];
+    int i, j, k = 0, l = 0, wide = 0, chan[26];
     char *s;
     Channel *p;
 
@@ -324,14 +355,14 @@ void writefile(char *filename)
 
     fprintf(file, "# -a %d\n\
 # -s %s\n\
-# -t %d:%d:%d\n\
+# -t %d:%d:%d:%d:%d\n\
 # -l %d:%d:%d\n\
 # -p %d\n\
 # -g %d\n\
 %s%s",
             scope.select + 1,
             formatScale(scope.scale),
-            scope.trig - 128, scope.trige, scope.trigch,
+            scope.trig - 128, scope.trige, scope.trigch, scope.pretrig, scope.trighyst,
             scope.cursa, scope.cursb, scope.curs,
             /* XXX fix this - plot_mode not backwards compatable anymore */
             /* XXX fix this - plot_mode now OK, but scope.scroll_mode = 2 not stored in file*/
@@ -340,6 +371,12 @@ void writefile(char *filename)
             scope.grat,
             scope.behind ? "# -b\n" : "",
             scope.verbose ? "# -v\n" : "");
+    /* Memories bound to files are already saved there; just remember which file */
+    for (i = 0 ; i < 26 ; i++) {
+        if (mem_file(i) != NULL) {
+            fprintf(file, "# -m %c:%s\n", 'a' + i, mem_file(i));
+        }
+    }
     for (i = 0 ; i < CHANNELS ; i++) {
         p = &ch[i];
         if (p->signal) {
@@ -349,8 +386,12 @@ void writefile(char *filename)
     }
     /* XXX code need to be carefully checked out */
     for (i = 0 ; i < 26 ; i++) {
+        if (mem_file(i) != NULL) {
+            continue;
+        }
         if (mem[i].num > 0) {
             chan[k++] = i;
+            wide |= (mem[i].type != SIG_S16);
         }
         if (mem[i].num > l) {
             l = mem[i].num;
@@ -371,16 +412,28 @@ void writefile(char *filename)
             fprintf(file, "%s%d", i ? "\t" : "\n#:", mem[chan[i]].rate);
         }
         for (i = 0 ; i < k ; i++) {
-#if SC_16BIT
-            fprintf(file, "%s%f", i ? "\t" : "\n#=", mem[chan[i]].volts);
-#else
-            fprintf(file, "%s%d", i ? "\t" : "\n#=", mem[chan[i]].volts);
-#endif
+            fprintf(file, "%s%g", i ? "\t" : "\n#=", mem[chan[i]].volts);
+        }
+        for (i = 0 ; i < k ; i++) {
+            fprintf(file, "%s%d", i ? "\t" : "\n#%", mem[chan[i]].resolution);
+        }
+        /* Sample types only if there's anything but shorts, so older versions can still read us */
+        for (i = 0 ; wide && i < k ; i++) {
+            fprintf(file, "%s%d", i ? "\t" : "\n#t", mem[chan[i]].type);
         }
         fprintf(file, "\n");
         for (j = 0 ; j < l ; j++) {
             for (i = 0 ; i < k ; i++) {
-                fprintf(file, "%s%d", i ? "\t" : "", mem[chan[i]].data[j]);
+                switch (mem[chan[i]].type) {
+                case SIG_S32:
+                    fprintf(file, "%s%d", i ? "\t" : "", mem[chan[i]].data32[j]);
+                    break;
+                case SIG_FLOAT:
+                    fprintf(file, "%s%g", i ? "\t" : "", mem[chan[i]].dataf[j]);
+                    break;
+                default:
+                    fprintf(file, "%s%d", i ? "\t" : "", mem[chan[i]].data[j]);
+                }
             }
             fprintf(file, "\n");
         }
@@ -399,9 +452,7 @@ void readfile(char *filename)
     int i = 0, j = 0, k, valid = 0, chan[26] =
         {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
          -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1};
-#if SC_16BIT
     double lf;
-#endif
     if ((file = fopen(filename, "r")) == NULL) {
         sprintf(error, "%s: can't read %s", progname, filename);
         message(error);
@@ -436,11 +487,17 @@ void readfile(char *filename)
                         //XXX 'k' is color and it is ignored
                         //mem[c - 'a'].color = color[k];
                         mem[c - 'a'].frame ++;
+                        /* These samples replace whatever the memory held, its file's
+                         * mapping too, and aren't in that file, so let go of it.
+                         */
+                        mem_free(c - 'a');
+                        mem_unbind(c - 'a');
                         /* Guess some multiple of two here for our data size.
                          * We'll adjust this up if needed.
                          */
-                        mem[c - 'a'].data = malloc(16 * sizeof(short));
+                        mem[c - 'a'].data = deep_new(short, 16);
                         mem[c - 'a'].width = 16;
+                        mem[c - 'a'].type = SIG_S16;
                     }
                     q += 6;
                 }
@@ -454,17 +511,29 @@ void readfile(char *filename)
             } else if (!strncmp("#=", buff, 2)) {
                 j = 0;
                 q = buff + 2;
-#if SC_16BIT
                 while (q && j < 26 && (sscanf(q, "%lf ", &lf) == 1)) {
                     mem[chan[j++]].volts = lf;
                     q = strchr(++q, '\t');
                 }
-#else
+            } else if (!strncmp("#%", buff, 2)) {
+                j = 0;
+                q = buff + 2;
                 while (q && j < 26 && (sscanf(q, "%d ", &k) == 1)) {
-                    mem[chan[j++]].volts = k;
+                    mem[chan[j++]].resolution = k;
+                    q = strchr(++q, '\t');
+                }
+            } else if (!strncmp("#t", buff, 2)) {
+                j = 0;
+                q = buff + 2;
+                while (q && j < 26 && (sscanf(q, "%d ", &k) == 1)) {
+                    if (k == SIG_S32 || k == SIG_FLOAT) {
+                        mem[chan[j]].type = k;
+                        mem[chan[j]].data = deep_realloc(mem[chan[j]].data,
+                                                         mem[chan[j]].width * sample_size(k));
+                    }
+                    j++;
                     q = strchr(++q, '\t');
                 }
-#endif
             }
         } else if (valid &&
                    ((buff[0] >= '0' && buff[0] <= '9') || buff[0] == '-')) {
@@ -483,10 +552,20 @@ void readfile(char *filename)
                         while (mem[chan[j]].width <= i) {
                             mem[chan[j]].width *= 2;
                         }
-                        mem[chan[j]].data = realloc(mem[chan[j]].data,
-                                                    mem[chan[j]].width * sizeof(short));
+                        mem[chan[j]].data = deep_realloc(mem[chan[j]].data,
+                                                         mem[chan[j]].width
+                                                         * sample_size(mem[chan[j]].type));
+                    }
+                    switch (mem[chan[j]].type) {
+                    case SIG_S32:
+                        mem[chan[j]].data32[i] = strtol(p, NULL, 0);
+                        break;
+                    case SIG_FLOAT:
+                        mem[chan[j]].dataf[i] = strtod(p, NULL);
+                        break;
+                    default:
+                        mem[chan[j]].data[i] = strtol(p, NULL, 0);
                     }
-                    mem[chan[j]].data[i] = strtol(p, NULL, 0);
                     mem[chan[j]].num = i + 1;
 
                     p ++;
@@ -24,10 +24,13 @@
 #include "fft.h"
 #include "display.h"
 #include "func.h"
+#include "deep.h"
+#include "memfile.h"
+#include "trigger.h"
 #include "xoscope_gtk.h"
 
 Signal mem[26];         /* 26 memories, corresponding to 26 letters */
-short  mem_pending[26]; /* Flags to indicate we wont to store a channel when a sweep is complete */
+short  mem_pending[26]; /* Display channel to store in each memory, or -1 */
 
 /* recall given memory register to the currently selected signal */
 void recall_on_channel(Signal *signal, Channel *ch)
@@ -47,7 +50,7 @@ void recall(Signal *signal)
     recall_on_channel(signal, &ch[scope.select]);
 }
 
-extern int in_progress;
+extern __thread int in_progress;
 
 /* store the currently selected signal to the given memory register */
 
@@ -57,13 +60,15 @@ void set_save_pending(char c)
     mem_pending[c - 'A'] = scope.select;
 }
 
+/* Storing doesn't wait for the sweep to complete: save() only takes a reference to the samples, so
+ * the memory gets the sweep as far as it's on the screen, and the data source carries on in a
+ * buffer of its own (see signal_writable()).
+ */
+
 void do_save_pending(void)
 {
     int i;
 
-    if(in_progress)
-        return;
-        
     for(i = 0; i < 26; i++){
         if(mem_pending[i] >= 0){
             save(i, mem_pending[i]);
@@ -78,30 +83,41 @@ void do_save_pending(void)
     }
 }
 
+/* The memory shares the signal's buffer rather than copying it, so storing costs the same however
+ * deep the sweep is.  Only samples in a memory file's mapping (see memfile.c) can't be shared, and
+ * get copied.
+ */
+
 void save(int dest, int src)
 {
-    if (ch[src].signal == NULL) 
+    Signal *sig = ch[src].signal;
+
+    if ((sig == NULL) || (sig == &mem[dest]))
         return;
 
     /* Don't want the name - leave that at 'Memory x'
      * Also, increment frame instead of setting it to signal->frame in case signal->frame is the
      * same as mem's old frame number!
      */
-    if (mem[dest].data != NULL) {
-        free(mem[dest].data);
-    }
-    mem[dest].data = malloc(ch[src].signal->width * sizeof(short));
-    if(mem[dest].data == NULL){
-        fprintf(stderr, "malloc failed in save()\n");
-        exit(0);
+    if (mem_store_file(dest, sig))
+        return;
+
+    if ((sig >= mem) && (sig < mem + 26) && mem_mapped(sig - mem)) {
+        signal_alloc(&mem[dest], sig->type, sig->width);
+        memcpy(mem[dest].data, sig->data, (size_t) sig->num * sample_size(sig->type));
+    } else {
+        mem_free(dest);
+        mem[dest].data = deep_ref(sig->data);
+        mem[dest].type = sig->type;
     }
-    memcpy(mem[dest].data, ch[src].signal->data, ch[src].signal->width * sizeof(short));
 
-    mem[dest].rate = ch[src].signal->rate;
-    mem[dest].num = ch[src].signal->width;
-    mem[dest].width = ch[src].signal->width;
+    mem[dest].rate = sig->rate;
+    mem[dest].num = sig->num;
+    mem[dest].width = sig->width;
     mem[dest].frame ++;
-    mem[dest].volts = ch[src].signal->volts;
+    mem[dest].volts = sig->volts;
+    mem[dest].resolution = sig->resolution;
+    mem[dest].stamp = sig->stamp;
 }
 
 /* !!! External process handling
@@ -211,7 +227,7 @@ void start_program_on_channel(const char *command, Channel *ch_select)
      */
 
     if (ch[0].signal != NULL) {
-        ext->signal.data = g_new(short, ch[0].signal->width);
+        ext->signal.data = deep_new(short, ch[0].signal->width);
 
         ext->signal.width = ch[0].signal->width;
         ext->signal.rate = ch[0].signal->rate;
@@ -305,7 +321,7 @@ void start_perl_function_on_channel(const char *command, Channel *ch_select)
      */
 
     if (ch[0].signal != NULL) {
-        ext->signal.data = g_new(short, ch[0].signal->width);
+        ext->signal.data = deep_new(short, ch[0].signal->width);
 
         ext->signal.width = ch[0].signal->width;
         ext->signal.rate = ch[0].signal->rate;
@@ -372,7 +388,7 @@ void restart_external_commands(void)
     struct external *ext;
 
     for (ext = externals; ext != NULL; ext = ext->next) {
-        ext->signal.data = g_renew(short, ext->signal.data, ch[0].signal->width);
+        ext->signal.data = deep_renew(short, ext->signal.data, ch[0].signal->width);
         ext->signal.width = ch[0].signal->width;
         ext->signal.num = 0;
     }
@@ -385,11 +401,23 @@ void restart_external_commands(void)
  * XXX externals shouldn't depend on having signals on both channels 1 and 2
  */
 
+/* External commands are fed shorts, whatever the type of channels 1 and 2 */
+
+static short sample_short(Signal *sig, int i)
+{
+    double v;
+
+    if (sig->type == SIG_S16)
+        return sig->data[i];
+    v = sample_value(sig, i);
+    return (v > SHRT_MAX) ? SHRT_MAX : (v < SHRT_MIN) ? SHRT_MIN : lrint(v);
+}
+
 static void run_externals(void)
 {
     struct external *ext;
 
-    short *a, *b, *c;
+    short a, b, *c;
     int i;
     char error_message[256];
 
@@ -411,6 +439,7 @@ static void run_externals(void)
                     ext->last_frame_ch1 = ch[1].signal->frame;
                     ext->signal.frame ++;
                     ext->signal.num = 0;
+                    ext->signal.stamp = ch[0].signal->stamp;
                 }
 
                 /* To avoid a race condition that might drop data or error messages, we check first
@@ -440,18 +469,19 @@ static void run_externals(void)
                  */
 
                 if ((ext->signal.width < ch[0].signal->width) && (ext->signal.width < ch[1].signal->width)) {
-                    ext->signal.data = g_renew(short, ext->signal.data, ch[0].signal->width);
+                    ext->signal.data = deep_renew(short, ext->signal.data, ch[0].signal->width);
                     ext->signal.width = ch[0].signal->width;
                 }
 
-                a = ch[0].signal->data + ext->signal.num;
-                b = ch[1].signal->data + ext->signal.num;
+                signal_writable(&ext->signal, ext->signal.num);
                 c = ext->signal.data + ext->signal.num;
 
                 for (i = ext->signal.num; (i < ch[0].signal->num) && (i < ch[1].signal->num); i++) {
-                    if (write(ext->to, a++, sizeof(short)) != sizeof(short))
+                    a = sample_short(ch[0].signal, i);
+                    b = sample_short(ch[1].signal, i);
+                    if (write(ext->to, &a, sizeof(short)) != sizeof(short))
                         break;
-                    if (write(ext->to, b++, sizeof(short)) != sizeof(short))
+                    if (write(ext->to, &b, sizeof(short)) != sizeof(short))
                         break;
                     if (read(ext->from, c++, sizeof(short)) != sizeof(short))
                         break;
@@ -497,23 +527,35 @@ static void run_externals(void)
 
 /* !!! The functions; they take one arg: a Signal ptr to store results in */
 
-/* Invert */
+/* Invert, into the same type (see ch1active()) */
 void inv(Signal *dest, Signal *src)
 {
     int i;
-    short *a, *b;
 
-    if (src == NULL) return;
+    if ((src == NULL) || (src->type != dest->type)) return;
 
     dest->rate = src->rate;
     dest->num = src->num;
     dest->volts = src->volts;
+    dest->resolution = src->resolution;
     dest->frame = src->frame;
+    dest->stamp = src->stamp;
 
-    a = src->data;
-    b = dest->data;
-    for (i = 0 ; i < src->num; i++) {
-        *b++ = -1 * *a++;
+    switch (src->type) {
+    case SIG_S32:
+        for (i = 0 ; i < src->num; i++) {
+            dest->data32[i] = (src->data32[i] == INT_MIN) ? INT_MAX : -src->data32[i];
+        }
+        break;
+    case SIG_FLOAT:
+        for (i = 0 ; i < src->num; i++) {
+            dest->dataf[i] = -src->dataf[i];
+        }
+        break;
+    default:
+        for (i = 0 ; i < src->num; i++) {
+            dest->data[i] = (src->data[i] == SHRT_MIN) ? SHRT_MAX : -src->data[i];
+        }
     }
 }
 
@@ -527,86 +569,105 @@ void inv2(Signal *sig)
     inv(sig, ch[1].signal);
 }
 
-/* The sum of the two channels */
-void sum(Signal *dest)
+/* Channels 1 and 2 can have different rates.  The math of the two works at the faster one (see
+ * chs12active()), and holds each sample of the slower one until its next one comes along.
+ */
+
+static inline int chs12_index(Signal *sig, Signal *dest, int i)
 {
-    int i;
-    short *a, *b, *c;
-    int sum;
+    if (sig->rate == dest->rate) {
+        return i;
+    }
+    return (long long) i * sig->rate / dest->rate;
+}
 
-    if ((ch[0].signal == NULL) || (ch[1].signal == NULL)) 
-        return;
+/* How many samples of the math there are data for on both channels */
 
-    a = ch[0].signal->data;
-    b = ch[1].signal->data;
-    c = dest->data;
+static int chs12_num(Signal *dest)
+{
+    Signal *a = ch[0].signal, *b = ch[1].signal;
 
-    dest->frame = ch[0].signal->frame + ch[1].signal->frame;
-    dest->num = ch[0].signal->num;
+    if (a->rate == b->rate) {
+        return min(a->num, b->num);
+    }
+    return min(dest->width, min((long long) a->num * dest->rate / a->rate,
+                                (long long) b->num * dest->rate / b->rate));
+}
 
-    if (dest->num > ch[1].signal->num) 
-        dest->num = ch[1].signal->num;
+/* An integer sample, of a Signal that's SIG_S16 or SIG_S32 */
 
-    for (i = 0 ; i < dest->num ; i++) {
-        sum = *a++ + *b++;
-        if(sum > SHRT_MAX)
-            sum = SHRT_MAX;
-        else if(sum < SHRT_MIN)
-           sum = SHRT_MIN;
-        *c++ = (short)sum;
-    }
+static inline int sample_int(Signal *sig, int i)
+{
+    return (sig->type == SIG_S32) ? sig->data32[i] : sig->data[i];
 }
 
-/* The difference of the two channels */
-void diff(Signal *dest)
+/* Channel 1 plus 'sign' times channel 2, times 'scale', into dest.  The isvalid() functions below
+ * picked a dest->type that holds the result; the integer types still saturate, but only inputs
+ * that are themselves that wide can get there.
+ */
+
+static void chs12_math(Signal *dest, int sign, double scale)
 {
+    Signal *a = ch[0].signal, *b = ch[1].signal;
+    long long v;
     int i;
-    short *a, *b, *c;
-    int sum;
 
+    dest->frame = a->frame + b->frame;
+    dest->stamp = a->stamp;
+    dest->num = chs12_num(dest);
+
+    switch (dest->type) {
+    case SIG_S16:               /* both channels S16, and 8 bits wide */
+        if ((a->type != SIG_S16) || (b->type != SIG_S16))
+            break;
+        for (i = 0 ; i < dest->num ; i++) {
+            v = a->data[chs12_index(a, dest, i)] + sign * b->data[chs12_index(b, dest, i)];
+            dest->data[i] = (v > SHRT_MAX) ? SHRT_MAX : (v < SHRT_MIN) ? SHRT_MIN : v;
+        }
+        break;
+    case SIG_S32:               /* both channels S16 or S32 */
+        if ((a->type == SIG_FLOAT) || (b->type == SIG_FLOAT))
+            break;
+        for (i = 0 ; i < dest->num ; i++) {
+            v = (long long) sample_int(a, chs12_index(a, dest, i))
+                + sign * sample_int(b, chs12_index(b, dest, i));
+            dest->data32[i] = (v > INT_MAX) ? INT_MAX : (v < INT_MIN) ? INT_MIN : v;
+        }
+        break;
+    case SIG_FLOAT:
+        for (i = 0 ; i < dest->num ; i++) {
+            dest->dataf[i] = (sample_value(a, chs12_index(a, dest, i))
+                              + sign * sample_value(b, chs12_index(b, dest, i))) * scale;
+        }
+        break;
+    }
+}
+
+/* The sum of the two channels */
+void sum(Signal *dest)
+{
     if ((ch[0].signal == NULL) || (ch[1].signal == NULL))
         return;
 
-    a = ch[0].signal->data;
-    b = ch[1].signal->data;
-    c = dest->data;
-
-    dest->frame = ch[0].signal->frame + ch[1].signal->frame;
-    dest->num = ch[0].signal->num;
+    chs12_math(dest, 1, 1.0);
+}
 
-    if (dest->num > ch[1].signal->num) dest->num = ch[1].signal->num;
+/* The difference of the two channels */
+void diff(Signal *dest)
+{
+    if ((ch[0].signal == NULL) || (ch[1].signal == NULL))
+        return;
 
-    for (i = 0 ; i < dest->num ; i++) {
-         sum = *a++ - *b++;
-        if(sum > SHRT_MAX)
-            sum = SHRT_MAX;
-        else if(sum < SHRT_MIN)
-           sum = SHRT_MIN;
-        *c++ = (short)sum;
-    }
+    chs12_math(dest, -1, 1.0);
 }
 
 
 /* The average of the two channels */
 void avg(Signal *dest)
 {
-    int i;
-    short *a, *b, *c;
-
     if ((ch[0].signal == NULL) || (ch[1].signal == NULL)) return;
 
-    a = ch[0].signal->data;
-    b = ch[1].signal->data;
-    c = dest->data;
-
-    dest->frame = ch[0].signal->frame + ch[1].signal->frame;
-    dest->num = ch[0].signal->num;
-
-    if (dest->num > ch[1].signal->num) dest->num = ch[1].signal->num;
-
-    for (i = 0 ; i < dest->num ; i++) {
-        *c++ = (*a++ + *b++) / 2;
-    }
+    chs12_math(dest, 1, 0.5);
 }
 
 /* Fast Fourier Transform of channels 0 and 1
@@ -623,7 +684,9 @@ void fft1(Signal *dest)
     if (in_progress != 0 || !scope.run)
         return;
 
-    fftW(ch[0].signal->data, dest->data, ch[0].signal->width);
+    signal_writable(dest, 0);
+    fftW(ch[0].signal, dest->data, ch[0].signal->width);
+    dest->stamp = ch[0].signal->stamp;
 }
 
 #ifndef FFT_TEST
@@ -635,7 +698,9 @@ void fft2(Signal *dest)
     if (in_progress != 0 || !scope.run)
         return;
 
-    fftW(ch[1].signal->data, dest->data, ch[1].signal->width);
+    signal_writable(dest, 0);
+    fftW(ch[1].signal, dest->data, ch[1].signal->width);
+    dest->stamp = ch[1].signal->stamp;
 }
 
 #else
@@ -652,6 +717,7 @@ void fft2(Signal *dest)
     int i;
     static short    *testdata = NULL;
     static int      testdataWidth = -1;
+    Signal          test = { .type = SIG_S16 };
     
     if (ch[1].signal == NULL){
         fprintf(stderr, "fft2() ch[1].signal == NULL\n");
@@ -670,7 +736,8 @@ void fft2(Signal *dest)
         make_sin(testdata, testdataWidth, 2500.0, ch[1].signal->rate);
     }
 
-    fftW(testdata, dest->data, testdataWidth);
+    test.data = testdata;
+    fftW(&test, dest->data, testdataWidth);
 
     for(i = 0; i< FFT_DSP_LEN - 20; i+=20){
         dest->data[i] = -80;
@@ -687,9 +754,23 @@ void fft2(Signal *dest)
  * these functions.
  *
  * These functions are also responsible for mallocing the data areas in the math function's
- * associated Signal structures.
+ * associated Signal structures, and for picking the type of their samples.
  */
 
+/* Make room in sig for 'width' samples of 'type', unless it already has a buffer of its own */
+
+void signal_alloc(Signal *sig, int type, int width)
+{
+    if ((sig->data != NULL) && (sig->type == type) && (sig->width == width)
+        && !deep_shared(sig->data))
+        return;
+
+    deep_free(sig->data);
+    sig->type = type;
+    sig->width = width;
+    sig->data = deep_alloc((size_t) width * sample_size(type));
+}
+
 int ch1active(Signal *dest)
 {
     dest->frame = 0;
@@ -703,17 +784,9 @@ int ch1active(Signal *dest)
 
     dest->rate = ch[0].signal->rate;
     dest->volts = ch[0].signal->volts;
+    dest->resolution = ch[0].signal->resolution;
 
-    if (dest->width != ch[0].signal->width) {
-        dest->width = ch[0].signal->width;
-        if (dest->data != NULL)
-            free(dest->data);
-        dest->data = malloc(ch[0].signal->width * sizeof(short));
-        if(dest->data == NULL){
-            fprintf(stderr, "malloc failed in ch1active()\n");
-            exit(0);
-        }
-    }
+    signal_alloc(dest, ch[0].signal->type, ch[0].signal->width);
 
     return 1;
 }
@@ -731,55 +804,72 @@ int ch2active(Signal *dest)
 
     dest->rate = ch[1].signal->rate;
     dest->volts = ch[1].signal->volts;
+    dest->resolution = ch[1].signal->resolution;
 
-    if (dest->width != ch[1].signal->width) {
-        dest->width = ch[1].signal->width;
-        if (dest->data != NULL)
-            free(dest->data);
-        dest->data = malloc(ch[1].signal->width * sizeof(short));
-        if(dest->data == NULL){
-            fprintf(stderr, "malloc failed in ch2active()\n");
-            exit(0);
-        }
-    }
+    signal_alloc(dest, ch[1].signal->type, ch[1].signal->width);
 
     return 1;
 }
 
-int chs12active(Signal *dest)
+/* The type sum and diff work in: a short only holds the sum of two 8 bit channels */
+
+static int chs12_type(void)
 {
+    Signal *a = ch[0].signal, *b = ch[1].signal;
+
+    if ((a->type == SIG_FLOAT) || (b->type == SIG_FLOAT))
+        return SIG_FLOAT;
+    if ((a->type == SIG_S16) && (b->type == SIG_S16) && (SAMPLE_UNIT(a) == 1))
+        return SIG_S16;
+    return SIG_S32;
+}
+
+static int chs12_setup(Signal *dest, int fractions)
+{
+    Signal *fast;
+
     dest->frame = 0;
     dest->num = 0;
 
     if ((ch[0].signal == NULL) || (ch[1].signal == NULL)
-        || (ch[0].signal->rate != ch[1].signal->rate)
-        || (ch[0].signal->volts != ch[1].signal->volts)) {
+        || ((ch[0].signal->rate != ch[1].signal->rate)
+            && ((ch[0].signal->rate <= 0) || (ch[1].signal->rate <= 0)))
+        || (ch[0].signal->volts != ch[1].signal->volts)
+        || (SAMPLE_UNIT(ch[0].signal) != SAMPLE_UNIT(ch[1].signal))) {
         dest->rate = 0;
         dest->volts = 0;
         return 0;
     }
 
-    dest->rate = ch[0].signal->rate;
+    /* The rates can differ; the result is at the faster one (see chs12_index()) */
+
+    fast = (ch[1].signal->rate > ch[0].signal->rate) ? ch[1].signal : ch[0].signal;
+
+    dest->rate = fast->rate;
     dest->volts = ch[0].signal->volts;
+    dest->resolution = ch[0].signal->resolution;
 
-    /* All of the associated functions (sum, diff, avg) only use the minimum of the samples on
-     * Channels 1 and 2, so we can safely base the size of our data array on Channel 1 only... the
+    /* All of the associated functions (sum, diff, avg) only use the samples that both Channels 1
+     * and 2 cover, so we can safely base the size of our data array on the faster channel... the
      * worst that can happen is that it is too big.
      */
 
-    if (dest->width != ch[0].signal->width) {
-        dest->width = ch[0].signal->width;
-        if (dest->data != NULL)
-            free(dest->data);
-        dest->data = malloc(ch[0].signal->width * sizeof(short));
-        if(dest->data == NULL){
-            fprintf(stderr, "malloc failed in ch12active()\n");
-            exit(0);
-        }
-    }
+    signal_alloc(dest, fractions ? SIG_FLOAT : chs12_type(), fast->width);
     return 1;
 }
 
+int chs12active(Signal *dest)
+{
+    return chs12_setup(dest, 0);
+}
+
+/* The average has halves in it, so it's always SIG_FLOAT */
+
+int chs12avgactive(Signal *dest)
+{
+    return chs12_setup(dest, 1);
+}
+
 /* special isvalid() functions for FFT
  *
  * First, it allocates memory for the generated fft.
@@ -824,7 +914,7 @@ struct func funcarray[] = {
     {inv2, "Inv. 2  ", ch2active},
     {sum,  "Sum  1+2", chs12active},
     {diff, "Diff 1-2", chs12active},
-    {avg,  "Avg. 1,2", chs12active},
+    {avg,  "Avg. 1,2", chs12avgactive},
     {fft1, "FFT. 1  ", ch1FFTactive},
     {fft2, "FFT. 2  ", ch2FFTactive},
 };
@@ -927,11 +1017,12 @@ void init_math(void)
     static int once = 0;
 
     for (i = 0 ; i < 26 ; i++) {
-        if (once==1 && mem[i].data != NULL) {
-            free(mem[i].data);
+        if (once==1) {
+            mem_free(i);
+            mem_unbind(i);
         }
         mem[i].data = NULL;
-        mem[i].num = mem[i].frame = mem[i].volts = 0;
+        mem[i].num = mem[i].frame = mem[i].volts = mem[i].resolution = 0;
         mem[i].listeners = 0;
         sprintf(mem[i].name, "Memory %c", 'a' + i);
         mem[i].savestr[0] = 'a' + i;
@@ -994,13 +1085,39 @@ void cleanup_math(void)
     EndFFTW();
 }
 
+/* The next rising edge in sig at or after sample i, relative to i, like trigger_find_s16() does it
+ * for the S16 signals
+ */
+
+static int measure_find(Trigger *t, Signal *sig, int i)
+{
+    int n = sig->num - i;
+    int k;
+    double v;
+
+    if (sig->type == SIG_S16)
+        return trigger_find_s16(t, sig->data + i, n, 1);
+
+    for (k = 0; k < n; k++) {
+        v = sample_value(sig, i + k);
+        if (v < (double) t->level - t->hyst) {
+            t->armed = 1;
+        } else if (t->armed && (v >= t->level)) {
+            t->armed = 0;
+            return k;
+        }
+    }
+    return n;
+}
+
 /* measure the given channel */
 
 void measure_data(Channel *sig, struct signal_stats *stats)
 {
-    int     i, k;
-    short   val, prev;
+    int     i;
+    int     val;
     int     min=0, max=0, midpoint=0;
+    Trigger edge;
     int     first = 0, last = 0, count = 0, imax = 0;
 #if CALC_RMS
     int     second = 0.0;
@@ -1020,7 +1137,6 @@ void measure_data(Channel *sig, struct signal_stats *stats)
      * sensibly
      */
 
-    prev = 1;
     if (scope.curs) {           /* manual cursor measurements */
         if (scope.cursa < scope.cursb) {
             first = scope.cursa;
@@ -1029,56 +1145,60 @@ void measure_data(Channel *sig, struct signal_stats *stats)
             first = scope.cursb;
             last = scope.cursa;
         }
-        stats->min = stats->max = sig->signal->data[(int)first];
-        if ((val = sig->signal->data[(int)last]) < stats->min)
+        stats->min = stats->max = lrint(sample_value(sig->signal, first));
+        if ((val = lrint(sample_value(sig->signal, last))) < stats->min)
             stats->min = val;
         else if (val > stats->max)
             stats->max = val;
         count = 2;
     } else {                    /* automatic period measurements */
-        min = max = sig->signal->data[0];
-        for (i = 0 ; i < sig->signal->num ; i++) {
-            val = sig->signal->data[i];
-            if (val < min)
-                min = val;
-            if (val > max) {
-                max = val;
-                imax = i;
+        if (sig->signal->type == SIG_S16) {
+            min = max = sig->signal->data[0];
+            for (i = 0 ; i < sig->signal->num ; i++) {
+                val = sig->signal->data[i];
+                if (val < min)
+                    min = val;
+                if (val > max) {
+                    max = val;
+                    imax = i;
+                }
+            }
+        } else {
+            min = max = lrint(sample_value(sig->signal, 0));
+            for (i = 0 ; i < sig->signal->num ; i++) {
+                val = lrint(sample_value(sig->signal, i));
+                if (val < min)
+                    min = val;
+                if (val > max) {
+                    max = val;
+                    imax = i;
+                }
             }
         }
 
-        /* locate and count rising edges
-         * tries to handle handle noise by looking at the next 10 values.
+        /* locate and count rising edges through the midpoint, with the same edge detector the
+         * data sources trigger with.  The hysteresis band (a tenth of the peak to peak value)
+         * keeps noise around the midpoint from counting as extra edges.
          */
         midpoint = (min + max)/2;
-        prev = max;
-        for (i = 0; i < sig->signal->num; i++) {
-            val = sig->signal->data[i];
-            if (val > midpoint && prev <= midpoint){
-                int rising = 0;
-                for(k = i + 1; k < i + 11 && k < sig->signal->num; k++) {
-                    if(sig->signal->data[k] > val){
-                        rising++;
-                     }
-                 }   
-                if(rising > 5){
-                    if (!first)
-                        first = i;
+        edge.mode = 1;
+        edge.level = midpoint + 1;
+        edge.hyst = (max - min) / 10;
+        trigger_reset(&edge);
+        for (i = 0; (i += measure_find(&edge, sig->signal, i)) < sig->signal->num; i++) {
+            if (!first)
+                first = i;
 #if CALC_RMS
-                    else if (!second)
-                        second = i;
+            else if (!second)
+                second = i;
 #endif
-                    last = i;
-                    i = k;
-                    count++;
-                }
-            }
-            prev = val;
+            last = i;
+            count++;
         }
 
 #if CALC_RMS
         for (i = first; i < second; i++) {
-            stats->rms += (sig->signal->data[i] * sig->signal->data[i]);
+            stats->rms += sample_value(sig->signal, i) * sample_value(sig->signal, i);
         }
         if((second - first) != 0){
             stats->rms = sqrt(stats->rms / (second - first));
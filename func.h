@@ -24,8 +24,8 @@
 #endif
 
 struct signal_stats {
-    short min;                  /* Minimum signal value */
-    short max;                  /* Maximum signal value */
+    int min;                    /* Minimum signal value */
+    int max;                    /* Maximum signal value */
     int time;
     int freq;
 #ifdef CALC_RMS
@@ -36,6 +36,7 @@ struct signal_stats {
 void set_save_pending(char c);
 void do_save_pending(void);
 void save(int i, int src);
+void signal_alloc(Signal *, int, int);
 void recall_on_channel(Signal *, Channel *);
 void recall(Signal *);
 
@@ -0,0 +1,640 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * This file implements a built-in signal generator data source
+ *
+ * It makes up its samples instead of reading them from a device, so xoscope can be driven (and the
+ * trigger, math and display timed) on machines without any sound card.  The channels, rate, bit
+ * width, waveform and frequency are all data source options.  Like the Replay source, it is paced
+ * by a timerfd: at the set rate, skipping ahead (for free) when we fall behind, or as fast as we
+ * can go with speed=max.
+ *
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include "xoscope.h"            /* program defaults */
+#include "history.h"
+#include "deep.h"
+#include "trigger.h"
+#include "convert.h"
+#include "record.h"
+
+#define GEN_CHANS CHANNELS
+#define GEN_MAXRATE 50000000
+
+static const char *wave_names[] = {"sine", "square", "triangle", "noise", "burst", "glitch"};
+#define NWAVES ((int) (sizeof(wave_names) / sizeof(wave_names[0])))
+
+enum { SINE, SQUARE, TRIANGLE, NOISE, BURST, GLITCH };
+
+static int gen_chans = 2;
+static int gen_rate = DEF_R;
+static int gen_bits = 16;               /* 1 to 16 */
+static int gen_wave = SINE;
+static double gen_freq = 1000.0;        /* Hz */
+static int gen_max = 0;                 /* 1 - as fast as we can; 0 - at gen_rate */
+
+static int timer_fd = -1;
+
+/* Pacing: the next sample we make, and the clock it was due by */
+static struct timespec started;
+static long long next_sample;
+static long long delivered;
+
+static Signal gen_sigs[GEN_CHANS];
+static History gen_hist[GEN_CHANS];
+
+static Trigger trig;
+static int trigch;
+static DataSrcStats stats;
+static int triglev;                     /* trigger level, in 8 bit sample values */
+
+static short *stage[GEN_CHANS];
+static int bufferSizeFrames = 0;
+
+/* Sine table, one period */
+#define SINE_BITS 12
+static short sine_table[1 << SINE_BITS];
+static int sine_amp = 0;                /* the amplitude sine_table[] was made for */
+
+static uint32_t noise_state = 1;
+
+static int resolution(void)
+{
+    return (gen_bits > 8) ? 16 : 8;
+}
+
+/* Full scale, in the 8 or 16 bit sample values of the Signals; generate() drops the bits past
+ * gen_bits afterwards
+ */
+
+static int amplitude(void)
+{
+    return (1 << (resolution() - 1)) - 1;
+}
+
+/* Samples just short of full scale, so the trigger has something to aim at */
+
+static inline short scaled(double v, int amp)
+{
+    return (short) lrint(v * amp * 0.8);
+}
+
+static void make_sine_table(int amp)
+{
+    int i;
+
+    for (i = 0; i < (1 << SINE_BITS); i++) {
+        sine_table[i] = scaled(sin(2.0 * M_PI * i / (1 << SINE_BITS)), amp);
+    }
+    sine_amp = amp;
+}
+
+/* Make 'n' samples of channel 'c', starting with sample number 't'.  Each channel runs a fraction
+ * of a period behind the one before it, so they can be told apart.
+ */
+
+static void generate(short *out, int c, long long t, int n)
+{
+    double step = gen_freq / gen_rate;
+    double phase = fmod(t * step + (double) c / gen_chans, 1.0);
+    int amp = amplitude();
+    int k;
+
+    if (gen_wave == SINE || gen_wave == BURST) {
+        if (amp != sine_amp) {
+            make_sine_table(amp);
+        }
+    }
+
+    for (k = 0; k < n; k++) {
+        switch (gen_wave) {
+        case SINE:
+            out[k] = sine_table[(int) (phase * (1 << SINE_BITS))];
+            break;
+        case SQUARE:
+            out[k] = scaled((phase < 0.5) ? 1.0 : -1.0, amp);
+            break;
+        case TRIANGLE:
+            out[k] = scaled((phase < 0.5) ? 4.0 * phase - 1.0 : 3.0 - 4.0 * phase, amp);
+            break;
+        case NOISE:
+            /* xorshift32 */
+            noise_state ^= noise_state << 13;
+            noise_state ^= noise_state >> 17;
+            noise_state ^= noise_state << 5;
+            out[k] = scaled((double) noise_state / UINT32_MAX * 2.0 - 1.0, amp);
+            break;
+        case BURST:
+            /* four periods on, twelve off */
+            out[k] = (fmod((t + k) * step, 16.0) < 4.0)
+                ? sine_table[(int) (phase * (1 << SINE_BITS))] : 0;
+            break;
+        case GLITCH:
+            /* a square wave at a quarter amplitude, with a one sample spike every 16th period */
+            out[k] = scaled((phase < 0.5) ? 0.25 : -0.25, amp);
+            if ((phase < step) && (fmod((t + k) * step, 16.0) < 1.0)) {
+                out[k] = scaled(1.0, amp);
+            }
+            break;
+        }
+        phase += step;
+        if (phase >= 1.0) {
+            phase -= floor(phase);
+        }
+    }
+
+    if (gen_bits < resolution()) {
+        /* throw away the bits we don't have */
+        short mask = ~((1 << (resolution() - gen_bits)) - 1);
+        for (k = 0; k < n; k++) {
+            out[k] &= mask;
+        }
+    }
+}
+
+static int gen_nchans(void)
+{
+    if (timer_fd < 0) {
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    }
+    return (timer_fd >= 0) ? gen_chans : 0;
+}
+
+static int fd(void)
+{
+    return timer_fd;
+}
+
+static Signal *gen_chan(int chan)
+{
+    return &gen_sigs[chan];
+}
+
+static void scale_trigger(void)
+{
+    trig.level = triglev * SAMPLE_UNIT(&gen_sigs[0]);
+    trig.hyst = scope.trighyst * SAMPLE_UNIT(&gen_sigs[0]);
+    trigger_reset(&trig);
+}
+
+static int set_trigger(int chan, int *levelp, int mode)
+{
+    trigch = chan;
+    trig.mode = mode;
+    triglev = *levelp;
+    if (triglev > 128) {
+        triglev = 128;
+        *levelp = 128;
+    }
+    if (triglev < -127) {
+        triglev = -127;
+        *levelp = -128;
+    }
+    scale_trigger();
+    return 1;
+}
+
+static void clear_trigger(void)
+{
+    trig.mode = 0;
+}
+
+/* Rates go 1, 2, 5, 10, ... from 1 kS/s up to GEN_MAXRATE */
+
+static int change_rate(int dir)
+{
+    static const int steps[] = {1, 2, 5};
+    int newrate = gen_rate;
+    int decade, k, rate;
+
+    for (decade = 1000; decade <= GEN_MAXRATE; decade *= 10) {
+        for (k = 0; k < 3; k++) {
+            rate = steps[k] * decade;
+            if (rate > GEN_MAXRATE) {
+                break;
+            }
+            if ((dir > 0) && (rate > gen_rate) && (newrate == gen_rate)) {
+                newrate = rate;
+            } else if ((dir < 0) && (rate < gen_rate)) {
+                newrate = rate;
+            }
+        }
+    }
+
+    if (newrate != gen_rate) {
+        gen_rate = newrate;
+        return 1;
+    }
+    return 0;
+}
+
+static void start_timer(void)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if (gen_max) {
+        its.it_interval.tv_nsec = 1000;
+    } else {
+        its.it_interval.tv_nsec = SND_QUERY_INTERVALL * 1000000L;
+    }
+    its.it_value = its.it_interval;
+    timerfd_settime(timer_fd, 0, &its, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    delivered = 0;
+}
+
+static void configure(void)
+{
+    int i;
+
+    gen_nchans();
+
+    for (i = 0; i < GEN_CHANS; i++) {
+        if (gen_sigs[i].name[0] == '\0') {
+            snprintf(gen_sigs[i].name, sizeof(gen_sigs[i].name), "Generator %c", 'a' + i);
+            gen_sigs[i].savestr[0] = 'a' + i;
+            gen_sigs[i].savestr[1] = '\0';
+        }
+        gen_sigs[i].rate = gen_rate;
+        gen_sigs[i].volts = 0;
+        gen_sigs[i].resolution = resolution();
+    }
+}
+
+static void start(void)
+{
+    int i;
+
+    for (i = 0; i < GEN_CHANS; i++) {
+        gen_sigs[i].num = 0;
+        gen_sigs[i].frame ++;
+
+        history_clear(&gen_hist[i]);
+    }
+    scale_trigger();
+
+    if (timer_fd >= 0) {
+        start_timer();
+    }
+
+    in_progress = 0;
+}
+
+static void stop(void)
+{
+    struct itimerspec its;
+
+    if (timer_fd >= 0) {
+        memset(&its, 0, sizeof(its));
+        timerfd_settime(timer_fd, 0, &its, NULL);
+    }
+}
+
+static void reset(void)
+{
+    configure();
+    start();
+}
+
+static void set_width(int width)
+{
+    int i;
+
+    bufferSizeFrames = width;
+
+    for (i = 0; i < GEN_CHANS; i++) {
+        gen_sigs[i].width = width;
+        deep_free(gen_sigs[i].data);
+        gen_sigs[i].data = deep_new(short, width);
+
+        history_resize(&gen_hist[i], width);
+        stage[i] = deep_renew(short, stage[i], width);
+    }
+}
+
+/* When frame 'n' (counting from 'started') is due.  Frames made as fast as possible are from now. */
+
+static long long frame_stamp(long long n)
+{
+    if (gen_max) {
+        return monotonic_ns();
+    }
+    return stamp_add((long long) started.tv_sec * 1000000000LL + started.tv_nsec, n, gen_rate);
+}
+
+/* process_frames() - trigger on and copy 'count' generated frames in stage[] into the Signals
+ *
+ * Returns the number of frames used up, which is less than 'count' only if the sweep ended before
+ * the frames did.  Sets *got if any samples went into the sweep buffer.
+ */
+
+static int process_frames(int count, int *got)
+{
+    int i, n, c, pre;
+    int width = gen_sigs[0].width;
+    int first = 0;
+
+    i = 0;
+    if (!in_progress) {
+        i = trigger_find_s16(&trig, stage[trigch], count, 1);
+
+        if (scope.pretrig) {
+            for (c = 0; c < gen_chans; c++) {
+                history_push(&gen_hist[c], stage[c], i);
+            }
+        }
+
+        if (i >= count) {
+            return count;
+        }
+
+        pre = pretrigger_samples(width);
+        for (c = 0; c < gen_chans; c++) {
+            signal_writable(&gen_sigs[c], 0);
+            history_copy(&gen_hist[c], gen_sigs[c].data, pre);
+            gen_sigs[c].delay = 0;
+            gen_sigs[c].frame ++;
+            gen_sigs[c].stamp = frame_stamp(delivered + i - pre);
+        }
+
+        first = i;
+        in_progress = pre;
+        stats.triggers ++;
+    }
+
+    n = max(0, min(count - i, width - in_progress));
+    for (c = 0; c < gen_chans; c++) {
+        signal_writable(&gen_sigs[c], in_progress);
+        memcpy(gen_sigs[c].data + in_progress, stage[c] + i, n * sizeof(short));
+        gen_sigs[c].num = in_progress + n;
+        if (scope.pretrig) {
+            history_push(&gen_hist[c], stage[c] + first, i + n - first);
+        }
+    }
+    in_progress += n;
+    i += n;
+
+    if (in_progress >= width) {
+        in_progress = 0;
+        stats.delivered ++;
+        trigger_prime(&trig, stage[trigch][i-1]);
+    }
+    *got = 1;
+    return i;
+}
+
+/* Make the 'skip' frames the display doesn't need, just for the recorder */
+
+static void record_skipped(long long skip)
+{
+    int c, n;
+
+    while (skip > 0) {
+        n = (skip < bufferSizeFrames) ? skip : bufferSizeFrames;
+        for (c = 0; c < gen_chans; c++) {
+            generate(stage[c], c, next_sample, n);
+        }
+        record_frames(stage, gen_chans, n, gen_rate, frame_stamp(delivered));
+        next_sample += n;
+        delivered += n;
+        skip -= n;
+    }
+}
+
+static long long frames_due(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) (((now.tv_sec - started.tv_sec)
+                         + (now.tv_nsec - started.tv_nsec) / 1e9) * gen_rate) - delivered;
+}
+
+static int gen_get_data(void)
+{
+    uint64_t expirations;
+    long long want;
+    int c, n;
+    int got = 0;
+
+    if ((timer_fd < 0) || (bufferSizeFrames == 0)) {
+        return 0;
+    }
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+        /* nothing yet, but get_data() is also called without waiting on fd() */
+    }
+
+    want = gen_max ? bufferSizeFrames : frames_due();
+
+    if (!in_progress && (want > bufferSizeFrames)) {
+        /* We've fallen behind; skip ahead to the last sweep's worth, which costs us nothing,
+         * unless the recorder wants to see them
+         */
+        long long skip = want - bufferSizeFrames;
+
+        if (record_active()) {
+            record_skipped(skip);
+        } else {
+            next_sample += skip;
+            delivered += skip;
+        }
+        stats.skipped += skip;
+        want = bufferSizeFrames;
+        trigger_reset(&trig);
+    }
+
+    while (want > 0) {
+        n = (want < bufferSizeFrames) ? want : bufferSizeFrames;
+        if (in_progress) {
+            n = min(n, gen_sigs[0].width - in_progress);
+        }
+        for (c = 0; c < gen_chans; c++) {
+            generate(stage[c], c, next_sample, n);
+        }
+
+        /* anything process_frames() doesn't use gets made again next time */
+        n = process_frames(n, &got);
+        record_frames(stage, gen_chans, n, gen_rate, frame_stamp(delivered));
+        next_sample += n;
+        delivered += n;
+        want -= n;
+
+        if (got && !in_progress) {      /* end of sweep */
+            break;
+        }
+    }
+
+    return got;
+}
+
+static const char * gen_status_str(int i)
+{
+    static char string[64];
+
+    switch (i) {
+    case 0:
+        return "Generator";
+
+    case 2:
+        snprintf(string, sizeof(string), "%s %g Hz", wave_names[gen_wave], gen_freq);
+        return string;
+
+    case 4:
+        snprintf(string, sizeof(string), "%d ch %d bits", gen_chans, gen_bits);
+        return string;
+
+    case 6:
+    case 7:
+        return datasrc_stats_str(&stats, i - 6);
+    }
+    return NULL;
+}
+
+static const DataSrcStats * gen_stats(void)
+{
+    return &stats;
+}
+
+static const DataSrcCaps * gen_caps(void)
+{
+    static const DataSrcCaps caps = { 1 << FMT_S16, 1000, GEN_MAXRATE, 0, 1, 1 };
+
+    return &caps;
+}
+
+/* Option 1 key - next waveform */
+
+static int option1(void)
+{
+    gen_wave = (gen_wave + 1) % NWAVES;
+    return 1;
+}
+
+static const char * option1str(void)
+{
+    return wave_names[gen_wave];
+}
+
+/* Option 2 key - set rate or maximum speed */
+
+static int option2(void)
+{
+    gen_max = !gen_max;
+    return 1;
+}
+
+static const char * option2str(void)
+{
+    return gen_max ? "Max speed" : "Real time";
+}
+
+static int gen_set_option(char *option)
+{
+    char name[16];
+    int i;
+
+    if (sscanf(option, "wave=%15s", name) == 1) {
+        for (i = 0; i < NWAVES; i++) {
+            if (strcasecmp(name, wave_names[i]) == 0) {
+                gen_wave = i;
+                return 1;
+            }
+        }
+        return 0;
+    } else if (sscanf(option, "freq=%lf", &gen_freq) == 1) {
+        return gen_freq > 0;
+    } else if (sscanf(option, "rate=%d", &gen_rate) == 1) {
+        gen_rate = max(1, min(gen_rate, GEN_MAXRATE));
+        return 1;
+    } else if (sscanf(option, "chans=%d", &gen_chans) == 1) {
+        gen_chans = max(1, min(gen_chans, GEN_CHANS));
+        return 1;
+    } else if (sscanf(option, "bits=%d", &gen_bits) == 1) {
+        gen_bits = max(1, min(gen_bits, 16));
+        return 1;
+    } else if (sscanf(option, "speed=%15s", name) == 1) {
+        if (strcasecmp(name, "max") == 0) {
+            gen_max = 1;
+        } else if (strcasecmp(name, "real") == 0) {
+            gen_max = 0;
+        } else {
+            return 0;
+        }
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+static char * gen_save_option(int i)
+{
+    static char buf[32];
+
+    switch (i) {
+    case 0:
+        snprintf(buf, sizeof(buf), "wave=%s", wave_names[gen_wave]);
+        return buf;
+
+    case 1:
+        snprintf(buf, sizeof(buf), "freq=%g", gen_freq);
+        return buf;
+
+    case 2:
+        snprintf(buf, sizeof(buf), "rate=%d", gen_rate);
+        return buf;
+
+    case 3:
+        snprintf(buf, sizeof(buf), "chans=%d", gen_chans);
+        return buf;
+
+    case 4:
+        snprintf(buf, sizeof(buf), "bits=%d", gen_bits);
+        return buf;
+
+    case 5:
+        snprintf(buf, sizeof(buf), "speed=%s", gen_max ? "max" : "real");
+        return buf;
+
+    default:
+        return NULL;
+    }
+}
+
+DataSrc datasrc_generator = {
+    "Generator",
+    gen_nchans,
+    gen_chan,
+    set_trigger,
+    clear_trigger,
+    change_rate,
+    set_width,
+    reset,
+    fd,
+    gen_get_data,
+    gen_status_str,
+    option1,
+    option1str,
+    option2,
+    option2str,
+    gen_set_option,
+    gen_save_option,
+    NULL, /* gtk_options */
+    gen_stats,
+    configure,
+    start,
+    stop,
+    NULL, /* pollfds */
+    NULL, /* interval */
+    gen_caps
+};
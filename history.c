@@ -0,0 +1,108 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * This file implements the sample history rings used for pre-trigger capture
+ *
+ * Every data source keeps one History per channel and pushes all the samples it sees into it, not
+ * just the ones that go into a sweep.  When the trigger fires, history_copy() puts the samples that
+ * led up to it at the start of the new sweep, and the sweep continues from there.  How much of the
+ * sweep comes before the trigger is set by scope.pretrig, in percent of the sweep width.
+ *
+ */
+
+#include <string.h>
+#include "xoscope.h"
+#include "history.h"
+#include "deep.h"
+
+/* Make room for at least 'size' samples, forgetting whatever was in there */
+
+void history_resize(History *h, int size)
+{
+    unsigned int n = 1;
+
+    while (n < size) n <<= 1;
+
+    if (size <= 0) {
+        deep_free(h->data);
+        h->data = NULL;
+        h->mask = 0;
+    } else if (h->data == NULL || n != h->mask + 1) {
+        deep_free(h->data);
+        h->data = deep_new(short, n);
+        h->mask = n - 1;
+    }
+    history_clear(h);
+}
+
+void history_clear(History *h)
+{
+    h->pos = 0;
+    h->fill = 0;
+}
+
+int history_size(History *h)
+{
+    return h->data ? h->mask + 1 : 0;
+}
+
+/* Push n samples.  Only the last 'size' of them can matter, so skip the others. */
+
+void history_push(History *h, const short *samples, int n)
+{
+    unsigned int size = h->mask + 1;
+    unsigned int at, first;
+
+    if (h->data == NULL || n <= 0) return;
+
+    if (n > size) {
+        h->pos += n - size;
+        samples += n - size;
+        n = size;
+    }
+
+    at = h->pos & h->mask;
+    first = size - at;
+    if (first > n) first = n;
+    memcpy(h->data + at, samples, first * sizeof(short));
+    memcpy(h->data, samples + first, (n - first) * sizeof(short));
+
+    h->pos += n;
+    h->fill = (h->fill + n > size) ? size : h->fill + n;
+}
+
+/* Copy the last n samples pushed, oldest first, to dst.  If we haven't seen that many yet (right
+ * after a reset), the missing ones at the start of dst are zeroed.  Returns the number of samples
+ * that were really copied.
+ */
+
+int history_copy(History *h, short *dst, int n)
+{
+    unsigned int have, at, first;
+
+    if (n <= 0) return 0;
+
+    have = (h->data == NULL) ? 0 : (n > h->fill ? h->fill : n);
+    memset(dst, 0, (n - have) * sizeof(short));
+    dst += n - have;
+
+    if (have == 0) return 0;
+
+    at = (h->pos - have) & h->mask;
+    first = h->mask + 1 - at;
+    if (first > have) first = have;
+    memcpy(dst, h->data + at, first * sizeof(short));
+    memcpy(dst + first, h->data, (have - first) * sizeof(short));
+
+    return have;
+}
+
+/* Number of samples of a sweep 'width' samples wide that come before the trigger */
+
+int pretrigger_samples(int width)
+{
+    int pre = (long long) width * scope.pretrig / 100;
+
+    return (pre >= width) ? width - 1 : (pre < 0 ? 0 : pre);
+}
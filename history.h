@@ -0,0 +1,32 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * Prototypes for the sample history rings in history.c
+ *
+ */
+
+/* A History remembers the most recent samples of one channel, whether or not a sweep is in
+ * progress, so that a data source can show what happened before the trigger.
+ */
+
+typedef struct History {
+    short *data;
+    unsigned int mask;          /* size - 1; size is a power of two */
+    unsigned int pos;           /* number of samples pushed so far (wraps around) */
+    unsigned int fill;          /* number of valid samples, never more than size */
+} History;
+
+void    history_resize(History *, int);
+void    history_clear(History *);
+void    history_push(History *, const short *, int);
+int     history_copy(History *, short *, int);
+int     history_size(History *);
+int     pretrigger_samples(int);
+
+/* push a single sample; the data source loops call this once per sample */
+static inline void history_put(History *h, short sample)
+{
+    h->data[h->pos++ & h->mask] = sample;
+    if (h->fill <= h->mask) h->fill++;
+}
@@ -0,0 +1,188 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * This file implements the file backed memory channels
+ *
+ * A memory channel bound to a file (-m) keeps its samples in that file and maps it, instead of
+ * holding a copy in memory.  Storing into it writes the file through the mapping, recalling it
+ * just points a display channel at the mapping, and loading it again, after a restart or from a
+ * save file, is only an mmap(): pages are read in as they are looked at, and the kernel can drop
+ * them again when memory is short, so a capture can be bigger than RAM.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "xoscope.h"
+#include "display.h"
+#include "deep.h"
+#include "memfile.h"
+
+static struct memfile {
+    char *path;                 /* the file this memory is bound to, or NULL */
+    char *map;                  /* its mapping while mem[].data points into it */
+    size_t len;
+} memfiles[26];
+
+/* Let go of a memory's samples, however it's holding them */
+
+void mem_free(int i)
+{
+    if (memfiles[i].map != NULL) {
+        munmap(memfiles[i].map, memfiles[i].len);
+        memfiles[i].map = NULL;
+    } else {
+        deep_free(mem[i].data);
+    }
+    mem[i].data = NULL;
+    mem[i].num = 0;
+}
+
+void mem_unbind(int i)
+{
+    g_free(memfiles[i].path);
+    memfiles[i].path = NULL;
+}
+
+const char * mem_file(int i)
+{
+    return memfiles[i].path;
+}
+
+/* TRUE if memory i's samples are in its file's mapping rather than a deep buffer */
+
+int mem_mapped(int i)
+{
+    return memfiles[i].map != NULL;
+}
+
+static int mem_failed(int i, const char *what)
+{
+    snprintf(error, sizeof(error), "memory %c: %s %s: %s",
+             'a' + i, what, memfiles[i].path, strerror(errno));
+    message(error);
+    return 0;
+}
+
+/* Map the file into memory i, writable if we're about to fill it */
+
+static MemFileHeader * mem_map(int i, int fd, size_t len, int writable)
+{
+    char *map;
+
+    map = mmap(NULL, len, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    mem_free(i);
+    memfiles[i].map = map;
+    memfiles[i].len = len;
+    mem[i].data = (short *) (map + MEMFILE_DATA);
+    return (MemFileHeader *) map;
+}
+
+static void mem_header(int i, const MemFileHeader *h)
+{
+    mem[i].rate = h->rate;
+    mem[i].resolution = h->resolution;
+    mem[i].type = h->type;
+    mem[i].num = mem[i].width = h->num;
+    mem[i].volts = h->volts;
+    mem[i].stamp = h->stamp;
+    mem[i].frame ++;
+}
+
+/* Bind memory i to 'path' (the -m option), and load whatever capture is already in there.  A file
+ * that doesn't exist yet is created by the next store into the memory.
+ */
+
+int mem_bind(int i, const char *path)
+{
+    MemFileHeader h, *m;
+    struct stat st;
+    int fd;
+
+    mem_unbind(i);
+    memfiles[i].path = g_strdup(path);
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        if (errno == ENOENT)
+            return 1;
+        mem_failed(i, "can't open");
+        mem_unbind(i);
+        return 0;
+    }
+    if ((fstat(fd, &st) < 0) || (read(fd, &h, sizeof(h)) != sizeof(h))
+        || memcmp(h.magic, MEMFILE_MAGIC, sizeof(h.magic))
+        || ((h.type != SIG_S16) && (h.type != SIG_S32) && (h.type != SIG_FLOAT)) || (h.num < 0)
+        || (st.st_size < MEMFILE_DATA + (off_t) h.num * sample_size(h.type))) {
+        close(fd);
+        snprintf(error, sizeof(error), "memory %c: %s is not a memory file", 'a' + i, path);
+        message(error);
+        mem_unbind(i);          /* or the next store would overwrite it */
+        return 0;
+    }
+    m = mem_map(i, fd, st.st_size, 0);
+    close(fd);
+    if (m == NULL) {
+        mem_failed(i, "can't map");
+        mem_unbind(i);
+        return 0;
+    }
+    mem_header(i, m);
+    return 1;
+}
+
+/* Store src into memory i's file, if it's bound to one.  Returns 0 if it isn't, or if the file
+ * couldn't be written, in which case the memory forgets the file and save() keeps the samples in
+ * memory instead.
+ */
+
+int mem_store_file(int i, Signal *src)
+{
+    MemFileHeader h, *m;
+    size_t len = MEMFILE_DATA + (size_t) src->num * sample_size(src->type);
+    int fd;
+
+    if (memfiles[i].path == NULL)
+        return 0;
+
+    /* Drop the old mapping first: the file is about to change size under it */
+
+    mem_free(i);
+    if (((fd = open(memfiles[i].path, O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0)
+        || (ftruncate(fd, len) < 0)) {
+        if (fd >= 0) close(fd);
+        mem_failed(i, "can't write");
+        mem_unbind(i);
+        return 0;
+    }
+    m = mem_map(i, fd, len, 1);
+    close(fd);
+    if (m == NULL) {
+        mem_failed(i, "can't map");
+        mem_unbind(i);
+        return 0;
+    }
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MEMFILE_MAGIC, sizeof(h.magic));
+    h.rate = src->rate;
+    h.resolution = src->resolution;
+    h.type = src->type;
+    h.num = src->num;               /* the sweep may still be coming in */
+    h.volts = src->volts;
+    h.stamp = src->stamp;
+    *m = h;
+    memcpy(mem[i].data, src->data, (size_t) src->num * sample_size(src->type));
+    mem_header(i, m);
+    return 1;
+}
@@ -0,0 +1,31 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * Prototypes for the file backed memory channels in memfile.c
+ *
+ */
+
+#include <stdint.h>
+
+/* A memory channel file is this header, then the samples, native endian, from MEMFILE_DATA on */
+
+#define MEMFILE_MAGIC   "xoscmem1"
+#define MEMFILE_DATA    4096
+
+typedef struct MemFileHeader {
+    char magic[8];              /* MEMFILE_MAGIC */
+    int32_t rate;
+    int32_t resolution;
+    int32_t type;               /* SIG_S16, SIG_S32 or SIG_FLOAT */
+    int32_t num;                /* number of samples */
+    double volts;
+    int64_t stamp;
+} MemFileHeader;
+
+int             mem_bind(int, const char *);
+const char *    mem_file(int);
+int             mem_mapped(int);
+int             mem_store_file(int, Signal *);
+void            mem_free(int);
+void            mem_unbind(int);
@@ -0,0 +1,125 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * This file implements the min/max pyramids the display draws deep traces from
+ *
+ * A trace that has more samples than the screen has pixels is drawn as the minimum and maximum of
+ * the samples in each pixel column (see signalline_points() in display.c).  Each level of the
+ * pyramid has half the blocks of the one below it, so the whole pyramid takes half as many floats
+ * as the trace has samples, and it is filled in as the sweep comes in, a block at a time.
+ * pyramid_range() takes the biggest blocks that fit in the span it's asked for, so a column costs
+ * a few dozen reads however many samples are in it.
+ *
+ */
+
+#include <stdlib.h>
+#include "pyramid.h"
+#include "deep.h"
+
+/* Make room to summarize 'width' samples, forgetting whatever was in there */
+
+void pyramid_resize(Pyramid *p, int width)
+{
+    size_t blocks = 0;
+    float *buf;
+    int l;
+
+    pyramid_free(p);
+
+    for (l = 0; (l < PYRAMID_LEVELS) && ((width >> (PYRAMID_BASE + l)) > 0); l++) {
+        blocks += width >> (PYRAMID_BASE + l);
+    }
+    p->levels = l;
+    if (blocks == 0)
+        return;
+
+    buf = deep_new(float, 2 * blocks);
+    for (l = 0; l < p->levels; l++) {
+        p->min[l] = buf;
+        buf += width >> (PYRAMID_BASE + l);
+        p->max[l] = buf;
+        buf += width >> (PYRAMID_BASE + l);
+    }
+}
+
+void pyramid_free(Pyramid *p)
+{
+    if (p->levels > 0) {
+        deep_free(p->min[0]);
+    }
+    p->levels = 0;
+    p->num = 0;
+}
+
+/* Summarize samples up to data[num - 1].  The ones before p->num are already in there, unless
+ * num says the trace has started over.
+ */
+
+void pyramid_update(Pyramid *p, const float *data, int num)
+{
+    int b, i, l, first, last;
+    float lo, hi;
+
+    if (num < p->num) {
+        p->num = 0;
+    }
+
+    for (l = 0; l < p->levels; l++) {
+        first = p->num >> (PYRAMID_BASE + l);
+        last = num >> (PYRAMID_BASE + l);
+        for (b = first; b < last; b++) {
+            if (l == 0) {
+                lo = hi = data[b << PYRAMID_BASE];
+                for (i = (b << PYRAMID_BASE) + 1; i < (b + 1) << PYRAMID_BASE; i++) {
+                    if (data[i] < lo) lo = data[i];
+                    if (data[i] > hi) hi = data[i];
+                }
+            } else {
+                lo = p->min[l-1][2*b];
+                if (p->min[l-1][2*b + 1] < lo) lo = p->min[l-1][2*b + 1];
+                hi = p->max[l-1][2*b];
+                if (p->max[l-1][2*b + 1] > hi) hi = p->max[l-1][2*b + 1];
+            }
+            p->min[l][b] = lo;
+            p->max[l][b] = hi;
+        }
+    }
+    p->num = num;
+}
+
+/* The smallest and largest of data[from] to data[to - 1].  Samples that haven't been summarized
+ * yet are read from data[] itself.
+ */
+
+void pyramid_range(const Pyramid *p, const float *data, int from, int to, float *min, float *max)
+{
+    float lo, hi;
+    int i = from, l, size;
+
+    lo = hi = data[from];
+
+    while (i < to) {
+
+        /* The biggest block that starts at i and ends by 'to' */
+
+        for (l = 0; l < p->levels; l++) {
+            size = 1 << (PYRAMID_BASE + l);
+            if ((i & (size - 1)) || (i + size > to) || (i + size > p->num))
+                break;
+        }
+
+        if (l == 0) {
+            if (data[i] < lo) lo = data[i];
+            if (data[i] > hi) hi = data[i];
+            i++;
+        } else {
+            l--;
+            if (p->min[l][i >> (PYRAMID_BASE + l)] < lo) lo = p->min[l][i >> (PYRAMID_BASE + l)];
+            if (p->max[l][i >> (PYRAMID_BASE + l)] > hi) hi = p->max[l][i >> (PYRAMID_BASE + l)];
+            i += 1 << (PYRAMID_BASE + l);
+        }
+    }
+    *min = lo;
+    *max = hi;
+}
@@ -0,0 +1,27 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * Prototypes for the min/max pyramids in pyramid.c
+ *
+ */
+
+/* A Pyramid summarizes a trace of samples as the minimum and maximum of every block of
+ * 1 << PYRAMID_BASE samples, of every two of those blocks, and so on up, so that the range of any
+ * span of the trace can be had from a handful of blocks instead of every sample in it.
+ */
+
+#define PYRAMID_BASE    3
+#define PYRAMID_LEVELS  32
+
+typedef struct Pyramid {
+    float *min[PYRAMID_LEVELS]; /* level l has a block for every 1 << (PYRAMID_BASE + l) samples */
+    float *max[PYRAMID_LEVELS];
+    int levels;                 /* levels with at least one block */
+    int num;                    /* samples summarized so far */
+} Pyramid;
+
+void    pyramid_resize(Pyramid *, int);
+void    pyramid_free(Pyramid *);
+void    pyramid_update(Pyramid *, const float *, int);
+void    pyramid_range(const Pyramid *, const float *, int, int, float *, float *);
@@ -0,0 +1,369 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * This file implements the continuous recorder (-e)
+ *
+ * The display only ever keeps the sweep it's showing, and the data sources throw away whatever
+ * comes in while they wait for a trigger or catch up.  The recorder gets every frame a data source
+ * takes from its device, shown or not, through record_frames(), and writes them to a file in
+ * RECORD_CHUNK byte chunks (see record.h).
+ *
+ * record_frames() only interleaves the frames into the chunk being filled, so it costs the data
+ * source about as much as a memcpy().  Full chunks go to a writer thread, which writes them whole
+ * at chunk aligned offsets, from page aligned buffers, with O_DIRECT where the file system allows
+ * it.  If the disk doesn't keep up and all RECORD_BUFFERS chunks are waiting to be written, frames
+ * are dropped rather than holding up the data source, and the next chunk says how many.
+ *
+ */
+
+#define _GNU_SOURCE             /* O_DIRECT */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "record.h"
+
+/* How many chunks can be waiting for the disk, 16M of them */
+
+#define RECORD_BUFFERS  16
+
+static int fd = -1;
+static int active = 0;
+static int stopping = 0;
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+
+static RecordChunk *buffers[RECORD_BUFFERS];
+static RecordChunk *spare[RECORD_BUFFERS];      /* free buffers */
+static int nspare = 0;
+static RecordChunk *queue[RECORD_BUFFERS];      /* full ones, oldest first */
+static int qhead = 0, qlen = 0;
+
+static RecordChunk *current = NULL;     /* the chunk being filled */
+static int capacity;                    /* ... and how many frames fit in it */
+static long long next_frame = 0;        /* number of the next frame we're given */
+static long long lost = 0;              /* frames lost since the last chunk, or -1 */
+
+static RecordIndex *index_entries = NULL;       /* only the writer thread touches these */
+static int index_size = 0;
+static int unindexed = 0;                       /* ... and the index couldn't be kept */
+static off_t offset;
+static int64_t started;
+
+static RecordStats stats;
+
+/* Queue the chunk being filled for the writer.  Call with the lock held. */
+
+static void queue_current(void)
+{
+    if (current == NULL)
+        return;
+
+    if (current->frames > 0) {
+        queue[(qhead + qlen++) % RECORD_BUFFERS] = current;
+        pthread_cond_signal(&wake);
+    } else {
+        spare[nspare++] = current;
+    }
+    current = NULL;
+}
+
+/* Start a new chunk.  Returns FALSE if all the buffers are waiting for the disk. */
+
+static int start_chunk(int chans, int rate, long long stamp)
+{
+    if (nspare == 0)
+        return 0;
+
+    current = spare[--nspare];
+    memset(current, 0, sizeof(*current));
+    memcpy(current->magic, "chnk", sizeof(current->magic));
+    current->chans = chans;
+    current->rate = rate;
+    current->first = next_frame;
+    current->stamp = stamp;
+    current->lost = lost;
+    lost = 0;
+    capacity = (RECORD_CHUNK - sizeof(RecordChunk)) / (chans * sizeof(short));
+    return 1;
+}
+
+static int write_block(const void *buf, size_t len, off_t where)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = pwrite(fd, buf, len, where);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        buf = (const char *) buf + n;
+        len -= n;
+        where += n;
+    }
+    return 1;
+}
+
+/* The writer thread: write out queued chunks until record_stop() says we're done */
+
+static void * write_chunks(void *arg)
+{
+    RecordChunk *chunk;
+    RecordIndex *grown;
+    int failed = 0;
+
+    (void) arg;
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while ((qlen == 0) && !stopping) {
+            pthread_cond_wait(&wake, &lock);
+        }
+        if (qlen == 0)
+            break;
+        chunk = queue[qhead];
+        qhead = (qhead + 1) % RECORD_BUFFERS;
+        qlen --;
+        pthread_mutex_unlock(&lock);
+
+        if (!failed && !write_block(chunk, RECORD_CHUNK, offset)) {
+            fprintf(stderr, "recording: %s\n", strerror(errno));
+            failed = 1;
+        }
+        if (!failed && !unindexed) {
+            grown = realloc(index_entries, (index_size + 1) * sizeof(RecordIndex));
+            if (grown == NULL) {
+                /* the chunks still say what they are, so the recording can go on without one */
+                fprintf(stderr, "recording: out of memory for the index\n");
+                unindexed = 1;
+            } else {
+                index_entries = grown;
+                index_entries[index_size].offset = offset;
+                index_entries[index_size].first = chunk->first;
+                index_entries[index_size].stamp = chunk->stamp;
+                index_entries[index_size].frames = chunk->frames;
+                index_entries[index_size].chans = chunk->chans;
+                index_size ++;
+            }
+        }
+        if (!failed) {
+            offset += RECORD_CHUNK;
+        }
+
+        pthread_mutex_lock(&lock);
+        if (failed) {
+            stats.lost += chunk->frames;
+        } else {
+            stats.frames += chunk->frames;
+            stats.chunks ++;
+        }
+        spare[nspare++] = chunk;
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/* Write the header, with the index if there is one */
+
+static int write_header(int64_t index)
+{
+    RecordHeader *h;
+    int ok;
+
+    if (posix_memalign((void **) &h, RECORD_ALIGN, RECORD_ALIGN))
+        return 0;
+
+    memset(h, 0, RECORD_ALIGN);
+    memcpy(h->magic, RECORD_MAGIC, sizeof(h->magic));
+    h->chunk = RECORD_CHUNK;
+    h->chunks = index ? index_size : 0;
+    h->index = index;
+    h->started = started;
+    ok = write_block(h, RECORD_ALIGN, 0);
+    free(h);
+    return ok;
+}
+
+/* Start recording to 'path'.  Returns FALSE, and says why, if we can't. */
+
+int record_start(const char *path)
+{
+    struct timespec now;
+    int i;
+
+    record_stop();
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+    if ((fd < 0) && (errno == EINVAL)) {
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "can't record to %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    memset(&stats, 0, sizeof(stats));
+    clock_gettime(CLOCK_REALTIME, &now);
+    started = (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+    if (!write_header(0)) {
+        fprintf(stderr, "can't record to %s: %s\n", path, strerror(errno));
+        close(fd);
+        fd = -1;
+        return 0;
+    }
+    offset = RECORD_ALIGN;
+
+    for (i = 0; i < RECORD_BUFFERS; i++) {
+        if (posix_memalign((void **) &buffers[i], RECORD_ALIGN, RECORD_CHUNK)) {
+            fprintf(stderr, "can't record to %s: out of memory\n", path);
+            while (--i >= 0) free(buffers[i]);
+            close(fd);
+            fd = -1;
+            return 0;
+        }
+        spare[i] = buffers[i];
+    }
+    nspare = RECORD_BUFFERS;
+    qhead = qlen = 0;
+    current = NULL;
+    next_frame = 0;
+    lost = 0;
+    stopping = 0;
+
+    if ((errno = pthread_create(&writer, NULL, write_chunks, NULL)) != 0) {
+        fprintf(stderr, "can't record to %s: %s\n", path, strerror(errno));
+        for (i = 0; i < RECORD_BUFFERS; i++) {
+            free(buffers[i]);
+            buffers[i] = NULL;
+        }
+        close(fd);
+        fd = -1;
+        return 0;
+    }
+    __atomic_store_n(&active, 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Write out what's left and the index, and close the recording */
+
+void record_stop(void)
+{
+    size_t len;
+    void *buf;
+    int i;
+
+    if (!active)
+        return;
+
+    pthread_mutex_lock(&lock);
+    __atomic_store_n(&active, 0, __ATOMIC_RELEASE);
+    queue_current();
+    stopping = 1;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer, NULL);
+
+    len = (index_size * sizeof(RecordIndex) + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+    if ((len > 0) && !unindexed && !posix_memalign(&buf, RECORD_ALIGN, len)) {
+        memset(buf, 0, len);
+        memcpy(buf, index_entries, index_size * sizeof(RecordIndex));
+        if (write_block(buf, len, offset)) {
+            write_header(offset);
+        }
+        free(buf);
+    }
+    close(fd);
+    fd = -1;
+
+    for (i = 0; i < RECORD_BUFFERS; i++) {
+        free(buffers[i]);
+        buffers[i] = NULL;
+    }
+    free(index_entries);
+    index_entries = NULL;
+    index_size = 0;
+    unindexed = 0;
+}
+
+int record_active(void)
+{
+    return __atomic_load_n(&active, __ATOMIC_ACQUIRE);
+}
+
+/* Take 'n' frames of 'chans' channels, sampled at 'rate', the first one at 'stamp' (0 if unknown),
+ * from stage[0] to stage[chans - 1].  Data sources call this with every frame they read.
+ */
+
+void record_frames(short **stage, int chans, int n, int rate, long long stamp)
+{
+    short *out;
+    int i, c, k, done = 0;
+
+    if (!record_active() || (n <= 0) || (chans <= 0))
+        return;
+
+    pthread_mutex_lock(&lock);
+    while (active && (done < n)) {
+        if ((current != NULL) && ((current->chans != chans) || (current->rate != rate))) {
+            queue_current();
+        }
+        if ((current == NULL)
+            && !start_chunk(chans, rate,
+                            (stamp && rate > 0) ? stamp + done * 1000000000LL / rate : 0)) {
+            /* the disk is behind; drop them */
+            stats.lost += n - done;
+            next_frame += n - done;
+            if (lost >= 0) lost += n - done;
+            break;
+        }
+
+        k = n - done;
+        if (k > capacity - current->frames) {
+            k = capacity - current->frames;
+        }
+        out = (short *) (current + 1) + (size_t) current->frames * chans;
+        for (i = 0; i < k; i++) {
+            for (c = 0; c < chans; c++) {
+                *out++ = stage[c][done + i];
+            }
+        }
+        current->frames += k;
+        next_frame += k;
+        done += k;
+
+        if (current->frames == capacity) {
+            queue_current();
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* The data source lost frames it can't count (an overrun, say): end the chunk there */
+
+void record_break(void)
+{
+    if (!record_active())
+        return;
+
+    pthread_mutex_lock(&lock);
+    if (active) {
+        queue_current();
+        lost = -1;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void record_stats(RecordStats *s)
+{
+    pthread_mutex_lock(&lock);
+    *s = stats;
+    s->queued = qlen;
+    pthread_mutex_unlock(&lock);
+}
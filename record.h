@@ -0,0 +1,62 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * Prototypes for the continuous recorder in record.c
+ *
+ */
+
+#include <stdint.h>
+
+/* A recording is a RECORD_ALIGN byte RecordHeader, then RECORD_CHUNK byte chunks, each a
+ * RecordChunk and then its frames, the samples of all channels interleaved, native endian.  When
+ * the recording is closed, an index with a RecordIndex for every chunk goes after the last one, and
+ * the header says where.  A recording that wasn't closed has no index, but every chunk says what it
+ * is, so it can still be read by walking the chunks.
+ */
+
+#define RECORD_MAGIC    "xoscrec1"
+#define RECORD_ALIGN    4096
+#define RECORD_CHUNK    (1 << 20)
+
+typedef struct RecordHeader {
+    char magic[8];              /* RECORD_MAGIC */
+    int32_t chunk;              /* RECORD_CHUNK */
+    int32_t chunks;             /* number of chunks, once closed */
+    int64_t index;              /* file offset of the index, or 0 if not closed */
+    int64_t started;            /* CLOCK_REALTIME of the start, in ns */
+} RecordHeader;
+
+typedef struct RecordChunk {
+    char magic[4];              /* "chnk" */
+    int32_t chans;              /* channels in each frame */
+    int32_t rate;               /* frames per second */
+    int32_t frames;             /* frames in this chunk */
+    int64_t first;              /* number of the first frame, counted from the start */
+    int64_t stamp;              /* when it was sampled, in ns of CLOCK_MONOTONIC; 0 if unknown */
+    int64_t lost;               /* frames missing just before it, or -1 if we don't know how many */
+} RecordChunk;
+
+typedef struct RecordIndex {
+    int64_t offset;             /* of the chunk in the file */
+    int64_t first;
+    int64_t stamp;
+    int32_t frames;
+    int32_t chans;
+} RecordIndex;
+
+/* RecordStats - what the recorder has done since it started */
+
+typedef struct RecordStats {
+    unsigned long long frames;  /* frames written */
+    unsigned long long lost;    /* frames dropped because the disk didn't keep up */
+    unsigned long chunks;       /* chunks written */
+    int queued;                 /* chunks waiting for the writer thread */
+} RecordStats;
+
+int     record_start(const char *);
+void    record_stop(void);
+int     record_active(void);
+void    record_frames(short **, int, int, int, long long);
+void    record_break(void);
+void    record_stats(RecordStats *);
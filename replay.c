@@ -0,0 +1,751 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * This file implements a data source that replays a recorded capture from a file
+ *
+ * The file is either a WAV file (PCM or float, any of the sample formats in convert.h, or 24 bit
+ * samples packed in three bytes), or raw interleaved samples, in which case the format, number of
+ * channels and rate come from the rawformat=, chans= and rate= options.  It goes through the same
+ * trigger and history code as the sound card, paced by a timerfd to the rate it was recorded at,
+ * or as fast as we can take it with speed=max (for benchmarking everything downstream).
+ *
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include "xoscope.h"            /* program defaults */
+#include "history.h"
+#include "deep.h"
+#include "trigger.h"
+#include "convert.h"
+
+#define REPLAY_CHANS CHANNELS
+
+static char replay_file[256] = "";
+static FILE *replay_fp = NULL;
+static int timer_fd = -1;
+
+static int replay_max = 0;      /* 1 - as fast as we can; 0 - at the rate it was recorded */
+static int replay_loop = 1;     /* start over at the end of the file */
+
+/* Sample format of a raw file; WAV files say what they are */
+static const char *raw_names[] = {"U8", "S16", "S24", "S32", "FLOAT"};
+static SampleFormat raw_fmt = FMT_S16;
+static int raw_chans = 2;
+static int raw_rate = DEF_R;
+
+/* What we're reading */
+static SampleFormat file_fmt;
+static int file_chans = 0;
+static int file_rate;
+static int file_packed24;       /* 24 bit samples in three bytes, which we spread out to four */
+static long data_start;         /* file offset of the first sample */
+static long data_frames;        /* number of frames in the file, or -1 for up to the end */
+static long data_pos;           /* frames read since data_start */
+static int at_end;              /* we've played it through and don't loop */
+
+/* Pacing: how many frames we've handed on since 'started' */
+static struct timespec started;
+static long long delivered;
+
+static Signal replay_sigs[REPLAY_CHANS];
+static History replay_hist[REPLAY_CHANS];
+
+static Trigger trig;
+static int trigch;
+static DataSrcStats stats;
+static int triglev;                     /* trigger level, in 8 bit sample values */
+
+/* Frames are read into buffer (sized for a sweep of the widest format) and converted into stage[]
+ * before we trigger on them.  'carry' frames at the start of buffer are left over from the last
+ * call.
+ */
+static char *buffer = NULL;
+static short *stage[REPLAY_CHANS];
+static int bufferSizeFrames = 0;
+static int carry = 0;
+
+static const char *replay_errormsg = NULL;
+
+static int frame_bytes(void)
+{
+    return file_chans * sample_bytes(file_fmt);
+}
+
+static unsigned int le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static unsigned long le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long) p[3] << 24);
+}
+
+/* Parse the header of a WAV file, leaving it positioned at the first sample.  Returns 0 if it isn't
+ * one (and rewinds it), -1 if it's one we can't read, 1 if all went well.
+ */
+
+static int read_wav_header(FILE *fp)
+{
+    unsigned char hdr[40];
+    unsigned long size, n;
+    int format = 0, bits = 0, align = 0;
+
+    if ((fread(hdr, 1, 12, fp) != 12) || memcmp(hdr, "RIFF", 4) || memcmp(hdr + 8, "WAVE", 4)) {
+        rewind(fp);
+        return 0;
+    }
+
+    while (fread(hdr, 1, 8, fp) == 8) {
+        size = le32(hdr + 4);
+
+        if (memcmp(hdr, "fmt ", 4) == 0) {
+            n = min(size, sizeof(hdr));
+            if ((size < 16) || (fread(hdr, 1, n, fp) != n)) {
+                break;
+            }
+            format = le16(hdr);
+            if ((format == 0xfffe) && (size >= 26)) {
+                format = le16(hdr + 24);        /* WAVE_FORMAT_EXTENSIBLE: the sub format GUID */
+            }
+            file_chans = le16(hdr + 2);
+            file_rate = le32(hdr + 4);
+            align = le16(hdr + 12);
+            bits = le16(hdr + 14);
+            if (size > sizeof(hdr)) {
+                fseek(fp, size - sizeof(hdr), SEEK_CUR);
+            }
+        } else if (memcmp(hdr, "data", 4) == 0) {
+            if (format == 0) {
+                break;
+            }
+            file_packed24 = 0;
+            if ((format == 3) && (bits == 32)) {
+                file_fmt = FMT_FLOAT;
+            } else if ((format == 1) && (bits == 8)) {
+                file_fmt = FMT_U8;
+            } else if ((format == 1) && (bits == 16)) {
+                file_fmt = FMT_S16;
+            } else if ((format == 1) && (bits == 24)) {
+                file_fmt = FMT_S24;
+                file_packed24 = 1;
+            } else if ((format == 1) && (bits == 32)) {
+                file_fmt = FMT_S32;
+            } else {
+                replay_errormsg = "unsupported WAV sample format";
+                return -1;
+            }
+            /* no dividing by a frame size of zero, or one that doesn't match the samples */
+            if ((file_chans < 1) || (file_chans > REPLAY_CHANS)
+                || (align != file_chans * bits / 8)) {
+                replay_errormsg = "unsupported number of channels or block size";
+                return -1;
+            }
+            data_frames = size / align;
+            return 1;
+        } else {
+            fseek(fp, size + (size & 1), SEEK_CUR);
+        }
+    }
+
+    replay_errormsg = "bad WAV header";
+    return -1;
+}
+
+static void close_replay(void)
+{
+    if (replay_fp != NULL) {
+        fclose(replay_fp);
+        replay_fp = NULL;
+    }
+    if (timer_fd >= 0) {
+        close(timer_fd);
+        timer_fd = -1;
+    }
+    file_chans = 0;
+}
+
+static int open_replay(void)
+{
+    int rc;
+
+    if (replay_fp != NULL) {
+        return 1;
+    }
+    if (replay_file[0] == '\0') {
+        replay_errormsg = "no file (-o file=NAME)";
+        return 0;
+    }
+
+    replay_errormsg = NULL;
+    if ((replay_fp = fopen(replay_file, "rb")) == NULL) {
+        replay_errormsg = strerror(errno);
+        return 0;
+    }
+
+    rc = read_wav_header(replay_fp);
+    if (rc == 0) {
+        file_fmt = raw_fmt;
+        file_chans = raw_chans;
+        file_rate = raw_rate;
+        file_packed24 = 0;
+        data_frames = -1;
+    }
+    if ((rc < 0) || (file_chans < 1) || (file_chans > REPLAY_CHANS) || (file_rate <= 0)) {
+        if (rc >= 0) {
+            replay_errormsg = "unsupported number of channels or rate";
+        }
+        close_replay();
+        return 0;
+    }
+    data_start = ftell(replay_fp);
+    data_pos = 0;
+    at_end = 0;
+
+    if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
+        replay_errormsg = strerror(errno);
+        close_replay();
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Read up to 'count' frames into 'buf', starting over at the end of the file if we loop.  Returns
+ * the number of frames read, which is zero only at the end of a file we don't loop.
+ */
+
+static int read_frames(char *buf, int count)
+{
+    int size = file_packed24 ? 3 * file_chans : frame_bytes();
+    int got = 0;
+    int n, k;
+
+    while (got < count) {
+        n = count - got;
+        if ((data_frames >= 0) && (n > data_frames - data_pos)) {
+            n = data_frames - data_pos;
+        }
+        n = (n > 0) ? fread(buf + got * size, size, n, replay_fp) : 0;
+        got += n;
+        data_pos += n;
+        if (got < count) {
+            if (!replay_loop || (data_pos == 0)) {
+                break;
+            }
+            fseek(replay_fp, data_start, SEEK_SET);
+            data_pos = 0;
+        }
+    }
+
+    if (file_packed24) {
+        /* back to front, so we don't overwrite what we haven't spread out yet */
+        const unsigned char *in = (const unsigned char *) buf;
+        int *out = (int *) buf;
+
+        for (k = got * file_chans - 1; k >= 0; k--) {
+            out[k] = in[3*k] | (in[3*k + 1] << 8) | (in[3*k + 2] << 16);
+        }
+    }
+    return got;
+}
+
+static int replay_nchans(void)
+{
+    if (replay_fp == NULL) {
+        open_replay();
+    }
+    return file_chans;
+}
+
+static int fd(void)
+{
+    return timer_fd;
+}
+
+static Signal *replay_chan(int chan)
+{
+    return &replay_sigs[chan];
+}
+
+/* Triggering - like the sound card, we trigger on the converted samples */
+
+static void scale_trigger(void)
+{
+    trig.level = triglev * SAMPLE_UNIT(&replay_sigs[0]);
+    trig.hyst = scope.trighyst * SAMPLE_UNIT(&replay_sigs[0]);
+    trigger_reset(&trig);
+}
+
+static int set_trigger(int chan, int *levelp, int mode)
+{
+    trigch = chan;
+    trig.mode = mode;
+    triglev = *levelp;
+    if (triglev > 128) {
+        triglev = 128;
+        *levelp = 128;
+    }
+    if (triglev < -127) {
+        triglev = -127;
+        *levelp = -128;
+    }
+    scale_trigger();
+    return 1;
+}
+
+static void clear_trigger(void)
+{
+    trig.mode = 0;
+}
+
+/* Start the timer: every SND_QUERY_INTERVALL ms at the recorded rate, or right away, every time,
+ * at full speed
+ */
+
+static void start_timer(void)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if (replay_max) {
+        its.it_interval.tv_nsec = 1000;
+    } else {
+        its.it_interval.tv_nsec = SND_QUERY_INTERVALL * 1000000L;
+    }
+    its.it_value = its.it_interval;
+    timerfd_settime(timer_fd, 0, &its, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    delivered = 0;
+}
+
+static void configure(void)
+{
+    int i;
+
+    open_replay();
+
+    for (i = 0; i < REPLAY_CHANS; i++) {
+        if (replay_sigs[i].name[0] == '\0') {
+            snprintf(replay_sigs[i].name, sizeof(replay_sigs[i].name), "Replay %c", 'a' + i);
+            replay_sigs[i].savestr[0] = 'a' + i;
+            replay_sigs[i].savestr[1] = '\0';
+        }
+        replay_sigs[i].rate = file_chans ? file_rate : 0;
+        replay_sigs[i].volts = 0;
+        replay_sigs[i].resolution = file_chans ? sample_resolution(file_fmt) : 0;
+    }
+}
+
+static void start(void)
+{
+    int i;
+
+    for (i = 0; i < REPLAY_CHANS; i++) {
+        replay_sigs[i].num = 0;
+        replay_sigs[i].frame ++;
+
+        history_clear(&replay_hist[i]);
+    }
+    scale_trigger();
+
+    carry = 0;
+    if (at_end) {               /* play it again */
+        fseek(replay_fp, data_start, SEEK_SET);
+        data_pos = 0;
+        at_end = 0;
+        replay_errormsg = NULL;
+    }
+    if (timer_fd >= 0) {
+        start_timer();
+    }
+
+    in_progress = 0;
+}
+
+static void stop(void)
+{
+    struct itimerspec its;
+
+    if (timer_fd >= 0) {
+        memset(&its, 0, sizeof(its));
+        timerfd_settime(timer_fd, 0, &its, NULL);
+    }
+}
+
+static void reset(void)
+{
+    configure();
+    start();
+}
+
+static void set_width(int width)
+{
+    int i;
+
+    bufferSizeFrames = width;
+    carry = 0;
+
+    for (i = 0; i < REPLAY_CHANS; i++) {
+        replay_sigs[i].width = width;
+        deep_free(replay_sigs[i].data);
+        replay_sigs[i].data = deep_new(short, width);
+
+        history_resize(&replay_hist[i], width);
+        stage[i] = deep_renew(short, stage[i], width);
+    }
+
+    buffer = deep_renew(char, buffer, width * REPLAY_CHANS * sizeof(int));
+}
+
+static void history_stage(int from, int n)
+{
+    int c;
+
+    for (c = 0; c < file_chans; c++) {
+        history_push(&replay_hist[c], stage[c] + from, n);
+    }
+}
+
+/* When frame 'n' (counting from 'started') is due.  Frames read as fast as possible are from now. */
+
+static long long frame_stamp(long long n)
+{
+    if (replay_max) {
+        return monotonic_ns();
+    }
+    return stamp_add((long long) started.tv_sec * 1000000000LL + started.tv_nsec, n, file_rate);
+}
+
+/* process_frames() - trigger on and copy 'count' frames of buffer into the Signals
+ *
+ * Returns the number of frames used up, which is less than 'count' only if the sweep ended before
+ * the frames did.  Sets *got if any samples went into the sweep buffer.  This is the sound card's
+ * process_frames(), for a file.
+ */
+
+static int process_frames(const char *frames, int count, int *got)
+{
+    int i, n, c, pre;
+    int width = replay_sigs[0].width;
+    int first = 0;
+
+    if (in_progress) {
+        count = min(count, width - in_progress);
+    }
+    deinterleave_short(file_fmt, frames, file_chans, count, stage);
+
+    i = 0;
+    if (!in_progress) {
+        i = trigger_find_s16(&trig, stage[trigch], count, 1);
+
+        if (scope.pretrig) {
+            history_stage(0, i);
+        }
+
+        if (i >= count) {
+            return count;
+        }
+
+        pre = pretrigger_samples(width);
+        for (c = 0; c < file_chans; c++) {
+            signal_writable(&replay_sigs[c], 0);
+            history_copy(&replay_hist[c], replay_sigs[c].data, pre);
+            replay_sigs[c].delay = 0;
+            replay_sigs[c].frame ++;
+            replay_sigs[c].stamp = frame_stamp(delivered + i - pre);
+        }
+
+        first = i;
+        in_progress = pre;
+        stats.triggers ++;
+    }
+
+    n = max(0, min(count - i, width - in_progress));
+    for (c = 0; c < file_chans; c++) {
+        signal_writable(&replay_sigs[c], in_progress);
+        memcpy(replay_sigs[c].data + in_progress, stage[c] + i, n * sizeof(short));
+        replay_sigs[c].num = in_progress + n;
+    }
+    in_progress += n;
+    i += n;
+
+    if (scope.pretrig) {
+        history_stage(first, i - first);
+    }
+
+    if (in_progress >= width) {
+        in_progress = 0;
+        stats.delivered ++;
+        trigger_prime(&trig, stage[trigch][i-1]);
+    }
+    *got = 1;
+    return i;
+}
+
+/* Frames that are due by now, at the recorded rate */
+
+static long long frames_due(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) (((now.tv_sec - started.tv_sec)
+                         + (now.tv_nsec - started.tv_nsec) / 1e9) * file_rate) - delivered;
+}
+
+static int replay_get_data(void)
+{
+    uint64_t expirations;
+    long long want;
+    int fb = frame_bytes();
+    int n, used;
+    int got = 0;
+
+    if ((replay_fp == NULL) || (bufferSizeFrames == 0)) {
+        return 0;
+    }
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+        /* nothing yet, but get_data() is also called without waiting on fd() */
+    }
+
+    want = replay_max ? bufferSizeFrames : frames_due();
+
+    if (!in_progress && (want > bufferSizeFrames)) {
+        /* We've fallen behind, just like a sound card would; keep less than a full sweep */
+        long long skip = want - bufferSizeFrames;
+
+        while (skip > 0) {
+            n = ((skip < bufferSizeFrames) ? skip : bufferSizeFrames) - carry;
+            n = carry + ((n > 0) ? read_frames(buffer + carry * fb, n) : 0);
+            if (n == 0) break;
+            if (scope.pretrig) {
+                deinterleave_short(file_fmt, buffer, file_chans, n, stage);
+                history_stage(0, n);
+            }
+            carry = 0;
+            skip -= n;
+            delivered += n;
+            stats.skipped += n;
+        }
+        want = bufferSizeFrames;
+        trigger_reset(&trig);
+    }
+
+    while (want > 0) {
+        n = (want < bufferSizeFrames) ? want : bufferSizeFrames;
+        if (carry < n) {
+            carry += read_frames(buffer + carry * fb, n - carry);
+        }
+        if (carry == 0) {       /* end of the file - stop the timer until the next reset() */
+            struct itimerspec its;
+
+            memset(&its, 0, sizeof(its));
+            timerfd_settime(timer_fd, 0, &its, NULL);
+            replay_errormsg = "end of file";
+            at_end = 1;
+            break;
+        }
+        n = min(n, carry);
+
+        used = process_frames(buffer, n, &got);
+        carry -= used;
+        memmove(buffer, buffer + used * fb, carry * fb);
+        delivered += used;
+        want -= used;
+
+        if (got && !in_progress) {      /* end of sweep */
+            break;
+        }
+    }
+
+    return got;
+}
+
+static const char * replay_status_str(int i)
+{
+    static char string[64];
+
+    switch (i) {
+    case 0:
+        return replay_file[0] ? replay_file : "Replay";
+
+    case 2:
+        return replay_errormsg ? replay_errormsg : "";
+
+    case 4:
+        if (replay_fp == NULL) return "";
+        snprintf(string, sizeof(string), "%d ch %s %d Hz", file_chans,
+                 raw_names[file_fmt], file_rate);
+        return string;
+
+    case 5:
+        if (replay_fp == NULL) return "";
+        snprintf(string, sizeof(string), "%.1f s", (double) data_pos / file_rate);
+        return string;
+
+    case 6:
+    case 7:
+        return datasrc_stats_str(&stats, i - 6);
+    }
+    return NULL;
+}
+
+static const DataSrcStats * replay_stats(void)
+{
+    return &stats;
+}
+
+static const DataSrcCaps * replay_caps(void)
+{
+    static DataSrcCaps caps;
+
+    caps.formats = file_chans ? 1 << file_fmt : 0;
+    caps.min_rate = caps.max_rate = file_chans ? file_rate : 0;
+    caps.hw_trigger = 0;
+    caps.pretrigger = 1;
+    caps.records = 0;          /* it's already recorded */
+    return &caps;
+}
+
+/* Option 1 key - recorded rate or maximum speed */
+
+static int option1(void)
+{
+    replay_max = !replay_max;
+    return 1;
+}
+
+static const char * option1str(void)
+{
+    return replay_max ? "Max speed" : "Real time";
+}
+
+/* Option 2 key - loop, or stop at the end */
+
+static int option2(void)
+{
+    replay_loop = !replay_loop;
+    return 1;
+}
+
+static const char * option2str(void)
+{
+    return replay_loop ? "Loop" : "Once";
+}
+
+static int replay_set_option(char *option)
+{
+    char name[16];
+    char *p;
+    int i;
+
+    if (strncmp(option, "file=", 5) == 0) {
+        snprintf(replay_file, sizeof(replay_file), "%s", option + 5);
+        if ((p = strchr(replay_file, '\n')) != NULL) {
+            *p = '\0';
+        }
+        close_replay();
+        return 1;
+    } else if (sscanf(option, "speed=%15s", name) == 1) {
+        if (strcasecmp(name, "max") == 0) {
+            replay_max = 1;
+        } else if (strcasecmp(name, "real") == 0) {
+            replay_max = 0;
+        } else {
+            return 0;
+        }
+        return 1;
+    } else if (sscanf(option, "loop=%d", &replay_loop) == 1) {
+        return 1;
+    } else if (sscanf(option, "rawformat=%15s", name) == 1) {
+        for (i = 0; i < (int) (sizeof(raw_names) / sizeof(raw_names[0])); i++) {
+            if (strcasecmp(name, raw_names[i]) == 0) {
+                raw_fmt = i;
+                close_replay();
+                return 1;
+            }
+        }
+        return 0;
+    } else if (sscanf(option, "chans=%d", &raw_chans) == 1) {
+        close_replay();
+        return 1;
+    } else if (sscanf(option, "rate=%d", &raw_rate) == 1) {
+        close_replay();
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+static char * replay_save_option(int i)
+{
+    static char buf[300];
+
+    switch (i) {
+    case 0:
+        snprintf(buf, sizeof(buf), "file=%s", replay_file);
+        return replay_file[0] ? buf : "";
+
+    case 1:
+        snprintf(buf, sizeof(buf), "speed=%s", replay_max ? "max" : "real");
+        return buf;
+
+    case 2:
+        snprintf(buf, sizeof(buf), "loop=%d", replay_loop);
+        return buf;
+
+    case 3:
+        snprintf(buf, sizeof(buf), "rawformat=%s", raw_names[raw_fmt]);
+        return buf;
+
+    case 4:
+        snprintf(buf, sizeof(buf), "chans=%d", raw_chans);
+        return buf;
+
+    case 5:
+        snprintf(buf, sizeof(buf), "rate=%d", raw_rate);
+        return buf;
+
+    default:
+        return NULL;
+    }
+}
+
+DataSrc datasrc_replay = {
+    "Replay",
+    replay_nchans,
+    replay_chan,
+    set_trigger,
+    clear_trigger,
+    NULL,  /* change_rate */
+    set_width,
+    reset,
+    fd,
+    replay_get_data,
+    replay_status_str,
+    option1,
+    option1str,
+    option2,
+    option2str,
+    replay_set_option,
+    replay_save_option,
+    NULL, /* gtk_options */
+    replay_stats,
+    configure,
+    start,
+    stop,
+    NULL, /* pollfds */
+    NULL, /* interval */
+    replay_caps
+};
@@ -0,0 +1,579 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * This file implements a data source fed by another program through shared memory
+ *
+ * The producer (an FPGA readout daemon, say, or xoscope-feed) listens on a Unix domain socket and
+ * hands us a memfd with a ring of interleaved frames and an eventfd to poll on; see shmring.h for
+ * the layout.  The frames are converted straight out of the ring, through the same trigger and
+ * history code as the sound card, so nobody has to copy them before we do.
+ *
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "xoscope.h"            /* program defaults */
+#include "history.h"
+#include "deep.h"
+#include "trigger.h"
+#include "convert.h"
+#include "record.h"
+#include "shmring.h"
+
+#define SHM_CHANS CHANNELS
+
+static char shm_socket[256] = DEFAULT_SHMSOCKET;
+static int sock = -1;
+static int event_fd = -1;
+static ShmRing *ring = NULL;
+static size_t ring_size;
+static ShmRing shape;                   /* its header, as open_shm() checked it */
+static uint64_t tail;                   /* frames we've read, which we tell ring->tail */
+static uint64_t overruns;               /* ring->overruns when we last looked */
+static long long next_ns;               /* when the next frame we process went into the ring */
+
+static const char *fmt_names[] = {"U8", "S16", "S24", "S32", "FLOAT"};
+
+static Signal shm_sigs[SHM_CHANS];
+static History shm_hist[SHM_CHANS];
+
+static Trigger trig;
+static int trigch;
+static DataSrcStats stats;
+static int triglev;                     /* trigger level, in 8 bit sample values */
+
+static short *stage[SHM_CHANS];
+static int bufferSizeFrames = 0;
+
+static const char *shm_errormsg = NULL;
+
+static void close_shm(void)
+{
+    if (ring != NULL) {
+        munmap(ring, ring_size);
+        ring = NULL;
+    }
+    if (event_fd >= 0) {
+        close(event_fd);
+        event_fd = -1;
+    }
+    if (sock >= 0) {
+        close(sock);
+        sock = -1;
+    }
+}
+
+/* Receive the memfd and the eventfd that the producer sends as soon as we connect */
+
+static int receive_fds(int *fds)
+{
+    char byte;
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+        return 0;
+    }
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if ((cmsg == NULL) || (cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS)
+        || (cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)))) {
+        return 0;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+    return 1;
+}
+
+/* The ring's consumer side (shmring_avail() and shmring_release()), going by our copy of its layout
+ * and our own count of what we've read, so that whatever the producer writes into the header can't
+ * take us outside the ring.  A head more than a ring ahead of us is taken to be a full ring.
+ */
+
+static uint64_t ring_waiting(void)
+{
+    uint64_t avail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+
+    return (avail < shape.frames) ? avail : shape.frames;
+}
+
+static uint32_t ring_avail(const char **where)
+{
+    uint64_t avail = ring_waiting();
+    uint64_t contig = shape.frames - (tail & (shape.frames - 1));
+
+    *where = (const char *) ring + shape.offset + (tail & (shape.frames - 1)) * shape.frame_bytes;
+    return (avail < contig) ? avail : contig;
+}
+
+static void ring_release(uint64_t n)
+{
+    tail += n;
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+}
+
+/* Connect to the producer and map its ring.  Returns TRUE if we have a ring we can use. */
+
+static int open_shm(void)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fds[2];
+    void *map;
+
+    if (ring != NULL) {
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", shm_socket);
+
+    if (((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        || (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0)) {
+        shm_errormsg = strerror(errno);
+        close_shm();
+        return 0;
+    }
+    if (!receive_fds(fds)) {
+        shm_errormsg = "no ring from the producer";
+        close_shm();
+        return 0;
+    }
+    event_fd = fds[1];
+
+    if ((fstat(fds[0], &st) < 0) || (st.st_size < (off_t) sizeof(ShmRing))
+        || ((map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0))
+            == MAP_FAILED)) {
+        shm_errormsg = "can't map the ring";
+        close(fds[0]);
+        close_shm();
+        return 0;
+    }
+    close(fds[0]);
+    ring = map;
+    ring_size = st.st_size;
+
+    /* The producer can still write the header, so only ever look at it once: everything after
+     * this goes by our copy, and only 'head' and 'overruns' are read from the mapping again.
+     */
+    memcpy(&shape, ring, sizeof(shape));
+    if ((shape.magic != SHMRING_MAGIC) || (shape.version != SHMRING_VERSION)
+        || (shape.chans < 1) || (shape.chans > SHM_CHANS) || (shape.rate == 0)
+        || (shape.rate > INT32_MAX) || (shape.format > FMT_FLOAT) || (shape.frames == 0)
+        || (shape.frames & (shape.frames - 1))
+        || (shape.frame_bytes != shape.chans * sample_bytes(shape.format))
+        || (shape.offset < sizeof(ShmRing))
+        || (shape.offset + (uint64_t) shape.frames * shape.frame_bytes > ring_size)) {
+        shm_errormsg = "not a ring we can read";
+        close_shm();
+        return 0;
+    }
+    trigch = min(trigch, shape.chans - 1);
+
+    /* start with what comes in from now on */
+    tail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    ring_release(0);
+    overruns = ring->overruns;
+    shm_errormsg = NULL;
+    return 1;
+}
+
+static int shm_nchans(void)
+{
+    open_shm();
+    return ring ? (int) shape.chans : 0;
+}
+
+static int fd(void)
+{
+    return event_fd;
+}
+
+static Signal *shm_chan(int chan)
+{
+    return &shm_sigs[chan];
+}
+
+/* Triggering - like the sound card, we trigger on the converted samples */
+
+static void scale_trigger(void)
+{
+    trig.level = triglev * SAMPLE_UNIT(&shm_sigs[0]);
+    trig.hyst = scope.trighyst * SAMPLE_UNIT(&shm_sigs[0]);
+    trigger_reset(&trig);
+}
+
+static int set_trigger(int chan, int *levelp, int mode)
+{
+    trigch = ring ? min(chan, shape.chans - 1) : chan;
+    trig.mode = mode;
+    triglev = *levelp;
+    if (triglev > 128) {
+        triglev = 128;
+        *levelp = 128;
+    }
+    if (triglev < -127) {
+        triglev = -127;
+        *levelp = -128;
+    }
+    scale_trigger();
+    return 1;
+}
+
+static void clear_trigger(void)
+{
+    trig.mode = 0;
+}
+
+static void configure(void)
+{
+    int i;
+
+    open_shm();
+
+    for (i = 0; i < SHM_CHANS; i++) {
+        if (shm_sigs[i].name[0] == '\0') {
+            snprintf(shm_sigs[i].name, sizeof(shm_sigs[i].name), "Shm %c", 'a' + i);
+            shm_sigs[i].savestr[0] = 'a' + i;
+            shm_sigs[i].savestr[1] = '\0';
+        }
+        shm_sigs[i].rate = ring ? (int) shape.rate : 0;
+        shm_sigs[i].volts = 0;
+        shm_sigs[i].resolution = ring ? sample_resolution(shape.format) : 0;
+    }
+}
+
+static void start(void)
+{
+    int i;
+
+    for (i = 0; i < SHM_CHANS; i++) {
+        shm_sigs[i].num = 0;
+        shm_sigs[i].frame ++;
+
+        history_clear(&shm_hist[i]);
+    }
+    scale_trigger();
+
+    in_progress = 0;
+}
+
+/* Hang up, so the producer stops waking us; configure() connects again */
+
+static void stop(void)
+{
+    close_shm();
+}
+
+static void reset(void)
+{
+    configure();
+    start();
+}
+
+static void set_width(int width)
+{
+    int i;
+
+    bufferSizeFrames = width;
+
+    for (i = 0; i < SHM_CHANS; i++) {
+        shm_sigs[i].width = width;
+        deep_free(shm_sigs[i].data);
+        shm_sigs[i].data = deep_new(short, width);
+
+        history_resize(&shm_hist[i], width);
+        stage[i] = deep_renew(short, stage[i], width);
+    }
+}
+
+static void history_stage(int from, int n)
+{
+    int c;
+
+    for (c = 0; c < (int) shape.chans; c++) {
+        history_push(&shm_hist[c], stage[c] + from, n);
+    }
+}
+
+/* process_frames() - trigger on and copy 'count' frames at 'frames' into the Signals
+ *
+ * Returns the number of frames used up, which is less than 'count' only if the sweep ended before
+ * the frames did.  Sets *got if any samples went into the sweep buffer.  This is the sound card's
+ * process_frames(), for the ring.
+ */
+
+static int process_frames(const char *frames, int count, int *got)
+{
+    int i, n, c, pre;
+    int width = shm_sigs[0].width;
+    int first = 0;
+
+    if (in_progress) {
+        count = min(count, width - in_progress);
+    }
+    count = min(count, bufferSizeFrames);
+    deinterleave_short(shape.format, frames, shape.chans, count, stage);
+
+    i = 0;
+    if (!in_progress) {
+        i = trigger_find_s16(&trig, stage[trigch], count, 1);
+
+        if (scope.pretrig) {
+            history_stage(0, i);
+        }
+
+        if (i >= count) {
+            return count;
+        }
+
+        pre = pretrigger_samples(width);
+        for (c = 0; c < (int) shape.chans; c++) {
+            signal_writable(&shm_sigs[c], 0);
+            history_copy(&shm_hist[c], shm_sigs[c].data, pre);
+            shm_sigs[c].delay = 0;
+            shm_sigs[c].frame ++;
+            shm_sigs[c].stamp = stamp_add(next_ns, i - pre, shape.rate);
+        }
+
+        first = i;
+        in_progress = pre;
+        stats.triggers ++;
+    }
+
+    n = max(0, min(count - i, width - in_progress));
+    for (c = 0; c < (int) shape.chans; c++) {
+        signal_writable(&shm_sigs[c], in_progress);
+        memcpy(shm_sigs[c].data + in_progress, stage[c] + i, n * sizeof(short));
+        shm_sigs[c].num = in_progress + n;
+    }
+    in_progress += n;
+    i += n;
+
+    if (scope.pretrig) {
+        history_stage(first, i - first);
+    }
+
+    if (in_progress >= width) {
+        in_progress = 0;
+        stats.delivered ++;
+        trigger_prime(&trig, stage[trigch][i-1]);
+    }
+    *got = 1;
+    return i;
+}
+
+/* Let go of all but the last sweep's worth of the 'avail' frames in the ring, like the sound card's
+ * skip_stale().  Only the frames the pre-trigger history can still use get converted, unless we're
+ * recording, and the recorder needs all of them.
+ */
+
+static void skip_stale(uint64_t avail)
+{
+    uint64_t skip = avail - bufferSizeFrames;
+    const char *frames;
+    int keep = 0;
+    int n;
+
+    if (record_active()) {
+        keep = skip;
+        stats.skipped += skip;
+    } else if (scope.pretrig) {
+        keep = (skip < (uint64_t) bufferSizeFrames) ? skip : bufferSizeFrames;
+        keep = min(keep, pretrigger_samples(bufferSizeFrames));
+    }
+
+    ring_release(skip - keep);
+    stats.skipped += skip - keep;
+    next_ns = stamp_add(next_ns, skip - keep, shape.rate);
+
+    while (keep > 0) {
+        n = min(min(ring_avail(&frames), keep), bufferSizeFrames);
+        deinterleave_short(shape.format, frames, shape.chans, n, stage);
+        record_frames(stage, shape.chans, n, shape.rate, next_ns);
+        if (scope.pretrig) {
+            history_stage(0, n);
+        }
+        ring_release(n);
+        next_ns = stamp_add(next_ns, n, shape.rate);
+        keep -= n;
+    }
+
+    /* the trigger didn't see what we let go of */
+    trigger_reset(&trig);
+}
+
+/* Has the producer hung up on us?  It doesn't send anything after the descriptors. */
+
+static int producer_gone(void)
+{
+    char byte;
+
+    return recv(sock, &byte, 1, MSG_DONTWAIT | MSG_PEEK) == 0;
+}
+
+static int shm_get_data(void)
+{
+    uint64_t count, avail;
+    const char *frames;
+    int n, used;
+    int got = 0;
+
+    if ((ring == NULL) || (bufferSizeFrames == 0)) {
+        return 0;
+    }
+    if (read(event_fd, &count, sizeof(count)) < 0) {
+        /* nothing yet, but get_data() is also called without waiting on fd() */
+    }
+
+    if (ring->overruns != overruns) {
+        stats.xruns += ring->overruns - overruns;
+        overruns = ring->overruns;
+        record_break();
+    }
+
+    avail = ring_waiting();
+    if (avail == 0) {
+        if (producer_gone()) {
+            shm_errormsg = "producer hung up";
+            close_shm();
+            in_progress = 0;
+        }
+        return 0;
+    }
+
+    /* The producer doesn't say when it wrote the frames, so the newest is taken to be from now */
+    next_ns = stamp_add(monotonic_ns(), -(long long) avail, shape.rate);
+
+    if (!in_progress && (avail > (uint64_t) bufferSizeFrames)) {
+        skip_stale(avail);
+    }
+
+    while ((n = ring_avail(&frames)) > 0) {
+        used = process_frames(frames, n, &got);
+        record_frames(stage, shape.chans, used, shape.rate, next_ns);
+        ring_release(used);
+        next_ns = stamp_add(next_ns, used, shape.rate);
+
+        if (got && !in_progress) {      /* end of sweep */
+            break;
+        }
+    }
+
+    return got;
+}
+
+static const char * shm_status_str(int i)
+{
+    static char string[64];
+
+    switch (i) {
+    case 0:
+        return shm_socket;
+
+    case 2:
+        return shm_errormsg ? shm_errormsg : "";
+
+    case 4:
+        if (ring == NULL) return "";
+        snprintf(string, sizeof(string), "%d ch %s %d Hz", shape.chans,
+                 fmt_names[shape.format], shape.rate);
+        return string;
+
+    case 6:
+    case 7:
+        return datasrc_stats_str(&stats, i - 6);
+    }
+    return NULL;
+}
+
+static const DataSrcStats * shm_stats(void)
+{
+    return &stats;
+}
+
+static const DataSrcCaps * shm_caps(void)
+{
+    static DataSrcCaps caps;
+
+    caps.formats = ring ? 1 << shape.format : 0;
+    caps.min_rate = caps.max_rate = ring ? (int) shape.rate : 0;
+    caps.hw_trigger = 0;
+    caps.pretrigger = 1;
+    caps.records = 1;
+    return &caps;
+}
+
+static int shm_set_option(char *option)
+{
+    char *p;
+
+    if (strncmp(option, "socket=", 7) == 0) {
+        snprintf(shm_socket, sizeof(shm_socket), "%s", option + 7);
+        if ((p = strchr(shm_socket, '\n')) != NULL) {
+            *p = '\0';
+        }
+        close_shm();
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+static char * shm_save_option(int i)
+{
+    static char buf[300];
+
+    switch (i) {
+    case 0:
+        snprintf(buf, sizeof(buf), "socket=%s", shm_socket);
+        return buf;
+
+    default:
+        return NULL;
+    }
+}
+
+DataSrc datasrc_shm = {
+    "Shm",
+    shm_nchans,
+    shm_chan,
+    set_trigger,
+    clear_trigger,
+    NULL,  /* change_rate */
+    set_width,
+    reset,
+    fd,
+    shm_get_data,
+    shm_status_str,
+    NULL,  /* option1 */
+    NULL,  /* option1str */
+    NULL,  /* option2 */
+    NULL,  /* option2str */
+    shm_set_option,
+    shm_save_option,
+    NULL, /* gtk_options */
+    shm_stats,
+    configure,
+    start,
+    stop,
+    NULL, /* pollfds */
+    NULL, /* interval */
+    shm_caps
+};
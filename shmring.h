@@ -0,0 +1,90 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * The shared memory ring that external producers feed the Shm data source (shm.c) through
+ *
+ * A producer creates a memfd holding a ShmRing header followed by the ring itself, and an eventfd,
+ * and listens on a Unix domain socket.  xoscope connects to the socket and is handed both
+ * descriptors (SCM_RIGHTS) with a one byte message.  The producer writes interleaved frames
+ * straight into the ring (see shmring_space() and shmring_commit()) and writes the eventfd to wake
+ * us up; we convert them out of the ring into the Signals and move the tail on.  Neither side
+ * ever waits for the other: if the ring is full, the producer throws the block away and counts it
+ * in 'overruns', just like a sound card would.
+ *
+ * feed.c (xoscope-feed) is a producer that feeds the ring from its standard input.
+ *
+ */
+
+#include <stdint.h>
+
+#define SHMRING_MAGIC   0x72687378      /* "xshr" */
+#define SHMRING_VERSION 1
+
+#define DEFAULT_SHMSOCKET "/tmp/xoscope-feed"
+
+typedef struct ShmRing {
+    uint32_t magic;             /* SHMRING_MAGIC */
+    uint32_t version;           /* SHMRING_VERSION */
+    uint32_t rate;              /* frames per second */
+    uint32_t chans;             /* interleaved channels per frame */
+    uint32_t format;            /* SampleFormat (convert.h): 0 U8, 1 S16, 2 S24, 3 S32, 4 FLOAT */
+    uint32_t frames;            /* size of the ring in frames, a power of two */
+    uint32_t frame_bytes;       /* size of one frame */
+    uint32_t offset;            /* where the ring starts, from the start of the ShmRing */
+    uint64_t overruns;          /* blocks the producer threw away because the ring was full */
+
+    /* Free running frame counters, each written by one side only and on its own cache line */
+    uint64_t head __attribute__ ((aligned (64)));       /* frames written, by the producer */
+    uint64_t tail __attribute__ ((aligned (64)));       /* frames read, by the consumer */
+} ShmRing;
+
+/* Size of the memfd for a ring of 'frames' frames of 'frame_bytes' bytes */
+
+static inline size_t shmring_size(uint32_t frames, uint32_t frame_bytes)
+{
+    return ((sizeof(ShmRing) + 63) & ~63) + (size_t) frames * frame_bytes;
+}
+
+static inline char * shmring_frame(ShmRing *ring, uint64_t n)
+{
+    return (char *) ring + ring->offset + (n & (ring->frames - 1)) * ring->frame_bytes;
+}
+
+/* Producer side: the number of frames that can be written in one piece at *where, and committing
+ * 'n' of them once they're there
+ */
+
+static inline uint32_t shmring_space(ShmRing *ring, char **where)
+{
+    uint64_t head = ring->head;
+    uint64_t room = ring->frames - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+    uint64_t contig = ring->frames - (head & (ring->frames - 1));
+
+    *where = shmring_frame(ring, head);
+    return (room < contig) ? room : contig;
+}
+
+static inline void shmring_commit(ShmRing *ring, uint32_t n)
+{
+    __atomic_store_n(&ring->head, ring->head + n, __ATOMIC_RELEASE);
+}
+
+/* Consumer side: the number of frames that can be read in one piece at *where, and letting go of
+ * 'n' of them
+ */
+
+static inline uint32_t shmring_avail(ShmRing *ring, const char **where)
+{
+    uint64_t tail = ring->tail;
+    uint64_t avail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+    uint64_t contig = ring->frames - (tail & (ring->frames - 1));
+
+    *where = shmring_frame(ring, tail);
+    return (avail < contig) ? avail : contig;
+}
+
+static inline void shmring_release(ShmRing *ring, uint64_t n)
+{
+    __atomic_store_n(&ring->tail, ring->tail + n, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,413 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * This file implements the software trigger shared by the data sources
+ *
+ * A trigger is a little state machine.  For a rising edge, it first waits for the signal to get
+ * below (level - hyst), which arms it, then for the signal to reach level, which fires it.  Falling
+ * edges are the mirror image.  With hyst == 0 that's just "the previous sample was below the level
+ * and this one isn't".
+ *
+ * Each of the two waits is a search for the first sample above or below some value, which is
+ * where all the time goes when the trigger doesn't fire for a while.  Those searches compare a
+ * whole vector of samples at once (AVX2 if the CPU has it, otherwise SSE2) whenever the channel's
+ * samples fall on fixed lanes of a vector, that is whenever the stride divides the number of lanes,
+ * and there are at least four of them per vector.  Anything else (three COMEDI channels, say) takes
+ * the plain loop.
+ *
+ * Compile with -DTIME_TRIGGER to have the search rate printed on stderr now and then, or build
+ * this file alone with -DTRIGGER_BENCH for a benchmark of the different search loops.
+ *
+ */
+
+#include <stdio.h>
+#include "trigger.h"
+
+#ifdef TIME_TRIGGER
+#include <time.h>
+#endif
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define HAVE_SSE2_TRIGGER 1
+#include <emmintrin.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_AVX2_TRIGGER 1
+#include <immintrin.h>
+#endif
+#endif
+
+/* The sample types we know about.  Everything is compared as signed, so unsigned samples are
+ * flipped into the signed range by xor'ing the top bit (bias), and the trigger level is moved by
+ * the same amount (offset).
+ */
+
+enum { S16, U16, U8 };
+
+static const struct {
+    int width;                  /* bytes per sample */
+    int bias;
+    int offset;
+    int min, max;               /* range of a sample once biased */
+} types[] = {
+    {2, 0, 0, -32768, 32767},
+    {2, 0x8000, 32768, -32768, 32767},
+    {1, 0x80, 128, -128, 127},
+};
+
+/* 0 - plain loops; 1 - SSE2; 2 - AVX2; -1 - not decided yet */
+static int simd = -1;
+
+static void pick_simd(void)
+{
+    simd = 0;
+#ifdef HAVE_SSE2_TRIGGER
+    simd = 1;
+#endif
+#ifdef HAVE_AVX2_TRIGGER
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) simd = 2;
+#endif
+}
+
+/* Plain loops - the index of the first of n samples that is greater (gt) or less (!gt) than x */
+
+static int find16_plain(const unsigned short *p, int n, int stride, int x, int gt, int bias)
+{
+    int k;
+
+    if (gt) {
+        for (k = 0; k < n && (short) (p[k * stride] ^ bias) <= x; k++);
+    } else {
+        for (k = 0; k < n && (short) (p[k * stride] ^ bias) >= x; k++);
+    }
+    return k;
+}
+
+static int find8_plain(const unsigned char *p, int n, int stride, int x, int gt, int bias)
+{
+    int k;
+
+    if (gt) {
+        for (k = 0; k < n && (signed char) (p[k * stride] ^ bias) <= x; k++);
+    } else {
+        for (k = 0; k < n && (signed char) (p[k * stride] ^ bias) >= x; k++);
+    }
+    return k;
+}
+
+/* Bits of a byte compare mask (one per byte of a 'bytes' long vector) that belong to samples of
+ * our channel, the first byte of the vector being the first byte of one of our samples
+ */
+
+static unsigned int lane_bits(int stride, int width, int bytes)
+{
+    unsigned int bits = 0;
+    int b;
+
+    for (b = 0; b < bytes; b++) {
+        if ((b / width) % stride == 0) bits |= 1u << b;
+    }
+    return bits;
+}
+
+#ifdef HAVE_SSE2_TRIGGER
+
+/* The vector loops stop while a whole vector still fits before the last sample, and leave the
+ * rest to the plain loops.
+ */
+
+static int find16_sse2(const unsigned short *p, int n, int stride, int x, int gt, int bias)
+{
+    __m128i vx = _mm_set1_epi16(x);
+    __m128i vb = _mm_set1_epi16(bias);
+    unsigned int bits = lane_bits(stride, 2, 16);
+    int end = (n - 1) * stride + 1;
+    int k;
+
+    for (k = 0; k * stride + 8 <= end; k += 8 / stride) {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (p + k * stride)), vb);
+        unsigned int m = _mm_movemask_epi8(gt ? _mm_cmpgt_epi16(v, vx) : _mm_cmpgt_epi16(vx, v));
+        if (m & bits) return k + __builtin_ctz(m & bits) / (2 * stride);
+    }
+    return k + find16_plain(p + k * stride, n - k, stride, x, gt, bias);
+}
+
+static int find8_sse2(const unsigned char *p, int n, int stride, int x, int gt, int bias)
+{
+    __m128i vx = _mm_set1_epi8(x);
+    __m128i vb = _mm_set1_epi8(bias);
+    unsigned int bits = lane_bits(stride, 1, 16);
+    int end = (n - 1) * stride + 1;
+    int k;
+
+    for (k = 0; k * stride + 16 <= end; k += 16 / stride) {
+        __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (p + k * stride)), vb);
+        unsigned int m = _mm_movemask_epi8(gt ? _mm_cmpgt_epi8(v, vx) : _mm_cmpgt_epi8(vx, v));
+        if (m & bits) return k + __builtin_ctz(m & bits) / stride;
+    }
+    return k + find8_plain(p + k * stride, n - k, stride, x, gt, bias);
+}
+
+#endif
+
+#ifdef HAVE_AVX2_TRIGGER
+
+__attribute__ ((target("avx2")))
+static int find16_avx2(const unsigned short *p, int n, int stride, int x, int gt, int bias)
+{
+    __m256i vx = _mm256_set1_epi16(x);
+    __m256i vb = _mm256_set1_epi16(bias);
+    unsigned int bits = lane_bits(stride, 2, 32);
+    int end = (n - 1) * stride + 1;
+    int k;
+
+    for (k = 0; k * stride + 16 <= end; k += 16 / stride) {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (p + k * stride)), vb);
+        unsigned int m = _mm256_movemask_epi8(gt ? _mm256_cmpgt_epi16(v, vx)
+                                              : _mm256_cmpgt_epi16(vx, v));
+        if (m & bits) return k + __builtin_ctz(m & bits) / (2 * stride);
+    }
+    return k + find16_sse2(p + k * stride, n - k, stride, x, gt, bias);
+}
+
+__attribute__ ((target("avx2")))
+static int find8_avx2(const unsigned char *p, int n, int stride, int x, int gt, int bias)
+{
+    __m256i vx = _mm256_set1_epi8(x);
+    __m256i vb = _mm256_set1_epi8(bias);
+    unsigned int bits = lane_bits(stride, 1, 32);
+    int end = (n - 1) * stride + 1;
+    int k;
+
+    for (k = 0; k * stride + 32 <= end; k += 32 / stride) {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) (p + k * stride)), vb);
+        unsigned int m = _mm256_movemask_epi8(gt ? _mm256_cmpgt_epi8(v, vx)
+                                              : _mm256_cmpgt_epi8(vx, v));
+        if (m & bits) return k + __builtin_ctz(m & bits) / stride;
+    }
+    return k + find8_sse2(p + k * stride, n - k, stride, x, gt, bias);
+}
+
+#endif
+
+/* A vector loop only pays off if each vector holds a few of our samples */
+
+static inline int worth(int lanes, int stride)
+{
+    return lanes % stride == 0 && lanes / stride >= 4;
+}
+
+/* First of n samples (of type 'type') that is greater (gt) or less (!gt) than x, where x is in the
+ * biased range and may be outside of what a sample can hold
+ */
+
+static int find(const void *s, int n, int stride, int x, int gt, int type)
+{
+    int bias = types[type].bias;
+
+    if (gt ? (x >= types[type].max) : (x <= types[type].min)) return n;
+    if (gt ? (x < types[type].min) : (x > types[type].max)) return 0;
+
+    if (types[type].width == 2) {
+#ifdef HAVE_AVX2_TRIGGER
+        if (simd >= 2 && worth(16, stride)) return find16_avx2(s, n, stride, x, gt, bias);
+#endif
+#ifdef HAVE_SSE2_TRIGGER
+        if (simd >= 1 && worth(8, stride)) return find16_sse2(s, n, stride, x, gt, bias);
+#endif
+        return find16_plain(s, n, stride, x, gt, bias);
+    } else {
+#ifdef HAVE_AVX2_TRIGGER
+        if (simd >= 2 && worth(32, stride)) return find8_avx2(s, n, stride, x, gt, bias);
+#endif
+#ifdef HAVE_SSE2_TRIGGER
+        if (simd >= 1 && worth(16, stride)) return find8_sse2(s, n, stride, x, gt, bias);
+#endif
+        return find8_plain(s, n, stride, x, gt, bias);
+    }
+}
+
+/* sample k of s, in the data source's units */
+
+static int sample(const void *s, int k, int type)
+{
+    switch (type) {
+    case S16:
+        return ((const short *) s)[k];
+    case U16:
+        return ((const unsigned short *) s)[k];
+    default:
+        return ((const unsigned char *) s)[k];
+    }
+}
+
+#ifdef TIME_TRIGGER
+static double searched = 0;
+static clock_t spent = 0;
+#endif
+
+static int search(Trigger *t, const void *s, int n, int stride, int type)
+{
+    const char *p = s;
+    int step = stride * types[type].width;      /* bytes from one of our samples to the next */
+    int level = t->level - types[type].offset;
+    int i = 0;
+#ifdef TIME_TRIGGER
+    clock_t begin = clock();
+#endif
+
+    if (simd < 0) pick_simd();
+
+    if (n <= 0) return n;
+
+    if (t->mode == 0) {
+        t->before = t->last;
+        t->last = sample(s, 0, type);
+        return 0;
+    }
+
+    /* wait for the signal to arm the trigger, unless it already has */
+
+    if (!t->armed) {
+        if (t->mode == 1) {
+            i = find(p, n, stride, level - t->hyst, 0, type);
+        } else {
+            i = find(p, n, stride, level + t->hyst, 1, type);
+        }
+        t->armed = (i < n);
+    }
+
+    /* then for it to reach the level */
+
+    if (t->armed) {
+        if (t->mode == 1) {
+            i += find(p + i * step, n - i, stride, level - 1, 1, type);
+        } else {
+            i += find(p + i * step, n - i, stride, level + 1, 0, type);
+        }
+    }
+
+    if (i < n) {
+        t->armed = 0;
+        t->before = (i > 0) ? sample(s, (i - 1) * stride, type) : t->last;
+        t->last = sample(s, i * stride, type);
+    } else {
+        i = n;
+        t->last = sample(s, (n - 1) * stride, type);
+    }
+
+#ifdef TIME_TRIGGER
+    spent += clock() - begin;
+    searched += (i < n) ? i + 1 : n;
+    if (searched > 1e8) {
+        fprintf(stderr, "trigger: %.1f Msamples/s searched\n",
+                searched / 1e6 / ((double) spent / CLOCKS_PER_SEC));
+        searched = 0;
+        spent = 0;
+    }
+#endif
+
+    return i;
+}
+
+/* Forget what we've seen; the next samples don't follow the last ones */
+
+void trigger_reset(Trigger *t)
+{
+    t->armed = 0;
+    t->last = t->before = t->level;
+}
+
+/* The next samples follow 'last', which the trigger didn't see (because it was in a sweep) */
+
+void trigger_prime(Trigger *t, int last)
+{
+    if (t->mode == 1) {
+        t->armed = last < t->level - t->hyst;
+    } else if (t->mode == 2) {
+        t->armed = last > t->level + t->hyst;
+    }
+    t->last = last;
+}
+
+int trigger_find_s16(Trigger *t, const short *s, int n, int stride)
+{
+    return search(t, s, n, stride, S16);
+}
+
+int trigger_find_u16(Trigger *t, const unsigned short *s, int n, int stride)
+{
+    return search(t, s, n, stride, U16);
+}
+
+int trigger_find_u8(Trigger *t, const unsigned char *s, int n, int stride)
+{
+    return search(t, s, n, stride, U8);
+}
+
+#ifdef TRIGGER_BENCH
+
+/* gcc -O2 -DTRIGGER_BENCH trigger.c -o trigbench && ./trigbench
+ *
+ * Searches a noisy signal that never reaches the trigger level, so every sample gets looked at,
+ * with each of the search loops this machine can run.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_SAMPLES (1 << 20)
+#define BENCH_PASSES 200
+
+int main(void)
+{
+    static short s16[BENCH_SAMPLES * 3];
+    static unsigned char u8[BENCH_SAMPLES * 3];
+    static const char *names[] = {"plain", "SSE2", "AVX2"};
+    static const int strides[] = {1, 2, 3, 4};
+    Trigger t = {.mode = 1, .level = 20000, .hyst = 0};
+    unsigned int st;
+    int best, level, pass, i, n;
+    clock_t begin;
+    double secs;
+
+    for (i = 0; i < BENCH_SAMPLES * 3; i++) {
+        s16[i] = (rand() % 20000) - 10000;
+        u8[i] = 64 + rand() % 128;
+    }
+
+    pick_simd();
+    best = simd;
+
+    for (level = 0; level <= best; level++) {
+        simd = level;
+        for (st = 0; st < sizeof(strides) / sizeof(strides[0]); st++) {
+            n = BENCH_SAMPLES * 3 / strides[st];
+
+            t.level = 20000;
+            trigger_reset(&t);
+            begin = clock();
+            for (pass = 0; pass < BENCH_PASSES; pass++) {
+                trigger_find_s16(&t, s16, n, strides[st]);
+            }
+            secs = (double) (clock() - begin) / CLOCKS_PER_SEC;
+            printf("%-5s 16 bit stride %d: %8.1f Msamples/s\n", names[level], strides[st],
+                   (double) n * BENCH_PASSES / secs / 1e6);
+
+            t.level = 250;
+            trigger_reset(&t);
+            begin = clock();
+            for (pass = 0; pass < BENCH_PASSES; pass++) {
+                trigger_find_u8(&t, u8, n, strides[st]);
+            }
+            secs = (double) (clock() - begin) / CLOCKS_PER_SEC;
+            printf("%-5s  8 bit stride %d: %8.1f Msamples/s\n", names[level], strides[st],
+                   (double) n * BENCH_PASSES / secs / 1e6);
+        }
+    }
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,32 @@
+/* -*- mode: C++; indent-tabs-mode: nil; fill-column: 100; c-basic-offset: 4; -*-
+ *
+ * (see the files README and COPYING for more details)
+ *
+ * Prototypes for the software trigger in trigger.c
+ *
+ */
+
+/* The state of one software trigger.  Data sources fill in mode, level and hyst (in their own
+ * sample units) from set_trigger(), and then hand blocks of samples to one of the trigger_find
+ * functions.  The rest is kept between calls, so a crossing that straddles two blocks is found.
+ */
+
+typedef struct Trigger {
+    int mode;                   /* 0 - freerun; 1 - rising edge; 2 - falling edge */
+    int level;                  /* trigger level */
+    int hyst;                   /* the signal must get this far past level the other way first */
+    int armed;                  /* the signal has been far enough on the other side */
+    int before;                 /* after a trigger, the sample just before it */
+    int last;                   /* the last sample searched */
+} Trigger;
+
+void    trigger_reset(Trigger *);
+void    trigger_prime(Trigger *, int);
+
+/* Each of these searches n samples, one every 'stride' elements of s, and returns the index of the
+ * first sample at or past the trigger level, or n if the trigger didn't fire.
+ */
+
+int     trigger_find_s16(Trigger *, const short *s, int n, int stride);
+int     trigger_find_u16(Trigger *, const unsigned short *s, int n, int stride);
+int     trigger_find_u8(Trigger *, const unsigned char *s, int n, int stride);
@@ -13,10 +13,14 @@
 #include <unistd.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
 #include "xoscope.h"            /* program defaults */
 #include "display.h"            /* display routines */
 #include "func.h"               /* signal math functions */
 #include "file.h"               /* file I/O functions */
+#include "acquire.h"            /* threaded acquisition */
+#include "deep.h"               /* deep sample buffers */
+#include "record.h"             /* continuous recorder */
 
 /* global program structures */
 Scope scope;
@@ -30,6 +34,11 @@ extern DataSrc datasrc_esd;
 #ifdef HAVE_LIBCOMEDI
 extern DataSrc datasrc_comedi;
 #endif
+#ifdef HAVE_SYS_TIMERFD_H
+extern DataSrc datasrc_replay;
+extern DataSrc datasrc_generator;
+#endif
+extern DataSrc datasrc_shm;
 
 DataSrc *datasrcs[] = {
 #ifdef HAVE_LIBCOMEDI
@@ -39,7 +48,14 @@ DataSrc *datasrcs[] = {
     &datasrc_esd,
 #endif
 #ifdef HAVE_LIBASOUND
-    &datasrc_sc
+    &datasrc_sc,
+#endif
+#ifdef HAVE_SYS_TIMERFD_H
+    &datasrc_replay,            /* never picked by itself: no channels until given a file */
+#endif
+    &datasrc_shm,               /* no channels either until a producer is listening */
+#ifdef HAVE_SYS_TIMERFD_H
+    &datasrc_generator,         /* always there, so last: what we get without any hardware */
 #endif
 };
 
@@ -56,8 +72,9 @@ char error[256];                /* buffer for "one-line" error messages */
 int clip = 0;                   /* whether we're maxed out or not */
 char *filename;                 /* default file name */
 int frames = 0;                 /* # of frames (full or partial) captured */
-int in_progress = 0;            /* frame collection in progress?
+__thread int in_progress = 0;   /* frame collection in progress?
                                  *   if so, this is index of next sample
+                                 *   (per thread, see acquire.c)
                                  */
 
 const char * datasrc_names(void)
@@ -96,7 +113,7 @@ Startup Options  Description (defaults)               version %s\n\
 -# <code>        #=1-%d, code=pos[.bits][:scale[:func#, mem a-z or cmd]] (0:1/1)\n\
 -a <channel>     set the Active channel: 1-%d                  (%d)\n\
 -s <scale>       time Scale: 1/500000-2000/1 where 1=1ms/div  (1/%d)\n\
--t <trigger>     Trigger level[:type[:channel]]               (%s)\n\
+-t <trigger>     Trigger level[:type[:channel[:pre%%[:hyst]]]] (%s)\n\
 -l <cursors>     cursor Line positions: first[:second[:on?]]  (%s)\n\
 -f <font name>   the Font name as-in %s\n\
 -p <type>        Plot mode: 0.=point .0=sweep                 (%02d)\n\
@@ -104,6 +121,9 @@ Startup Options  Description (defaults)               version %s\n\
                             2.=step  .2=strip-chart\n\
 -g <style>       Graticule: 0=none,  1=minor, 2=major         (%d)\n\
 -i <min interv>  Minimum display update interval (ms)         (50)\n\
+-m <mem:file>    keep Memory a-z in a file, loading what's there\n\
+-e <file>        record Every sample to a file\n\
+-w               acquire data in a separate Worker thread\n\
 -b               %s Behind instead of in front of %s\n\
 -v               turn Verbose key help display %s\n\
 file             %s file to load to restore settings and memory\n\
@@ -131,14 +151,24 @@ void parse_args(int argc, char **argv)
 {
     const char     *flags = "Hh"
         "1:2:3:4:5:6:7:8:"
-        "a:r:s:t:l:c:m:d:f:p:g:o:i:bvxyz"
-        "A:R:S:T:L:C:M:D:F:P:G:o:I:BVXYZ";
+        "a:r:s:t:l:c:m:e:d:f:p:g:o:i:bvwxyz"
+        "A:R:S:T:L:C:M:E:D:F:P:G:o:I:BVWXYZ";
     int c;
 
+    /* Threaded acquisition has to be known before we open any data source. */
+
+    while ((c = getopt(argc, argv, flags)) != EOF) {
+        if ((c == 'w') || (c == 'W')) {
+            handle_opt(c, optarg);
+        }
+    }
+
     /* If a data source, data source option, or ALSA device name was specified on the command line,
      * parse them first.
      */
 
+    optind = 1;
+
     while ((c = getopt(argc, argv, flags)) != EOF) {
         if ((c == 'D') || (c == 'o') || (c == 'A')) {
             handle_opt(c, optarg);
@@ -166,6 +196,7 @@ void parse_args(int argc, char **argv)
 void cleanup(void)
 {
     cleanup_math();
+    record_stop();
 }
 
 /* initialize the scope */
@@ -213,23 +244,15 @@ void init_channels(void)
  * samples/sec) to get samples per screen, and add one so rounding doesn't make us end a capture
  * before the end of the screen.
  *
- * XXX MAXWID is defined (in configure.ac) as: 1024*256=262144
- * On long time basis, this results in a sweep that does not fill the screen.
- * Under "worst conditions" - 44,1 kHz sampling rate and 2s/div - we need 882000 samples
- * for a full screen.
+ * Slow timebases need a lot of them - 882000 at 44.1 kHz and 2 s/div - but the sweep buffers are
+ * deep buffers (see deep.c), which only take memory for what has been captured so far.
  */
 
 int samples(int rate)
 {
-    static unsigned long int r;
-
-    r = rate * 10 * scope.scale / 1000 + 1;
-
-    if (r > MAXWID) {
-        r = MAXWID;
-    }
+    double r = (double) rate * 10 * scope.scale / 1000 + 1;
 
-    return r;
+    return (r > MAXWID) ? MAXWID : r;
 }
 
 /* scaledown/roundoff/scaleup: scale numbers like a scope does
@@ -363,12 +386,200 @@ void datasrc_close(void)
                 }
             }
         }
+
+        datasrc_stop(datasrc);
     }
 
+    acquire_release();
+
     datasrc = NULL;
     datasrci = -1;
 }
 
+/* Show the first one or two channels of the data source on the first two display channels, if
+ * they're free
+ */
+
+void datasrc_show_channels(void)
+{
+    /* If data sources has a channel, show it. */
+
+    if ((ch[0].signal == NULL) && (datasrc->nchans() > 0)) {
+        ch[0].show = 1;
+        recall_on_channel(datasrc->chan(0), &ch[0]);
+    }
+
+    /* If data sources has a second channel, show it.  Older versions did. */
+
+    if ((ch[1].signal == NULL) && (datasrc->nchans() > 1)) {
+        ch[1].show = 1;
+        recall_on_channel(datasrc->chan(1), &ch[1]);
+    }
+}
+
+/* Capture timestamps (Signal.stamp) are in ns of CLOCK_MONOTONIC, so that they can be compared
+ * across data sources and with the time they get drawn
+ */
+
+long long monotonic_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* The time of the sample 'n' samples at 'rate' after (or before, if 'n' is negative) one sampled at
+ * 'when'
+ */
+
+long long stamp_add(long long when, long long n, int rate)
+{
+    return (rate > 0) ? when + n * 1000000000LL / rate : when;
+}
+
+/* Call before writing into sig->data.  A memory that stored sig (see save()) just holds a reference
+ * to its buffer, so if that's still the case the signal moves on to a buffer of its own, taking the
+ * first 'keep' samples along, and the memory keeps the sweep as it was when it was stored.
+ */
+
+void signal_writable(Signal *sig, int keep)
+{
+    size_t size = sample_size(sig->type);
+    void *fresh;
+
+    if (!deep_shared(sig->data))
+        return;
+
+    fresh = deep_alloc((size_t) sig->width * size);
+    if (keep > 0) {
+        memcpy(fresh, sig->data, (size_t) min(keep, sig->width) * size);
+    }
+    deep_free(sig->data);
+    sig->data = fresh;
+}
+
+/* One of the two status lines with a data source's counters, for its status_str(6) and (7) */
+
+const char * datasrc_stats_str(const DataSrcStats *stats, int line)
+{
+    static char string[2][32];
+
+    if (line == 0) {
+        snprintf(string[0], sizeof(string[0]), "%lu trig %lu xrun", stats->triggers, stats->xruns);
+    } else {
+        snprintf(string[1], sizeof(string[1]), "%lu drop %llu skip", stats->dropped,
+                 stats->skipped);
+    }
+    return string[line != 0];
+}
+
+/* The second generation DataSrc functions, or what a data source that doesn't have them does
+ * instead.  See the end of the DataSrc structure in xoscope.h.
+ */
+
+void datasrc_configure(DataSrc *src)
+{
+    if (src->configure) {
+        src->configure();
+    } else {
+        src->reset();
+    }
+}
+
+/* Size the sweeps of the listened-to channels to the number of samples needed to fill the screen
+ * at their rates.  The rate fields are only valid after datasrc_configure().  A data source without
+ * set_chan_width() has one width for all its channels, so the first listened-to channel decides.
+ * Only bother the data source if a width actually changes, since set_width() reallocates all the
+ * sweep buffers.
+ */
+
+void datasrc_set_widths(DataSrc *src)
+{
+    int i, j, width;
+    Signal *sig;
+
+    for (i = 0; i < src->nchans(); i++) {
+        sig = src->chan(i);
+        if (sig->listeners == 0) {
+            continue;
+        }
+        width = samples(sig->rate);
+
+        if (src->set_chan_width) {
+            if ((sig->width != width) || (sig->data == NULL)) {
+                src->set_chan_width(i, width);
+            }
+            continue;
+        }
+
+        if (src->set_width == NULL) {
+            return;
+        }
+        for (j = 0; j < src->nchans(); j++) {
+            if ((src->chan(j)->width != width) || (src->chan(j)->data == NULL)) {
+                src->set_width(width);
+                return;
+            }
+        }
+        return;
+    }
+}
+
+void datasrc_start(DataSrc *src)
+{
+    if (src->start) {
+        src->start();
+    } else {
+        src->reset();
+    }
+}
+
+void datasrc_stop(DataSrc *src)
+{
+    if (src->stop) {
+        src->stop();
+    }
+}
+
+/* Fill in up to 'nfds' descriptors to poll on, and return how many */
+
+int datasrc_pollfds(DataSrc *src, struct pollfd *fds, int nfds)
+{
+    if (src->pollfds) {
+        return src->pollfds(fds, nfds);
+    }
+    if ((nfds < 1) || ((fds[0].fd = src->fd()) < 0)) {
+        return 0;
+    }
+    fds[0].events = POLLIN;
+    return 1;
+}
+
+int datasrc_interval(DataSrc *src)
+{
+    return src->interval ? src->interval() : 0;
+}
+
+const DataSrcCaps * datasrc_caps(DataSrc *src)
+{
+    /* What all the first generation data sources in the tree can do */
+    static const DataSrcCaps v1 = { 0, 0, 0, 0, 1, 1 };
+
+    return src->caps ? src->caps() : &v1;
+}
+
+/* Say so if we're recording (-e) but the data source can't give the recorder anything */
+
+void datasrc_check_record(void)
+{
+    if (record_active() && (datasrc != NULL) && !datasrc_caps(datasrc)->records) {
+        snprintf(error, sizeof(error), "%s can't be recorded, nothing goes to the -e file",
+                 datasrc->name);
+        message(error);
+    }
+}
+
 int datasrc_open(DataSrc *new_datasrc)
 {
     int i;
@@ -384,19 +595,12 @@ int datasrc_open(DataSrc *new_datasrc)
             if (datasrc == datasrcs[i]) datasrci = i;
         }
 
-        /* All data sources have at least one channel.  Show it. */
-
-        if (ch[0].signal == NULL) {
-            ch[0].show = 1;
-            recall_on_channel(datasrc->chan(0), &ch[0]);
+        if (scope.threaded) {
+            datasrc = acquire_wrap(datasrc);
         }
 
-        /* If data sources has a second channel, show it.  Older versions did. */
-
-        if ((ch[1].signal == NULL) && (datasrc->nchans() > 1)) {
-            ch[1].show = 1;
-            recall_on_channel(datasrc->chan(1), &ch[1]);
-        }
+        datasrc_show_channels();
+        datasrc_check_record();
 
         return 1;
 
@@ -424,24 +628,16 @@ void datasrc_force_open(DataSrc *new_datasrc)
         if (datasrc == datasrcs[i]) datasrci = i;
     }
 
-    /* If data sources has a channel, show it. */
-
-    /* XXX problem here - if data source requires options to be set before it can open properly,
-     * nchans() won't return anything valid yet
-     */
-
-    if ((ch[0].signal == NULL) && (datasrc->nchans() > 0)) {
-        ch[0].show = 1;
-        recall_on_channel(datasrc->chan(0), &ch[0]);
+    if (scope.threaded) {
+        datasrc = acquire_wrap(datasrc);
     }
 
-    /* If data sources has a second channel, show it.  Older versions did. */
-
-    if ((ch[1].signal == NULL) && (datasrc->nchans() > 1)) {
-        ch[1].show = 1;
-        recall_on_channel(datasrc->chan(1), &ch[1]);
-    }
+    /* If a data source requires options to be set before it can open properly, nchans() won't
+     * return anything valid yet; handle_opt() tries again after each of them.
+     */
 
+    datasrc_show_channels();
+    datasrc_check_record();
 }
 
 /* Find the first valid datasrc; should only be called once return TRUE if successful; FALSE if no
@@ -548,7 +744,7 @@ void handle_key(unsigned char c)
                 clear();                    /* need this in case other chan displays mem */
             }
             else {
-                set_save_pending(c);        /* remember to store channel as soon as a sweep is complete*/
+                set_save_pending(c);        /* store channel before the next get_data() */
             }
         }
         return;
@@ -764,6 +960,27 @@ void handle_key(unsigned char c)
             clear();
         }
         break;
+    case '|':                   /* cycle the trigger hysteresis band: 0, 2, 4, 8, 16 */
+        if (datasrc && datasrc->set_trigger) {
+            scope.trighyst = (scope.trighyst >= 16) ? 0 : max(scope.trighyst * 2, 2);
+            if (scope.trige) {
+                datasrc->set_trigger(scope.trigch, &scope.trig, scope.trige);
+            }
+            clear();
+        }
+        break;
+    case '<':                   /* move the trigger point left */
+        if (scope.pretrig > 0) {
+            scope.pretrig = max(scope.pretrig - 10, 0);
+            clear();
+        }
+        break;
+    case '>':                   /* move the trigger point right */
+        if ((scope.pretrig < 90) && datasrc && datasrc_caps(datasrc)->pretrigger) {
+            scope.pretrig = min(scope.pretrig + 10, 90);
+            clear();
+        }
+        break;
     case '(':
         if (datasrc && datasrc->change_rate && datasrc->change_rate(-1)) {
             in_progress = 0;
@@ -839,7 +1056,7 @@ void handle_key(unsigned char c)
             scope.run = 0;
         }
         if ((scope.run == 1) && datasrc) {
-            setinputfd(datasrc->fd());  /* were stopped, so now start */
+            listen_datasrc();           /* were stopped, so now start */
         }
         update_text();
         break;
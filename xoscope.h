@@ -10,6 +10,8 @@
 
 #include <gtk/gtk.h>            /* need GdkPoint below */
 #include <gtkdatabox_graph.h>
+#include <poll.h>               /* struct pollfd, for DataSrc pollfds() */
+#include "pyramid.h"            /* Pyramid, for SignalLine */
 
 #include "config.h"
 
@@ -24,7 +26,7 @@ extern char error[256];
 extern int quit_key_pressed;
 extern int clip;
 extern char *filename;
-extern int in_progress;
+extern __thread int in_progress;
 
 typedef struct Scope {          /* The oscilloscope */
     int plot_mode;              /* 0 - point; 1 - line; 2 - step */
@@ -38,10 +40,13 @@ typedef struct Scope {          /* The oscilloscope */
     int trigch;
     int trige;
     int trig;
+    int pretrig;                /* percent of the sweep shown before the trigger */
+    int trighyst;               /* trigger hysteresis band, in the same units as trig */
     int curs;
     int cursa;
     int cursb;
     int min_interval;
+    int threaded;               /* acquire data in a separate thread (see acquire.c) */
 } Scope;
 extern Scope scope;
 
@@ -54,22 +59,89 @@ typedef struct Signal {
     char name[16];              /* Textual name of this signal (for display) */
     char savestr[256];          /* String used in save files */
     int rate;                   /* sampling rate in samples/sec */
-#if SC_16BIT
     double volts;               /* millivolts per 320 sample values */
-#else
-    int volts;                  /* millivolts per 320 sample values */
-#endif
     int frame;                  /* Current frame number, for comparisons */
     int num;                    /* number of samples read from current frame */
     int delay;                  /* Delay, in ten-thousandths of samples */
     int listeners;              /* Number of things 'listening' to this Sig */
     int bits;                   /* number of valid bits - 0 for analog sig */
     int width;                  /* size of data[] in samples */
-    short *data;                /* the data samples */
+    union {                     /* the data samples, as 'type' says */
+        short *data;
+        int *data32;
+        float *dataf;
+    };
+    int resolution;             /* bits per sample value in data[]: 8 (or 0) or 16 */
+    long long stamp;            /* when data[0] was sampled, in ns of CLOCK_MONOTONIC; 0 if unknown */
+    int type;                   /* what the samples are stored as: SIG_S16, SIG_S32 or SIG_FLOAT */
 } Signal;
 
+/* Signal types.  The data sources always deliver SIG_S16, so that's what a Signal is unless it
+ * says otherwise; the math functions use the wider ones for results that would overflow a short
+ * (sum and difference of 16 bit channels) or need fractions (average).
+ */
+#define SIG_S16         0
+#define SIG_S32         1
+#define SIG_FLOAT       2
+
+static inline int sample_size(int type)
+{
+    return (type == SIG_S32) ? sizeof(int) : (type == SIG_FLOAT) ? sizeof(float) : sizeof(short);
+}
+
+/* Sample i of a Signal of any type, for code that isn't worth specializing per type */
+
+static inline double sample_value(const Signal *sig, int i)
+{
+    switch (sig->type) {
+    case SIG_S32:
+        return sig->data32[i];
+    case SIG_FLOAT:
+        return sig->dataf[i];
+    default:
+        return sig->data[i];
+    }
+}
+
+/* The display is laid out for 8 bit samples; this is how many sample values of a Signal make one
+ * of those
+ */
+#define SAMPLE_UNIT(sig) ((sig)->resolution > 8 ? 1 << ((sig)->resolution - 8) : 1)
+
+/* The most samples a sweep can have.  That's not what the buffers cost (see samples()), it only
+ * keeps sample counts, and the display's float coordinates, well inside what they can hold.
+ */
+#define MAXWID (1 << 26)
+
 extern Signal mem[26];          /* Memory channels */
 
+/* DataSrcStats - what a data source has had to do to keep up, counted from when it was first used.
+ * Every sweep that was started gets delivered unless an overrun or reset() cuts it short; delivered
+ * minus dropped is how many sweeps could have been seen.
+ */
+
+typedef struct DataSrcStats {
+    unsigned long xruns;        /* device overruns we had to recover from */
+    unsigned long long skipped; /* samples (per channel) thrown away without a trigger search */
+    unsigned long triggers;     /* sweeps started */
+    unsigned long delivered;    /* sweeps completed */
+    unsigned long dropped;      /* completed sweeps replaced before anybody could see them */
+} DataSrcStats;
+
+/* DataSrcCaps - what a data source can do, so the rest of the program doesn't have to find out by
+ * trying.  Zero means "don't know" for formats and rates.
+ */
+
+typedef struct DataSrcCaps {
+    unsigned int formats;       /* sample formats the device can deliver, bit 1<<SampleFormat */
+    int min_rate, max_rate;     /* the rates change_rate() can get to, equal if fixed */
+    int hw_trigger;             /* TRUE if set_trigger() programs the device itself */
+    int pretrigger;             /* TRUE if sweeps can start before the trigger (scope.pretrig) */
+    int records;                /* TRUE if every frame it takes in goes to the recorder (-e) */
+} DataSrcCaps;
+
+#define DATASRC_MAXFDS 8        /* most descriptors pollfds() can ask us to poll */
+
 typedef struct DataSrc {        /* A source of data samples */
 
     char *              name;
@@ -95,7 +167,8 @@ typedef struct DataSrc {        /* A source of data samples */
 
     /* sets the frame width (number of samples to capture per sweep) for all channels in the
      * DataSrc.  Success is indicated by the 'width' field changing in the DataSrc's Signal
-     * structures.  Can be NULL to indicate device does not support multiple frame widths.
+     * structures.  Can be NULL to indicate device does not support multiple frame widths.  Data
+     * sources whose channels can run at different rates also have set_chan_width() (below).
      */
     void                (* set_width)(int width);
 
@@ -171,6 +244,41 @@ typedef struct DataSrc {        /* A source of data samples */
      */
     void                (* gtk_options)(void);
 
+    /* Returns the data source's counters (see DataSrcStats above), or NULL if it doesn't keep any.
+     * Can be NULL.  The counters are also shown by status_str(6) and status_str(7).
+     */
+    const DataSrcStats * (* stats)(void);
+
+    /* The second generation interface.  Any of these can be NULL, so use them through the
+     * datasrc_*() functions in xoscope.c, which fall back on the functions above: reset() for
+     * configure() and start(), fd() for pollfds().
+     *
+     * configure() (re)opens the device with the current channel, trigger, rate and option settings
+     * and makes the rate and volts fields in the Signal structures valid, without starting a sweep.
+     * set_width() can then be called, and start() begins capturing into a fresh sweep, so a change
+     * of timebase costs one configure() instead of two reset()s.  reset() must still do both.
+     *
+     * stop() stops capturing until the next start(), when we switch to another data source.
+     *
+     * pollfds() fills in up to 'nfds' descriptors (fd and events) to poll(2) on, and returns how
+     * many it filled in; get_data() is called when any of them is ready.  interval() returns how
+     * often, in ms, get_data() should be called anyway, or 0 to wait for the descriptors (or
+     * SND_QUERY_INTERVALL, if there are none).
+     *
+     * caps() returns what the device can do, see DataSrcCaps above.
+     *
+     * set_chan_width() sets the frame width of just one channel.  Data sources that have it may
+     * give each channel its own rate, and get each listened-to channel sized for the timebase at
+     * that rate, see datasrc_set_widths().  The others get set_width() for the first one.
+     */
+    void                (* configure)(void);
+    void                (* start)(void);
+    void                (* stop)(void);
+    int                 (* pollfds)(struct pollfd *fds, int nfds);
+    int                 (* interval)(void);
+    const DataSrcCaps * (* caps)(void);
+    void                (* set_chan_width)(int chan, int width);
+
 } DataSrc;
 
 extern DataSrc *datasrc;
@@ -185,7 +293,10 @@ typedef struct SignalLine {
     GtkDataboxGraph *graph;
     gfloat *X;
     gfloat *Y;
-    short *data;
+    gfloat *data;               /* the samples (or bits) behind Y, whatever the Signal's type */
+    Pyramid pyramid;            /* min/max of data[], for drawing it a pixel column at a time */
+    double spp;                 /* samples per pixel column in X/Y, or 0 for a point per sample */
+    int points;                 /* number of points in X/Y */
     double x_offset;
     double y_offset;
     double y_scale;
@@ -216,9 +327,22 @@ int     samples(int);
 void    loadfile(char *);
 void    savefile(char *);
 const char *    split_field(const char *, int, int);
+long long       monotonic_ns(void);
+long long       stamp_add(long long, long long, int);
+void    signal_writable(Signal *, int);
 
 int     datasrc_byname(char *);
 void    datasrc_force_open(DataSrc *);
+void    datasrc_show_channels(void);
+const char * datasrc_stats_str(const DataSrcStats *, int);
+void    datasrc_configure(DataSrc *);
+void    datasrc_set_widths(DataSrc *);
+void    datasrc_start(DataSrc *);
+void    datasrc_stop(DataSrc *);
+int     datasrc_pollfds(DataSrc *, struct pollfd *, int);
+int     datasrc_interval(DataSrc *);
+const DataSrcCaps * datasrc_caps(DataSrc *);
+void    datasrc_check_record(void);
 
 double  roundoff(double, double);
 
@@ -230,5 +354,5 @@ const gpointer int_to_int_pointer(int);
 extern char serial_error[];
 
 /* Functions defined in display library specific files */
-void    setinputfd(int);
+void    setinputfds(struct pollfd *, int);
 void    settimeout(int);
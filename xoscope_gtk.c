@@ -963,6 +963,9 @@ static GtkItemFactoryEntry menu_items[] = {
     {"/Trigger/sep", NULL, NULL, 0, "<Separator>"},
     {"/Trigger/Position up", "=", hit_key, '=', NULL},
     {"/Trigger/Position down", "-", hit_key, '-', NULL},
+    {"/Trigger/Hysteresis", "bar", hit_key, '|', NULL},
+    {"/Trigger/Pre-trigger less", "less", hit_key, '<', NULL},
+    {"/Trigger/Pre-trigger more", "greater", hit_key, '>', NULL},
     {"/Trigger/Position Positive", NULL, NULL, 0, "<Branch>"},
     {"/Trigger/Position Positive/120", NULL, set_trigger_level, 120, NULL},
     {"/Trigger/Position Positive/112", NULL, set_trigger_level, 112, NULL},
@@ -1546,9 +1549,9 @@ void inputCallback(gpointer data, gint source, GdkInputCondition condition)
     animate(NULL);
 }
 
-static int input_fd = -1;
-static int input_tag_valid = 0;
-static gint input_tag;
+static struct pollfd input_fds[DATASRC_MAXFDS];
+static int input_nfds = 0;
+static gint input_tags[DATASRC_MAXFDS];
 
 static int timeout_tag_valid = 0;
 static gint timeout_tag;
@@ -1582,22 +1585,39 @@ void settimeout(int ms)
     timeout_tag_valid = 1;
 }
 
-void setinputfd(int fd)
+/* Call animate() whenever one of the 'nfds' descriptors in 'fds' is ready, and no longer for the
+ * ones we were given before
+ */
+
+void setinputfds(struct pollfd *fds, int nfds)
 {
-    if (input_fd != fd) {
+    GdkInputCondition condition;
+    int i;
 
-        if (input_tag_valid) {
-            gdk_input_remove(input_tag);
-            input_tag_valid = 0;
+    nfds = min(nfds, DATASRC_MAXFDS);
+    for (i = 0; i < nfds; i++) {
+        if ((i >= input_nfds) || (fds[i].fd != input_fds[i].fd)
+            || (fds[i].events != input_fds[i].events)) {
+            break;
         }
+    }
+    if ((i == nfds) && (nfds == input_nfds)) {
+        return;
+    }
 
-        if (fd != -1) {
-            input_tag = gdk_input_add(fd, GDK_INPUT_READ, inputCallback, NULL);
-            input_tag_valid = 1;
-        }
+    for (i = 0; i < input_nfds; i++) {
+        gdk_input_remove(input_tags[i]);
+    }
 
-        input_fd = fd;
+    for (i = 0; i < nfds; i++) {
+        condition = 0;
+        if (fds[i].events & POLLIN) condition |= GDK_INPUT_READ;
+        if (fds[i].events & POLLOUT) condition |= GDK_INPUT_WRITE;
+        if (fds[i].events & POLLPRI) condition |= GDK_INPUT_EXCEPTION;
+        input_tags[i] = gdk_input_add(fds[i].fd, condition, inputCallback, NULL);
+        input_fds[i] = fds[i];
     }
+    input_nfds = nfds;
 }
 
 #ifndef HAVE_LIBCOMEDI